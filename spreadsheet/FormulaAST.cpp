@@ -1,9 +1,6 @@
 #include "FormulaAST.h"
 
-#include "FormulaBaseListener.h"
-#include "FormulaLexer.h"
-#include "FormulaParser.h"
-
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <memory>
@@ -67,377 +64,432 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
-class Expr {
-public:
-    virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const std::function<double(Position)>& args) const = 0;
-
-    // higher is tighter
-    virtual ExprPrecedence GetPrecedence() const = 0;
-
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                      bool right_child = false) const {
-        auto precedence = GetPrecedence();
-        auto mask = right_child ? PR_RIGHT : PR_LEFT;
-        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-        if (parens_needed) {
-            out << '(';
-        }
-
-        DoPrintFormula(out, precedence);
-
-        if (parens_needed) {
-            out << ')';
-        }
-    }
-};
-
 namespace {
-class BinaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        Add = '+',
-        Subtract = '-',
-        Multiply = '*',
-        Divide = '/',
-    };
-
-public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-        : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs))
-    {}
-
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+using Op = Instruction::Op;
+
+ExprPrecedence GetPrecedence(Op op) {
+    switch (op) {
+    case Op::Add:
+        return EP_ADD;
+    case Op::Subtract:
+        return EP_SUB;
+    case Op::Multiply:
+        return EP_MUL;
+    case Op::Divide:
+        return EP_DIV;
+    case Op::UnaryPlus:
+    case Op::UnaryMinus:
+        return EP_UNARY;
+    case Op::PushNumber:
+    case Op::LoadCell:
+    case Op::RangeSum:
+    case Op::RangeMin:
+    case Op::RangeMax:
+    case Op::Sum:
+    case Op::Average:
+    case Op::Min:
+    case Op::Max:
+        return EP_ATOM;
+    default:
+        // have to do this because VC++ has a buggy warning
+        assert(false);
+        return static_cast<ExprPrecedence>(INT_MAX);
     }
+}
 
-    ExprPrecedence GetPrecedence() const override {
-        switch (type_) {
-        case Add:
-            return EP_ADD;
-        case Subtract:
-            return EP_SUB;
-        case Multiply:
-            return EP_MUL;
-        case Divide:
-            return EP_DIV;
-        default:
-            // have to do this because VC++ has a buggy warning
-            assert(false);
-            return static_cast<ExprPrecedence>(INT_MAX);
-        }
-    }
+bool IsBinary(Op op) {
+    return op == Op::Add || op == Op::Subtract || op == Op::Multiply || op == Op::Divide;
+}
 
-    double Evaluate(const std::function<double(Position)>& args) const override {
-        // Скопируйте ваше решение из предыдущих уроков.
-        switch (type_) {
-        case Type::Add:
-            return (lhs_.get()->Evaluate(args) + rhs_.get()->Evaluate(args));
-            break;
-        case Type::Subtract:
-            return (lhs_.get()->Evaluate(args) - rhs_.get()->Evaluate(args));
-            break;
-        case Type::Multiply:
-            return (lhs_.get()->Evaluate(args) * rhs_.get()->Evaluate(args));
-            break;
-        case Type::Divide:
-            if (std::isfinite(lhs_.get()->Evaluate(args) / rhs_.get()->Evaluate(args))) {
-                return (lhs_.get()->Evaluate(args) / rhs_.get()->Evaluate(args));
-            }
-            else {
-                throw FormulaError(FormulaError::Category::Arithmetic);
-            }
-            break;
-        default:
-            throw FormulaError(FormulaError::Category::Value);
-            break;
-        }
-    }
+bool IsUnary(Op op) {
+    return op == Op::UnaryPlus || op == Op::UnaryMinus;
+}
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
-};
+bool IsFunction(Op op) {
+    return op == Op::Sum || op == Op::Average || op == Op::Min || op == Op::Max;
+}
 
-class UnaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        UnaryPlus = '+',
-        UnaryMinus = '-',
-    };
-
-public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-        : type_(type)
-        , operand_(std::move(operand))
-    {}
-
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
-        out << ')';
+const char* GetFunctionName(Op op) {
+    switch (op) {
+    case Op::Sum:
+        return "SUM";
+    case Op::Average:
+        return "AVG";
+    case Op::Min:
+        return "MIN";
+    case Op::Max:
+        return "MAX";
+    default:
+        assert(false);
+        return "?";
     }
+}
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+char GetSign(Op op) {
+    switch (op) {
+    case Op::Add:
+    case Op::UnaryPlus:
+        return '+';
+    case Op::Subtract:
+    case Op::UnaryMinus:
+        return '-';
+    case Op::Multiply:
+        return '*';
+    case Op::Divide:
+        return '/';
+    default:
+        assert(false);
+        return '?';
     }
+}
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_UNARY;
-    }
+}  // namespace
 
-    double Evaluate(const std::function<double(Position)>& args) const override {
-        // Скопируйте ваше решение из предыдущих уроков.
-        switch (type_) {
-        case Type::UnaryMinus:
-            return (-1.0) * operand_->Evaluate(args);
-            break;
-        default:
-            return operand_->Evaluate(args);
-            break;
-        }
+FunctionOps GetFunctionOps(std::string_view name) {
+    if (name == "SUM") {
+        return { Op::Sum, Op::RangeSum };
     }
-
-private:
-    Type type_;
-    std::unique_ptr<Expr> operand_;
-};
-
-class CellExpr final : public Expr {
-public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell)
-    {}
-
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
-        }
+    if (name == "AVG") {
+        return { Op::Average, Op::RangeSum };
     }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    if (name == "MIN") {
+        return { Op::Min, Op::RangeMin };
     }
+    assert(name == "MAX");
+    return { Op::Max, Op::RangeMax };
+}
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+RangeStats Aggregate(const double* values, size_t count) {
+    assert(count > 0);
+    constexpr size_t LANES = 4;
+    double sum[LANES] = {};
+    double min[LANES];
+    double max[LANES];
+    for (size_t lane = 0; lane < LANES; ++lane) {
+        min[lane] = max[lane] = values[0];
     }
 
-    double Evaluate(const std::function<double(Position)>& args) const override {
-        if (!cell_->IsValid())
-        {
-            throw FormulaError(FormulaError::Category::Ref);
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        for (size_t lane = 0; lane < LANES; ++lane) {
+            const double value = values[i + lane];
+            sum[lane] += value;
+            min[lane] = value < min[lane] ? value : min[lane];
+            max[lane] = value > max[lane] ? value : max[lane];
         }
-        return args(*cell_);
-    }
-
-private:
-    const Position* cell_;
-};
-
-class NumberExpr final : public Expr
-{
-public:
-    explicit NumberExpr(double value)
-        : value_(value)
-    {}
-
-    void Print(std::ostream& out) const override {
-        out << value_;
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
     }
-
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
-    }
-
-    double Evaluate(const std::function<double(Position)>& args) const override {
-        return value_;
+    for (; i < count; ++i) {
+        sum[0] += values[i];
+        min[0] = std::min(min[0], values[i]);
+        max[0] = std::max(max[0], values[i]);
     }
 
-private:
-    double value_;
-};
+    RangeStats stats;
+    stats.sum = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    stats.min = std::min(std::min(min[0], min[1]), std::min(min[2], min[3]));
+    stats.max = std::max(std::max(max[0], max[1]), std::max(max[2], max[3]));
+    stats.count = static_cast<double>(count);
+    return stats;
+}
 
-class ParseASTListener final : public FormulaBaseListener {
-public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
+}  // namespace ASTImpl
 
-        return root;
+void FormulaAST::PrintCells(std::ostream& out) const {
+    for (auto cell : GetCells()) {
+        out << cell.ToString() << ' ';
     }
+}
 
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+FormulaAST::Operands FormulaAST::FindOperands() const {
+    Operands operands;
+    operands.lhs.resize(program_size_);
+    operands.rhs.resize(program_size_);
+    operands.args_begin.resize(program_size_);
+    std::vector<uint32_t> stack;
+    for (uint32_t i = 0; i < program_size_; ++i) {
+        const auto& instruction = Program()[i];
+        const auto op = instruction.op;
+        if (ASTImpl::IsBinary(op)) {
+            operands.rhs[i] = stack.back();
+            stack.pop_back();
+            operands.lhs[i] = stack.back();
+            stack.back() = i;
+        }
+        else if (ASTImpl::IsUnary(op) || op == ASTImpl::Op::ScalarArgument) {
+            operands.lhs[i] = stack.back();
+            stack.back() = i;
+        }
+        else if (ASTImpl::IsFunction(op)) {
+            operands.args_begin[i] = static_cast<uint32_t>(operands.args.size());
+            operands.args.insert(operands.args.end(), stack.end() - instruction.arg, stack.end());
+            stack.resize(stack.size() - instruction.arg);
+            stack.push_back(i);
+        }
+        else {
+            stack.push_back(i);
+        }
     }
+    return operands;
+}
 
-public:
-    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-        assert(args_.size() >= 1);
-
-        auto operand = std::move(args_.back());
-
-        UnaryOpExpr::Type type;
-        if (ctx->SUB()) {
-            type = UnaryOpExpr::UnaryMinus;
+void FormulaAST::PrintNode(std::ostream& out, const Operands& operands, uint32_t node, Position offset) const {
+    const auto& instruction = Program()[node];
+    switch (instruction.op) {
+    case ASTImpl::Op::PushNumber:
+        out << Numbers()[instruction.arg];
+        break;
+    case ASTImpl::Op::LoadCell: {
+        const Position cell = Cells()[instruction.arg];
+        const Position pos{ cell.row + offset.row, cell.col + offset.col };
+        if (!pos.IsValid()) {
+            out << FormulaError::Category::Ref;
         } else {
-            assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
+            out << pos.ToString();
         }
-
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        break;
     }
-
-    void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-        double value = 0;
-        auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-        std::istringstream in(valueStr);
-        in >> value;
-        if (!in) {
-            throw ParsingError("Invalid number: " + valueStr);
-        }
-
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+    case ASTImpl::Op::RangeSum:
+    case ASTImpl::Op::RangeMin:
+    case ASTImpl::Op::RangeMax: {
+        const Range range = Ranges()[instruction.arg];
+        out << Range{ { range.top_left.row + offset.row, range.top_left.col + offset.col },
+                      { range.bottom_right.row + offset.row, range.bottom_right.col + offset.col } }
+                   .ToString();
+        break;
     }
-
-    void exitCell(FormulaParser::CellContext* ctx) override {
-        auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
-        if (!value.IsValid()) {
-            throw FormulaException("Invalid position: " + value_str);
+    case ASTImpl::Op::ScalarArgument:
+        PrintNode(out, operands, operands.lhs[node], offset);
+        break;
+    case ASTImpl::Op::Sum:
+    case ASTImpl::Op::Average:
+    case ASTImpl::Op::Min:
+    case ASTImpl::Op::Max:
+        out << '(' << ASTImpl::GetFunctionName(instruction.op);
+        for (uint32_t i = 0; i < instruction.arg; ++i) {
+            out << ' ';
+            PrintNode(out, operands, operands.args[operands.args_begin[node] + i], offset);
         }
-
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        out << ')';
+        break;
+    default:
+        out << '(' << ASTImpl::GetSign(instruction.op) << ' ';
+        PrintNode(out, operands, operands.lhs[node], offset);
+        if (ASTImpl::IsBinary(instruction.op)) {
+            out << ' ';
+            PrintNode(out, operands, operands.rhs[node], offset);
+        }
+        out << ')';
+        break;
     }
+}
 
-    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-        assert(args_.size() >= 2);
-
-        auto rhs = std::move(args_.back());
-        args_.pop_back();
-
-        auto lhs = std::move(args_.back());
-
-        BinaryOpExpr::Type type;
-        if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
-        }
-        else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
-        }
-        else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
-        }
-        else {
-            assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
-        }
+void FormulaAST::PrintFormulaNode(std::ostream& out, const Operands& operands, uint32_t node, Position offset,
+                                  int parent_precedence, bool right_child) const {
+    using namespace ASTImpl;
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+    const auto& instruction = Program()[node];
+    if (instruction.op == Op::ScalarArgument) {
+        PrintFormulaNode(out, operands, operands.lhs[node], offset, parent_precedence, right_child);
+        return;
     }
-
-    void visitErrorNode(antlr4::tree::ErrorNode* node) override
-    {
-        throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
+    auto precedence = GetPrecedence(instruction.op);
+    auto mask = right_child ? PR_RIGHT : PR_LEFT;
+    bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+    if (parens_needed) {
+        out << '(';
     }
 
-private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
-};
-
-class BailErrorListener : public antlr4::BaseErrorListener {
-public:
-    void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
-                    size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
-                    std::exception_ptr /* e */
-                    ) override {
-        throw ParsingError("Error when lexing: " + msg);
+    if (IsBinary(instruction.op)) {
+        PrintFormulaNode(out, operands, operands.lhs[node], offset, precedence, false);
+        out << GetSign(instruction.op);
+        PrintFormulaNode(out, operands, operands.rhs[node], offset, precedence, /* right_child = */ true);
+    }
+    else if (IsUnary(instruction.op)) {
+        out << GetSign(instruction.op);
+        PrintFormulaNode(out, operands, operands.lhs[node], offset, precedence, false);
+    }
+    else if (IsFunction(instruction.op)) {
+        out << GetFunctionName(instruction.op) << '(';
+        for (uint32_t i = 0; i < instruction.arg; ++i) {
+            if (i > 0) {
+                out << ',';
+            }
+            // every argument is a complete expression
+            PrintFormulaNode(out, operands, operands.args[operands.args_begin[node] + i], offset, EP_ATOM, false);
+        }
+        out << ')';
+    }
+    else {
+        PrintNode(out, operands, node, offset);
     }
-};
-
-}  // namespace
-}  // namespace ASTImpl
-
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
-
-    ANTLRInputStream input(in);
-
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
-
-    CommonTokenStream tokens(&lexer);
-
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
-
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
-
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
-}
-
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
-}
 
-void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+    if (parens_needed) {
+        out << ')';
     }
 }
 
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    PrintNode(out, FindOperands(), static_cast<uint32_t>(program_size_ - 1), { 0, 0 });
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position offset) const {
+    PrintFormulaNode(out, FindOperands(), static_cast<uint32_t>(program_size_ - 1), offset,
+                     ASTImpl::EP_ATOM, false);
 }
 
-double FormulaAST::Execute(const std::function<double(Position)>& args) const {
-    return root_expr_->Evaluate(args);
+FormulaAST::Result FormulaAST::Execute(const double* cell_values, const ASTImpl::RangeStats* range_stats) const {
+    using ASTImpl::Op;
+
+    // small formulas run on a stack array, deep ones on the heap
+    constexpr size_t INLINE_STACK_SIZE = 32;
+    double inline_stack[INLINE_STACK_SIZE];
+    std::vector<double> heap_stack;
+    double* stack = inline_stack;
+    if (max_stack_depth_ > INLINE_STACK_SIZE) {
+        heap_stack.resize(max_stack_depth_);
+        stack = heap_stack.data();
+    }
+
+    // top points past the last value on the stack
+    double* top = stack;
+    for (const auto& instruction : GetProgram()) {
+        switch (instruction.op) {
+        case Op::PushNumber:
+            *top++ = Numbers()[instruction.arg];
+            break;
+        case Op::LoadCell:
+            *top++ = cell_values[instruction.arg];
+            break;
+        case Op::Add:
+            --top;
+            top[-1] += *top;
+            break;
+        case Op::Subtract:
+            --top;
+            top[-1] -= *top;
+            break;
+        case Op::Multiply:
+            --top;
+            top[-1] *= *top;
+            break;
+        case Op::Divide:
+            --top;
+            top[-1] /= *top;
+            if (!std::isfinite(top[-1])) {
+                return FormulaError(FormulaError::Category::Arithmetic);
+            }
+            break;
+        case Op::UnaryPlus:
+            break;
+        case Op::UnaryMinus:
+            top[-1] = -top[-1];
+            break;
+        case Op::ScalarArgument:
+            *top++ = 1;
+            break;
+        case Op::RangeSum:
+            *top++ = range_stats[instruction.arg].sum;
+            *top++ = range_stats[instruction.arg].count;
+            break;
+        case Op::RangeMin:
+            *top++ = range_stats[instruction.arg].min;
+            *top++ = range_stats[instruction.arg].count;
+            break;
+        case Op::RangeMax:
+            *top++ = range_stats[instruction.arg].max;
+            *top++ = range_stats[instruction.arg].count;
+            break;
+        case Op::Sum:
+        case Op::Average: {
+            double* pairs = top - 2 * instruction.arg;
+            double sum = 0;
+            double count = 0;
+            for (double* pair = pairs; pair != top; pair += 2) {
+                sum += pair[0];
+                count += pair[1];
+            }
+            top = pairs;
+            *top++ = instruction.op == Op::Sum ? sum : sum / count;
+            break;
+        }
+        case Op::Min:
+        case Op::Max: {
+            double* pairs = top - 2 * instruction.arg;
+            double result = pairs[0];
+            for (double* pair = pairs + 2; pair != top; pair += 2) {
+                result = instruction.op == Op::Min ? std::min(result, pair[0]) : std::max(result, pair[0]);
+            }
+            top = pairs;
+            *top++ = result;
+            break;
+        }
+        }
+    }
+    assert(top == stack + 1);
+    return *stack;
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+FormulaAST::FormulaAST(Span<const ASTImpl::Instruction> program, Span<const double> numbers,
+                       Span<const Position> cells, Span<const Range> ranges)
+    : numbers_size_(static_cast<uint32_t>(numbers.size()))
+    , program_size_(static_cast<uint32_t>(program.size()))
+    , ranges_size_(static_cast<uint32_t>(ranges.size())) {
+    static_assert(alignof(ASTImpl::Instruction) <= alignof(double)
+                  && sizeof(ASTImpl::Instruction) % alignof(Range) == 0
+                  && sizeof(Range) % alignof(Position) == 0);
+
+    storage_.reset(new std::byte[numbers.size() * sizeof(double)
+                                 + program.size() * sizeof(ASTImpl::Instruction)
+                                 + ranges.size() * sizeof(Range)
+                                 + cells.size() * sizeof(Position)]);
+    auto* numbers_begin = reinterpret_cast<double*>(storage_.get());
+    auto* program_begin = reinterpret_cast<ASTImpl::Instruction*>(
+        std::uninitialized_copy(numbers.begin(), numbers.end(), numbers_begin));
+    auto* ranges_begin = reinterpret_cast<Range*>(
+        std::uninitialized_copy(program.begin(), program.end(), program_begin));
+    auto* cells_begin = reinterpret_cast<Position*>(
+        std::uninitialized_copy(ranges.begin(), ranges.end(), ranges_begin));
+    auto* cells_end = std::uninitialized_copy(cells.begin(), cells.end(), cells_begin);
+
+    // keep every referenced cell once, in sorted order, to avoid sorting in
+    // GetReferencedCells, and point the loads at the deduplicated list
+    std::sort(cells_begin, cells_end);
+    cells_end = std::unique(cells_begin, cells_end);
+    cells_size_ = static_cast<uint32_t>(cells_end - cells_begin);
+
+    uint32_t depth = 0;
+    for (auto* instruction = program_begin; instruction != program_begin + program.size(); ++instruction) {
+        switch (instruction->op) {
+        case ASTImpl::Op::LoadCell:
+            instruction->arg = static_cast<uint32_t>(
+                std::lower_bound(cells_begin, cells_end, cells[instruction->arg]) - cells_begin);
+            [[fallthrough]];
+        case ASTImpl::Op::PushNumber:
+        case ASTImpl::Op::ScalarArgument:
+            max_stack_depth_ = std::max(max_stack_depth_, ++depth);
+            break;
+        case ASTImpl::Op::RangeSum:
+        case ASTImpl::Op::RangeMin:
+        case ASTImpl::Op::RangeMax:
+            depth += 2;
+            max_stack_depth_ = std::max(max_stack_depth_, depth);
+            break;
+        case ASTImpl::Op::Sum:
+        case ASTImpl::Op::Average:
+        case ASTImpl::Op::Min:
+        case ASTImpl::Op::Max:
+            assert(instruction->arg > 0 && depth >= 2 * instruction->arg);
+            depth -= 2 * instruction->arg - 1;
+            break;
+        case ASTImpl::Op::UnaryPlus:
+        case ASTImpl::Op::UnaryMinus:
+            break;
+        default:
+            --depth;
+            break;
+        }
+    }
+    assert(depth == 1);
 }
 
 FormulaAST::~FormulaAST() = default;
@@ -2,14 +2,86 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "span.h"
 
-#include <forward_list>
-#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <stdexcept>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl {
-class Expr;
-}
+
+// A formula is compiled into a program for a small stack machine: the
+// instructions of the expression tree are stored in postfix order, every
+// operand is pushed before the operation that consumes it.
+//
+// Every argument of an aggregate function leaves a (partial, count) pair on
+// the stack: the partial sum, minimum or maximum of the argument and the
+// number of values in it. The function then combines `arg` such pairs.
+struct Instruction {
+    enum class Op : uint8_t {
+        PushNumber,  // push numbers_[arg]
+        LoadCell,    // push the value of cells_[arg]
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        UnaryPlus,   // kept so that the formula prints the way it was written
+        UnaryMinus,
+        ScalarArgument,  // turn the value on top into the pair (value, 1)
+        RangeSum,        // push the pair (sum, count) of ranges_[arg]
+        RangeMin,        // push the pair (minimum, count) of ranges_[arg]
+        RangeMax,        // push the pair (maximum, count) of ranges_[arg]
+        Sum,             // combine `arg` pairs into one value
+        Average,
+        Min,
+        Max,
+    };
+
+    Op op;
+    uint32_t arg = 0;
+};
+
+// Growable buffers a parser collects a program in before it is copied into
+// a FormulaAST. Parsers keep them between formulas to reuse the capacity.
+struct ProgramBuffers {
+    std::vector<Instruction> program;
+    std::vector<double> numbers;
+    std::vector<Position> cells;
+    std::vector<Range> ranges;
+
+    void Clear() {
+        program.clear();
+        numbers.clear();
+        cells.clear();
+        ranges.clear();
+    }
+};
+
+// The operation of aggregate function `name` (SUM, AVG, MIN or MAX) and the
+// one that aggregates its range arguments.
+struct FunctionOps {
+    Instruction::Op function;
+    Instruction::Op range;
+};
+FunctionOps GetFunctionOps(std::string_view name);
+
+// Aggregates of the values of one range.
+struct RangeStats {
+    double sum = 0;
+    double min = 0;
+    double max = 0;
+    double count = 0;
+};
+
+// Aggregates `count` > 0 values stored contiguously. The loop keeps
+// independent accumulators, so the compiler can vectorize it.
+RangeStats Aggregate(const double* values, size_t count);
+
+}  // namespace ASTImpl
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
@@ -17,33 +89,87 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    // errors are returned as values, evaluation never throws
+    using Result = std::variant<double, FormulaError>;
+
+    // LoadCell arguments of `program` index `cells`, one entry per reference
+    // in the order they occur in the formula; Range* arguments index
+    // `ranges`. Everything is copied into one allocation owned by the formula.
+    explicit FormulaAST(Span<const ASTImpl::Instruction> program,
+                        Span<const double> numbers,
+                        Span<const Position> cells,
+                        Span<const Range> ranges = {});
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(const std::function<double(Position)>&) const;
+    // cell_values[i] is the value of GetCells()[i], range_stats[i] are the
+    // aggregates of GetRanges()[i]
+    Result Execute(const double* cell_values, const ASTImpl::RangeStats* range_stats = nullptr) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    // `offset` is added to every referenced cell, see FormulaTemplateCache
+    void PrintFormula(std::ostream& out, Position offset = { 0, 0 }) const;
+
+    // sorted and without duplicates
+    Span<const Position> GetCells() const {
+        return { Cells(), cells_size_ };
+    }
+
+    // in the order they occur in the formula
+    Span<const Range> GetRanges() const {
+        return { Ranges(), ranges_size_ };
+    }
 
-    std::forward_list<Position>& GetCells() {
-        return cells_;
+    Span<const double> GetNumbers() const {
+        return { Numbers(), numbers_size_ };
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    Span<const ASTImpl::Instruction> GetProgram() const {
+        return { Program(), program_size_ };
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // child instructions of every operation of program_, used for printing;
+    // the arguments of function `i` are args[args_begin[i]..][0..arg)
+    struct Operands {
+        std::vector<uint32_t> lhs;
+        std::vector<uint32_t> rhs;
+        std::vector<uint32_t> args_begin;
+        std::vector<uint32_t> args;
+    };
+    Operands FindOperands() const;
+    void PrintNode(std::ostream& out, const Operands& operands, uint32_t node, Position offset) const;
+    void PrintFormulaNode(std::ostream& out, const Operands& operands, uint32_t node, Position offset,
+                          int parent_precedence, bool right_child) const;
 
+    const double* Numbers() const {
+        return reinterpret_cast<const double*>(storage_.get());
+    }
+    const ASTImpl::Instruction* Program() const {
+        return reinterpret_cast<const ASTImpl::Instruction*>(Numbers() + numbers_size_);
+    }
+    const Range* Ranges() const {
+        return reinterpret_cast<const Range*>(Program() + program_size_);
+    }
     // physically stores cells so that they can be
     // efficiently traversed without going through
-    // the whole AST
-    std::forward_list<Position> cells_;
+    // the whole program
+    const Position* Cells() const {
+        return reinterpret_cast<const Position*>(Ranges() + ranges_size_);
+    }
+
+    // numbers, the program, the ranges and then the cells; the block may have
+    // a few unused cell slots at the end when the formula repeats references
+    std::unique_ptr<std::byte[]> storage_;
+    uint32_t numbers_size_ = 0;
+    uint32_t program_size_ = 0;
+    uint32_t ranges_size_ = 0;
+    uint32_t cells_size_ = 0;
+    // deepest evaluation stack the program needs
+    uint32_t max_stack_depth_ = 0;
 };
 
+// parse with the default backend, see formula_parser.h
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+FormulaAST ParseFormulaAST(std::string_view expression);
@@ -0,0 +1,471 @@
+#include "common.h"
+#include "formula.h"
+#include "formula_parser.h"
+#include "sheet.h"
+#include "sheet_snapshot.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+// Synthetic workloads for the spreadsheet. Every workload is deterministic
+// (fixed seeds), so runs can be compared between builds. Usage:
+//   spreadsheet_benchmark [name filter]
+// For every workload the suite prints throughput, per-operation latency
+// percentiles and the peak resident memory of the process so far.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// peak resident set size of the process in KiB, 0 if unknown
+long PeakMemoryKiB() {
+#if defined(__APPLE__)
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024;
+#elif defined(__unix__)
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#else
+    return 0;
+#endif
+}
+
+// Collects the duration of every operation of a workload.
+class Recorder {
+public:
+    template <typename Func>
+    void Measure(Func func) {
+        const auto start = Clock::now();
+        func();
+        latencies_.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+
+    const std::vector<double>& GetLatencies() const {
+        return latencies_;
+    }
+
+private:
+    std::vector<double> latencies_;
+};
+
+struct Workload {
+    std::string name;
+    // runs the workload and records its operations; everything outside
+    // Recorder::Measure() is preparation and is not measured
+    std::function<void(Recorder&)> run;
+};
+
+double Percentile(const std::vector<double>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    const size_t index = std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()));
+    return sorted[index];
+}
+
+void Report(const std::string& name, std::vector<double> latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    double total_us = 0;
+    for (double latency : latencies) {
+        total_us += latency;
+    }
+    const double ops_per_sec = total_us > 0 ? latencies.size() * 1e6 / total_us : 0;
+
+    std::cout << std::left << std::setw(34) << name << std::right
+              << std::setw(9) << latencies.size()
+              << std::setw(14) << std::fixed << std::setprecision(0) << ops_per_sec
+              << std::setprecision(2)
+              << std::setw(11) << Percentile(latencies, 0.5)
+              << std::setw(11) << Percentile(latencies, 0.9)
+              << std::setw(11) << Percentile(latencies, 0.99)
+              << std::setw(12) << (latencies.empty() ? 0 : latencies.back())
+              << std::setw(12) << PeakMemoryKiB() << '\n';
+}
+
+std::string Ref(Position pos) {
+    return pos.ToString();
+}
+
+// --- workloads ---
+
+constexpr int BULK_CELLS = 100000;
+constexpr int CHAIN_LENGTH = 10000;
+constexpr int FAN_WIDTH = 5000;
+constexpr int HOT_EDITS = 200;
+constexpr int PRINT_ROWS = 2000;
+constexpr int PRINT_COLS = 50;
+constexpr Size VIEW_SIZE{ 50, 30 };
+constexpr int PARSE_COUNT = 100000;
+constexpr int ERROR_ROWS = 10000;
+constexpr int ERROR_ROUNDS = 50;
+constexpr int RANGE_ROWS = 10000;
+constexpr int RANGE_FORMULAS = 200;
+constexpr size_t BATCH_SIZE = 1000;
+
+void BulkSetText(Recorder& recorder) {
+    Sheet sheet;
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> row(0, Position::MAX_ROWS - 1);
+    std::uniform_int_distribution<int> col(0, 999);
+    for (int i = 0; i < BULK_CELLS; ++i) {
+        const Position pos{ row(random), col(random) };
+        std::string text = "text" + std::to_string(i);
+        recorder.Measure([&] {
+            sheet.SetCell(pos, std::move(text));
+        });
+    }
+}
+
+void BulkSetFormulas(Recorder& recorder) {
+    Sheet sheet;
+    std::mt19937 random(2);
+    std::uniform_int_distribution<int> row(0, 999);
+    std::uniform_int_distribution<int> col(0, 99);
+    for (int i = 0; i < BULK_CELLS / 10; ++i) {
+        // inputs live in columns 0-99, formulas in 100-199, so no cycles
+        const Position pos{ i % 1000, 100 + i / 1000 };
+        std::string text = "=" + Ref({ row(random), col(random) }) + "*2+" + Ref({ row(random), col(random) });
+        recorder.Measure([&] {
+            sheet.SetCell(pos, std::move(text));
+        });
+    }
+}
+
+// the formulas of BulkSetFormulas, applied in batches of BATCH_SIZE edits;
+// one op is one batch
+void BatchSetFormulas(Recorder& recorder) {
+    Sheet sheet;
+    std::mt19937 random(2);
+    std::uniform_int_distribution<int> row(0, 999);
+    std::uniform_int_distribution<int> col(0, 99);
+    std::vector<std::pair<Position, std::string>> edits;
+    for (int i = 0; i < BULK_CELLS / 10; ++i) {
+        const Position pos{ i % 1000, 100 + i / 1000 };
+        edits.emplace_back(pos, "=" + Ref({ row(random), col(random) }) + "*2+" + Ref({ row(random), col(random) }));
+        if (edits.size() == BATCH_SIZE) {
+            recorder.Measure([&] {
+                sheet.SetCells(edits);
+            });
+            edits.clear();
+        }
+    }
+}
+
+// the same relative formula in every row, as after filling a column down
+void CopiedDownFormulas(Recorder& recorder) {
+    Sheet sheet;
+    for (int i = 0; i < BULK_CELLS / 10; ++i) {
+        const std::string row = std::to_string(i + 1);
+        std::string text = "=A" + row + "*B" + row + "+C" + row + "/2";
+        recorder.Measure([&] {
+            sheet.SetCell({ i, 3 }, std::move(text));
+        });
+    }
+}
+
+// A1 = 1, every next cell adds one to the previous; the head is edited and
+// the whole chain recalculated
+void LongChainRecalc(Recorder& recorder) {
+    Sheet sheet;
+    auto link = [](int i) {
+        return Position{ i % Position::MAX_ROWS, i / Position::MAX_ROWS };
+    };
+    sheet.SetCell(link(0), "1");
+    for (int i = 1; i < CHAIN_LENGTH; ++i) {
+        sheet.SetCell(link(i), "=" + Ref(link(i - 1)) + "+1");
+    }
+    sheet.Recalculate();
+    for (int edit = 0; edit < HOT_EDITS / 4; ++edit) {
+        recorder.Measure([&] {
+            sheet.SetCell(link(0), std::to_string(edit));
+            sheet.Recalculate();
+        });
+    }
+}
+
+// one formula per row reads FAN_WIDTH / 100 inputs, every input is read by
+// many formulas; inputs are edited one at a time
+void WideFanInRecalc(Recorder& recorder) {
+    Sheet sheet;
+    constexpr int inputs = 100;
+    for (int col = 0; col < inputs; ++col) {
+        sheet.SetCell({ 0, col }, std::to_string(col));
+    }
+    for (int row = 1; row <= FAN_WIDTH / 10; ++row) {
+        std::string text = "=";
+        for (int i = 0; i < 50; ++i) {
+            text += (i ? "+" : "") + Ref({ 0, (row + i * 7) % inputs });
+        }
+        sheet.SetCell({ row, 0 }, text);
+    }
+    sheet.Recalculate();
+    for (int edit = 0; edit < HOT_EDITS; ++edit) {
+        recorder.Measure([&] {
+            sheet.SetCell({ 0, edit % inputs }, std::to_string(edit));
+            sheet.Recalculate();
+        });
+    }
+}
+
+// FAN_WIDTH formulas read a single hot cell, which is edited repeatedly
+void HotCellFanOut(Recorder& recorder) {
+    Sheet sheet;
+    sheet.SetCell(Position{ 0, 0 }, "1");
+    for (int row = 1; row <= FAN_WIDTH; ++row) {
+        sheet.SetCell({ row, 1 }, "=A1*" + std::to_string(row));
+    }
+    sheet.Recalculate();
+    for (int edit = 0; edit < HOT_EDITS; ++edit) {
+        recorder.Measure([&] {
+            sheet.SetCell({ 0, 0 }, std::to_string(edit));
+            sheet.Recalculate();
+        });
+    }
+}
+
+void FillPrintSheet(Sheet& sheet) {
+    std::mt19937 random(3);
+    std::uniform_real_distribution<double> number(0, 1000);
+    for (int row = 0; row < PRINT_ROWS; ++row) {
+        for (int col = 0; col < PRINT_COLS; ++col) {
+            if (col % 5 == 4) {
+                sheet.SetCell({ row, col }, "=" + Ref({ row, col - 1 }) + "+" + Ref({ row, col - 2 }));
+            }
+            else if (col % 5 == 3) {
+                sheet.SetCell({ row, col }, "label" + std::to_string(row));
+            }
+            else {
+                sheet.SetCell({ row, col }, std::to_string(number(random)));
+            }
+        }
+    }
+    sheet.Recalculate();
+}
+
+void PrintValues(Recorder& recorder, size_t thread_count) {
+    Sheet sheet;
+    sheet.SetThreadCount(thread_count);
+    FillPrintSheet(sheet);
+    for (int i = 0; i < 10; ++i) {
+        std::ostringstream out;
+        recorder.Measure([&] {
+            sheet.PrintValues(out);
+        });
+    }
+}
+
+void PrintTexts(Recorder& recorder, size_t thread_count) {
+    Sheet sheet;
+    sheet.SetThreadCount(thread_count);
+    FillPrintSheet(sheet);
+    for (int i = 0; i < 10; ++i) {
+        std::ostringstream out;
+        recorder.Measure([&] {
+            sheet.PrintTexts(out);
+        });
+    }
+}
+
+// an interactive client: one edit, then the values of the visible area
+void EditAndView(Recorder& recorder) {
+    Sheet sheet;
+    FillPrintSheet(sheet);
+    std::vector<Cell::ValueView> values(VIEW_SIZE.rows * VIEW_SIZE.cols);
+    for (int edit = 0; edit < HOT_EDITS; ++edit) {
+        recorder.Measure([&] {
+            sheet.SetCell({ edit % VIEW_SIZE.rows, 0 }, std::to_string(edit));
+            sheet.GetValues({ 0, 0 }, VIEW_SIZE, { values.data(), values.size() });
+        });
+    }
+}
+
+// restarting with the print sheet: every text set again, then evaluated
+void ReplayTexts(Recorder& recorder) {
+    Sheet source;
+    FillPrintSheet(source);
+    std::vector<std::pair<Position, std::string>> texts;
+    for (int row = 0; row < PRINT_ROWS; ++row) {
+        for (int col = 0; col < PRINT_COLS; ++col) {
+            texts.emplace_back(Position{ row, col }, source.GetCell({ row, col })->GetText());
+        }
+    }
+    for (int i = 0; i < 5; ++i) {
+        recorder.Measure([&] {
+            Sheet sheet;
+            for (const auto& [pos, text] : texts) {
+                sheet.SetCell(pos, text);
+            }
+            sheet.Recalculate();
+        });
+    }
+}
+
+// restarting with the print sheet from a snapshot with the cached values
+void LoadSheetSnapshot(Recorder& recorder) {
+    Sheet source;
+    FillPrintSheet(source);
+    std::ostringstream out;
+    SaveSnapshot(source, out);
+    const std::string data = out.str();
+    for (int i = 0; i < 5; ++i) {
+        recorder.Measure([&] {
+            auto sheet = LoadSnapshot({ data.data(), data.size() });
+            sheet->Recalculate();
+        });
+    }
+}
+
+// a reporting job takes a snapshot while edits stream in; the first
+// snapshot, which walks the sheet, is taken before measuring
+void TakeSnapshotAndEdit(Recorder& recorder) {
+    Sheet sheet;
+    FillPrintSheet(sheet);
+    sheet.TakeSnapshot();
+    for (int edit = 0; edit < HOT_EDITS; ++edit) {
+        recorder.Measure([&] {
+            auto snapshot = sheet.TakeSnapshot();
+            sheet.SetCell({ edit % PRINT_ROWS, 0 }, std::to_string(edit));
+        });
+    }
+}
+
+std::vector<std::string> MakeFormulas() {
+    std::mt19937 random(4);
+    std::uniform_int_distribution<int> row(0, 9999);
+    std::uniform_int_distribution<int> col(0, 200);
+    std::vector<std::string> formulas;
+    for (int i = 0; i < PARSE_COUNT; ++i) {
+        formulas.push_back(Ref({ row(random), col(random) }) + "*(1.5+" + Ref({ row(random), col(random) })
+                           + ")/-" + std::to_string(i % 97 + 1));
+    }
+    return formulas;
+}
+
+void ParseSingleFormulas(Recorder& recorder, FormulaParserBackend backend) {
+    auto formulas = MakeFormulas();
+    const auto default_backend = GetDefaultFormulaParserBackend();
+    SetDefaultFormulaParserBackend(backend);
+    for (auto& formula : formulas) {
+        recorder.Measure([&] {
+            ParseFormula(std::move(formula));
+        });
+    }
+    SetDefaultFormulaParserBackend(default_backend);
+}
+
+// one operation is a batch of PARSE_COUNT formulas
+void ParseFormulaBatch(Recorder& recorder, size_t thread_count) {
+    const auto formulas = MakeFormulas();
+    for (int i = 0; i < 3; ++i) {
+        recorder.Measure([&] {
+            ParseFormulas(formulas, thread_count);
+        });
+    }
+}
+
+// Column A holds inputs, column B = A / E1 and column C = B + 1, so every
+// change of E1 recalculates 2 * ERROR_ROWS formulas; used to check that
+// sheets full of errors recalculate as fast as clean ones.
+void ErrorColumnRecalc(Recorder& recorder, const std::string& input, const std::string& factor) {
+    Sheet sheet;
+    sheet.SetCell(Position{ 0, 4 }, factor);
+    for (int row = 0; row < ERROR_ROWS; ++row) {
+        sheet.SetCell(Position{ row, 0 }, input);
+        sheet.SetCell(Position{ row, 1 }, "=" + Ref({ row, 0 }) + "/E1");
+        sheet.SetCell(Position{ row, 2 }, "=" + Ref({ row, 1 }) + "+1");
+    }
+    sheet.Recalculate();
+    for (int round = 0; round < ERROR_ROUNDS; ++round) {
+        recorder.Measure([&] {
+            // alternate between two values so that every round invalidates
+            sheet.SetCell(Position{ 0, 4 }, round % 2 ? factor : factor + "0");
+            sheet.Recalculate();
+        });
+    }
+}
+
+// RANGE_FORMULAS formulas aggregate windows of a column of RANGE_ROWS inputs;
+// every edit of an input recalculates the windows that cover it
+void RangeAggregateRecalc(Recorder& recorder) {
+    Sheet sheet;
+    for (int row = 0; row < RANGE_ROWS; ++row) {
+        sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+    }
+    const char* functions[] = { "SUM", "AVG", "MIN", "MAX" };
+    for (int i = 0; i < RANGE_FORMULAS; ++i) {
+        const int top = i * (RANGE_ROWS / RANGE_FORMULAS) / 2;
+        sheet.SetCell(Position{ i, 2 }, std::string("=") + functions[i % 4] + "("
+                      + Ref({ top, 0 }) + ":" + Ref({ top + RANGE_ROWS / 2 - 1, 0 }) + ")");
+    }
+    sheet.Recalculate();
+    for (int edit = 0; edit < HOT_EDITS; ++edit) {
+        recorder.Measure([&] {
+            sheet.SetCell(Position{ (edit * 7919) % RANGE_ROWS, 0 }, std::to_string(edit));
+            sheet.Recalculate();
+        });
+    }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    const std::string_view filter = argc > 1 ? argv[1] : "";
+
+    const std::vector<Workload> workloads = {
+        { "set_cell/text", BulkSetText },
+        { "set_cell/formula", BulkSetFormulas },
+        { "set_cell/batch_formula", BatchSetFormulas },
+        { "set_cell/copied_down_formula", CopiedDownFormulas },
+        { "recalc/long_chain", LongChainRecalc },
+        { "recalc/wide_fan_in", WideFanInRecalc },
+        { "recalc/hot_cell_fan_out", HotCellFanOut },
+        { "recalc/clean_column", [](Recorder& r) { ErrorColumnRecalc(r, "2", "4"); } },
+        { "recalc/value_error_column", [](Recorder& r) { ErrorColumnRecalc(r, "text", "4"); } },
+        { "recalc/arithmetic_error_column", [](Recorder& r) { ErrorColumnRecalc(r, "2", "0"); } },
+        { "recalc/range_aggregates", RangeAggregateRecalc },
+        { "view/edit_and_view", EditAndView },
+        { "print/values", [](Recorder& r) { PrintValues(r, 1); } },
+        { "print/values_4_threads", [](Recorder& r) { PrintValues(r, 4); } },
+        { "print/texts", [](Recorder& r) { PrintTexts(r, 1); } },
+        { "print/texts_4_threads", [](Recorder& r) { PrintTexts(r, 4); } },
+        { "startup/replay_texts", ReplayTexts },
+        { "startup/load_snapshot", LoadSheetSnapshot },
+        { "snapshot/take_and_edit", TakeSnapshotAndEdit },
+        { "parse/formula_antlr", [](Recorder& r) { ParseSingleFormulas(r, FormulaParserBackend::Antlr); } },
+        { "parse/formula_native", [](Recorder& r) { ParseSingleFormulas(r, FormulaParserBackend::Native); } },
+        { "parse/batch_1_thread", [](Recorder& r) { ParseFormulaBatch(r, 1); } },
+        { "parse/batch_4_threads", [](Recorder& r) { ParseFormulaBatch(r, 4); } },
+    };
+
+    std::cout << std::left << std::setw(34) << "workload" << std::right
+              << std::setw(9) << "ops"
+              << std::setw(14) << "ops/sec"
+              << std::setw(11) << "p50 us"
+              << std::setw(11) << "p90 us"
+              << std::setw(11) << "p99 us"
+              << std::setw(12) << "max us"
+              << std::setw(12) << "peak KiB" << '\n';
+    for (const auto& workload : workloads) {
+        if (workload.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        Recorder recorder;
+        workload.run(recorder);
+        Report(workload.name, recorder.GetLatencies());
+    }
+}
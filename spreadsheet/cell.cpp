@@ -1,240 +1,597 @@
 #include "cell.h"
 #include "sheet.h"
+#include "tsv_writer.h"
 
 #include <cassert>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <optional>
 #include <cmath>
 #include <memory>
+#include <mutex>
+#include <string_view>
+#include <utility>
+
+CellContents::CellContents(std::string_view text) {
+    assert(!text.empty());
+    if (text.size() > std::numeric_limits<uint32_t>::max()) {
+        throw std::length_error("Cell text is too long");
+    }
+    size_ = static_cast<uint32_t>(text.size());
+    // what formulas referencing the cell see; #VALUE! if there is no number
+    const auto number = ParseCellText(text[0] == ESCAPE_SIGN ? text.substr(1) : text);
+    char* chars;
+    if (number && text.size() <= NUMBER_TEXT_CAPACITY) {
+        kind_ = Kind::NUMBER_TEXT;
+        payload_.number_text.number = *number;
+        chars = payload_.number_text.chars;
+    }
+    else if (text.size() <= SHORT_TEXT_CAPACITY && !number) {
+        kind_ = Kind::SHORT_TEXT;
+        chars = payload_.short_text;
+    }
+    else {
+        kind_ = Kind::LONG_TEXT;
+        has_number_ = number.has_value();
+        payload_.long_text.number = number.value_or(0);
+        payload_.long_text.chars = chars = new char[text.size()];
+    }
+    std::memcpy(chars, text.data(), text.size());
+}
 
-class Cell::Impl {
-public:
-    virtual ~Impl() = default;
-    virtual CellInterface::Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
+CellContents::CellContents(FormulaTable::Id formula)
+    : kind_(Kind::FORMULA) {
+    payload_.formula = formula;
+}
 
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-    virtual void InvalidateCache() {
-        return;
+CellContents::CellContents(CellContents&& other) noexcept {
+    *this = std::move(other);
+}
+
+CellContents& CellContents::operator=(CellContents&& other) noexcept {
+    if (this != &other) {
+        Reset();
+        kind_ = other.kind_;
+        has_number_ = other.has_number_;
+        size_ = other.size_;
+        payload_ = other.payload_;
+        // the heap block and the formula id now belong to this one
+        other.kind_ = Kind::EMPTY;
+        other.has_number_ = false;
+        other.size_ = 0;
     }
-    virtual bool IsCached() const {
-        return true;
+    return *this;
+}
+
+CellContents::~CellContents() {
+    Reset();
+}
+
+void CellContents::Reset() {
+    if (kind_ == Kind::LONG_TEXT) {
+        delete[] payload_.long_text.chars;
     }
-};
+    kind_ = Kind::EMPTY;
+    has_number_ = false;
+    size_ = 0;
+}
 
-class Cell::EmptyImpl : public Impl
-{
-public:
-    EmptyImpl() = default;
+namespace {
 
-    CellInterface::Value GetValue() const override {
-        return 0.;
+// -0 and 0 differ for the formulas referencing a cell, 1/-0 is -inf
+bool IsSameNumber(double lhs, double rhs) {
+    return lhs == rhs && std::signbit(lhs) == std::signbit(rhs);
+}
+
+bool IsSameNumber(const FormulaInterface::Value& lhs, const FormulaInterface::Value& rhs) {
+    if (std::holds_alternative<double>(lhs) && std::holds_alternative<double>(rhs)) {
+        return IsSameNumber(std::get<double>(lhs), std::get<double>(rhs));
+    }
+    return lhs == rhs;
+}
+
+CellInterface::Value ToCellValue(const FormulaInterface::Value& value) {
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
     }
+    return std::get<FormulaError>(value);
+}
 
-    std::string GetText() const override {
-        return std::string();
+// the cached value of a formula, which is never a text
+FormulaInterface::Value ToFormulaValue(const CellInterface::Value& value) {
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
     }
+    return std::get<FormulaError>(value);
+}
+
+}  // namespace
+
+Cell::Cell(Sheet& sheet)
+    : sheet_(sheet)
+{}
+
+Cell::~Cell() {
+    Release(contents_);
+}
 
-    std::vector<Position> GetReferencedCells() const override {
+CellContents Cell::MakeContents(const std::string& text, Position pos) {
+    if (text.empty()) {
         return {};
     }
+    if (text[0] != FORMULA_SIGN || (text[0] == FORMULA_SIGN && text.size() == 1)) {
+        return MakeTextContents(text);
+    }
+    std::unique_ptr<FormulaInterface> formula;
+    try {
+        Instrumentation::Timer timer(sheet_.GetInstrumentation(), Phase::PARSE);
+        formula = ParseFormula(std::string{ text.begin() + 1, text.end() }, pos, sheet_.GetFormulaTemplates());
+    }
+    catch (...) {
+        throw FormulaException("Parsing error!");
+    }
+    sheet_.GetInstrumentation().AddAllocation(Allocation::FORMULA);
+    return CellContents(sheet_.GetFormulaTable().Add(std::move(formula), pos));
+}
+
+CellContents Cell::MakeTextContents(std::string_view text) const {
+    CellContents contents(text);
+    if (contents.GetKind() == CellContents::Kind::LONG_TEXT) {
+        sheet_.GetInstrumentation().AddAllocation(Allocation::LONG_TEXT);
+    }
+    return contents;
+}
 
-};
+void Cell::Install(CellContents contents) {
+    Release(contents_);
+    contents_ = std::move(contents);
+}
 
-class Cell::TextImpl : public Impl {
-public:
-    explicit TextImpl(std::string text)
-        : value_(std::move(text)) {
-        if (value_[0] == ESCAPE_SIGN) {
-            is_escaped_ = true;
+Cell::ValueChange Cell::Replace(CellContents contents) {
+    const std::optional<FormulaInterface::Value> old_number = GetKnownNumber();
+    Install(std::move(contents));
+    if (contents_.GetKind() == CellContents::Kind::FORMULA) {
+        if (!old_number) {
+            return ValueChange::CHANGED;
         }
+        GetFormulaRecord(contents_).cache = ToCellValue(*old_number);
+        return ValueChange::UNKNOWN;
+    }
+    // e.g. "2" replaced with "2.0", or an empty cell with "0"
+    if (old_number && IsSameNumber(*old_number, *GetKnownNumber())) {
+        return ValueChange::NONE;
     }
+    return ValueChange::CHANGED;
+}
 
-    CellInterface::Value GetValue() const override {
-        if (is_escaped_) {
-            return value_.substr(1, value_.size() - 1);
-        }
-        else {
-            return value_;
-        }
+std::optional<FormulaInterface::Value> Cell::GetKnownNumber() const {
+    if (!IsCacheValid()) {
+        return std::nullopt;
     }
+    if (contents_.GetKind() == CellContents::Kind::FORMULA) {
+        // without counting a cache hit
+        return ToFormulaValue(*GetFormulaRecord(contents_).cache);
+    }
+    return GetCellNumber(this);
+}
 
-    std::string GetText() const override {
-        return value_;
+void Cell::Release(CellContents& contents) {
+    if (contents.GetKind() == CellContents::Kind::FORMULA) {
+        sheet_.GetFormulaTable().Release(contents.GetFormula());
     }
+    contents = CellContents();
+}
+
+const FormulaTable::Record& Cell::GetFormulaRecord(const CellContents& contents) const {
+    assert(contents.GetKind() == CellContents::Kind::FORMULA);
+    return std::as_const(sheet_).GetFormulaTable().Get(contents.GetFormula());
+}
 
-    std::vector<Position> GetReferencedCells() const override {
+Span<const Position> Cell::GetReferencedCellsOf(const CellContents& contents) const {
+    if (contents.GetKind() != CellContents::Kind::FORMULA) {
         return {};
     }
+    return GetFormulaRecord(contents).formula->GetReferencedCellsView();
+}
 
-private:
-    std::string value_;
-    bool is_escaped_ = false;
-};
-
-
-class Cell::FormulaImpl : public Impl {
-public:
-    FormulaImpl(Sheet& sheet, std::string formula)
-        : sheet_(sheet), formula_(ParseFormula(formula))
-    {}
-
-    CellInterface::Value GetValue() const override {
-        if (!cache_) {
-            FormulaInterface::Value result = formula_->Evaluate(sheet_);
-            if (std::holds_alternative<double>(result)) {
-                if (std::isfinite(std::get<double>(result))) {
-                    return std::get<double>(result);
-                }
-                else {
-                    return FormulaError(FormulaError::Category::Arithmetic);
-                }
-            }
-            return std::get<FormulaError>(result);
-        }
-        return *cache_;
+std::vector<Range> Cell::GetReferencedRangesOf(const CellContents& contents) const {
+    if (contents.GetKind() != CellContents::Kind::FORMULA) {
+        return {};
     }
+    return GetFormulaRecord(contents).formula->GetReferencedRanges();
+}
 
-    std::string GetText() const override {
-        return { FORMULA_SIGN + formula_->GetExpression() };
+void Cell::Set(const std::string& text, Position pos) {
+    CellContents new_contents = MakeContents(text, pos);
+
+    const auto cur_ref_cells = GetReferencedCellsOf(new_contents);
+    const auto cur_ref_ranges = GetReferencedRangesOf(new_contents);
+    DependencyGraph& graph = sheet_.GetDependencyGraph();
+    bool creates_cycle = false;
+    if (!cur_ref_cells.empty() || !cur_ref_ranges.empty()) {
+        Instrumentation::Timer timer(sheet_.GetInstrumentation(), Phase::CYCLE_CHECK);
+        creates_cycle = graph.WouldCreateCycle(pos, cur_ref_cells, cur_ref_ranges);
+    }
+    if (creates_cycle) {
+        Release(new_contents);
+        throw CircularDependencyException("Circular dependency!");
+    }
+    const ValueChange change = Replace(std::move(new_contents));
+    graph.SetReferences(pos, cur_ref_cells, cur_ref_ranges);
+    PublishNumber(pos);
+    // referenced positions without a cell stay without one, the graph
+    // node is all they need until some text is set there
+    if (!IsCacheValid()) {
+        sheet_.MarkDirty(pos);
     }
+    // invalidate cache in all dependent cells
+    if (change != ValueChange::NONE) {
+        sheet_.InvalidateDependents({ &pos, 1 }, change == ValueChange::CHANGED);
+    }
+}
 
-    std::vector<Position> GetReferencedCells() const override {
-        return formula_.get()->GetReferencedCells();
+CellContents Cell::Stage(const std::string& text, Position pos) {
+    return MakeContents(text, pos);
+}
+
+Span<const Position> Cell::GetStagedReferencedCells(const CellContents& staged) const {
+    return GetReferencedCellsOf(staged);
+}
+
+std::vector<Range> Cell::GetStagedReferencedRanges(const CellContents& staged) const {
+    return GetReferencedRangesOf(staged);
+}
+
+Cell::ValueChange Cell::CommitStaged(CellContents staged, Position pos) {
+    const ValueChange change = Replace(std::move(staged));
+    PublishNumber(pos);
+    if (!IsCacheValid()) {
+        sheet_.MarkDirty(pos);
     }
+    return change;
+}
+
+void Cell::DiscardStaged(CellContents& staged) {
+    Release(staged);
+}
 
-    void InvalidateCache() override {
-        cache_.reset();
+const FormulaInterface* Cell::GetFormula() const {
+    if (contents_.GetKind() != CellContents::Kind::FORMULA) {
+        return nullptr;
     }
-    bool IsCached() const override {
-        return cache_.has_value();
+    return GetFormulaRecord(contents_).formula.get();
+}
+
+std::optional<CellInterface::Value> Cell::GetCachedValue() const {
+    if (contents_.GetKind() != CellContents::Kind::FORMULA || !IsCacheValid()) {
+        return std::nullopt;
     }
-private:
-    Sheet& sheet_;
-    std::unique_ptr<FormulaInterface> formula_;
-    std::optional<CellInterface::Value> cache_;
-};
+    return GetFormulaRecord(contents_).cache;
+}
 
-Cell::Cell(Sheet& sheet)
-    : impl_(std::make_unique<EmptyImpl>()),
-    sheet_(sheet)
-{}
+void Cell::RestoreText(std::string text, Position pos) {
+    assert(text.size() <= 1 || text[0] != FORMULA_SIGN);
+    Install(text.empty() ? CellContents() : MakeTextContents(text));
+    PublishNumber(pos);
+}
 
-Cell::~Cell() {
-    if (impl_) {
-        impl_.reset(nullptr);
+void Cell::RestoreFormula(std::unique_ptr<FormulaInterface> formula, Position pos,
+                          std::optional<CellInterface::Value> cache) {
+    sheet_.GetInstrumentation().AddAllocation(Allocation::FORMULA);
+    Install(CellContents(sheet_.GetFormulaTable().Add(std::move(formula), pos, std::move(cache))));
+    PublishNumber(pos);
+    if (!IsCacheValid()) {
+        sheet_.MarkDirty(pos);
     }
 }
 
-void Cell::Set(const std::string& text, Position pos) {
-    std::unique_ptr<Impl> new_impl;
-   
-    if (text.empty()) {
-        new_impl = std::make_unique<EmptyImpl>();
+void Cell::PublishNumber(Position pos) {
+    // texts are known right away, formulas once they are evaluated
+    NumericColumns& numbers = sheet_.GetNumericColumns();
+    if (IsCacheValid()) {
+        const FormulaInterface::Value number = GetCellNumber(this);
+        if (std::holds_alternative<double>(number)) {
+            numbers.SetNumber(pos, std::get<double>(number));
+            return;
+        }
     }
-    else if (text[0] != FORMULA_SIGN || (text[0] == FORMULA_SIGN && text.size() == 1)) {
-        new_impl = std::make_unique<TextImpl>(text);
+    numbers.Invalidate(pos);
+}
+
+void Cell::Clear(const Position& pos) {
+    this->Set(std::string(), pos);
+}
+
+CellInterface::Value Cell::EvaluateFormula() const {
+    const FormulaTable::Record& record = GetFormulaRecord(contents_);
+    const FormulaTable::State state = record.state.load(std::memory_order_acquire);
+    if (state == FormulaTable::State::CLEAN) {
+        sheet_.CountCacheHit();
+        return *record.cache;
     }
-    else {
-        try {
-            new_impl = std::make_unique<FormulaImpl>(sheet_, std::string{ text.begin() + 1, text.end() });
-        }
-        catch (...) {
-            throw FormulaException("Parsing error!");
-        }
-    } 
-    
-    const auto cur_ref_cells = new_impl->GetReferencedCells();
-    if (!cur_ref_cells.empty()) {
-        // save all visited cells from all function calls for this Cell::Set iteration
-        std::unordered_set<const Cell*, PositionHasher> visited;
-        if (CheckCyclicDependencies(cur_ref_cells, pos, visited)) {
-            throw CircularDependencyException("Circular dependency!");
-        }      
-    }  
-    std::unique_ptr<Impl> old_impl = std::move(impl_);
-    impl_ = std::move(new_impl);
-
-    //For each ref cell, clear the reference from dependent_cells about the current cell
-    for (const auto& pos_of_old_ref_cell : old_impl.get()->GetReferencedCells()) {
-        Cell* refrenced = sheet_.GetConcreteCell(pos_of_old_ref_cell);
-        refrenced->dependent_cells_.erase(this);
-    }
-    //set new reference in dependent_cells_ of referenced cells
-    for (const auto& pos_of_new_ref_cell : impl_->GetReferencedCells()) {
-
-        Cell* refrenced = sheet_.GetConcreteCell(pos_of_new_ref_cell);
-
-        if (!refrenced) {
-            sheet_.SetCell(pos_of_new_ref_cell, std::string());
-            refrenced = sheet_.GetConcreteCell(pos_of_new_ref_cell);
+    // the stale cells it depends on first, without recursion; this one is
+    // evaluated last, through UpdateCache()
+    const Cell* self = this;
+    sheet_.EvaluateWithPrecedents({ &self, 1 });
+    return *record.cache;
+}
+
+void Cell::UpdateCache() const {
+    if (contents_.GetKind() != CellContents::Kind::FORMULA) {
+        return;
+    }
+    const FormulaTable::Record& record = GetFormulaRecord(contents_);
+    std::lock_guard lock(record.evaluation_mutex);
+    // another reader may have been evaluating it
+    switch (record.state.load(std::memory_order_acquire)) {
+    case FormulaTable::State::CLEAN:
+        return;
+    case FormulaTable::State::CHECK:
+        if (ConfirmCache(record)) {
+            return;
         }
-        refrenced->AddDependentCell(this);
+        break;
+    case FormulaTable::State::DIRTY:
+        break;
     }
-    // recursive invalidate cache in dependent cells
-    InvalidateCacheInDependentCells(dependent_cells_);
+    Recompute(record, /* notify = */ true);
 }
-void Cell::InvalidateCacheInDependentCells(const std::unordered_set<Cell*, PositionHasher>& dependent_cells) {
-    for (const auto& refrenced : dependent_cells) {
-        if (refrenced->IsCacheValid()) {
-            refrenced->InvalidateCache();
-            //The cache needs to be cleared for all cells that in any way depend on this one
-            refrenced->InvalidateCacheInDependentCells(refrenced->GetDependentCells());
-        }       
+
+// the caller holds record.evaluation_mutex, as for ConfirmCache() and
+// MarkClean()
+bool Cell::Recompute(const FormulaTable::Record& record, bool notify) const {
+    sheet_.CountCacheMiss(record.was_evaluated);
+
+    FormulaInterface::Value result = [this, &record] {
+        Instrumentation::Timer timer(sheet_.GetInstrumentation(), Phase::EVALUATION);
+        return record.formula->Evaluate(sheet_);
+    }();
+    if (std::holds_alternative<double>(result) && !std::isfinite(std::get<double>(result))) {
+        result = FormulaError(FormulaError::Category::Arithmetic);
+    }
+    // without a previous value the dependents are dirty already
+    const bool has_previous = record.cache.has_value();
+    const bool changed = has_previous && !IsSameNumber(ToFormulaValue(*record.cache), result);
+    if (has_previous && !changed) {
+        sheet_.CountUnchangedRecompute();
+    }
+    record.cache = ToCellValue(result);
+    // errors stay unknown in the numeric columns
+    if (std::holds_alternative<double>(*record.cache)) {
+        sheet_.GetNumericColumns().SetNumber(record.pos, std::get<double>(*record.cache));
+    }
+    record.was_evaluated = true;
+    // the dependents are told before the cache is published: whoever reads
+    // CLEAN without the lock may take it as unchanged (see
+    // FormulaTable::State)
+    if (changed && notify) {
+        sheet_.MarkDependentsChanged(record.pos);
     }
+    record.state.store(FormulaTable::State::CLEAN, std::memory_order_release);
+    return changed;
 }
 
-void Cell::Clear(const Position& pos) {
-    this->Set(std::string(), pos);
+bool Cell::ConfirmCache(const FormulaTable::Record& record) const {
+    // the cells of ranges are not looked at, they can be too many
+    if (!record.formula->GetReferencedRanges().empty()) {
+        return false;
+    }
+    // the referenced cells are up to date, and one that got a new value has
+    // marked this one dirty, unless Recalculate() evaluated it (see
+    // Sheet::IsRecalculating()); the one running now cannot end before
+    // this cell is unlocked
+    return !sheet_.IsRecalculating() && MarkClean(record);
+}
+
+bool Cell::MarkClean(const FormulaTable::Record& record) const {
+    FormulaTable::State expected = FormulaTable::State::CHECK;
+    if (!record.state.compare_exchange_strong(expected, FormulaTable::State::CLEAN, std::memory_order_acq_rel)) {
+        return false;
+    }
+    if (std::holds_alternative<double>(*record.cache)) {
+        sheet_.GetNumericColumns().SetNumber(record.pos, std::get<double>(*record.cache));
+    }
+    sheet_.CountCutOff();
+    return true;
 }
 
 Cell::Value Cell::GetValue() const {
-    return impl_->GetValue();
+    switch (contents_.GetKind()) {
+    case CellContents::Kind::EMPTY:
+        return 0.;
+    case CellContents::Kind::SHORT_TEXT:
+    case CellContents::Kind::NUMBER_TEXT:
+    case CellContents::Kind::LONG_TEXT:
+        return std::string(contents_.GetShownText());
+    case CellContents::Kind::FORMULA:
+        break;
+    }
+    return EvaluateFormula();
+}
+
+Cell::NumericValue Cell::GetNumericValue() const {
+    switch (contents_.GetKind()) {
+    case CellContents::Kind::EMPTY:
+        return 0.;
+    case CellContents::Kind::SHORT_TEXT:
+    case CellContents::Kind::NUMBER_TEXT:
+    case CellContents::Kind::LONG_TEXT:
+        if (auto number = contents_.GetNumber()) {
+            return *number;
+        }
+        return FormulaError(FormulaError::Category::Value);
+    case CellContents::Kind::FORMULA:
+        break;
+    }
+    CellInterface::Value value = EvaluateFormula();
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    return std::get<FormulaError>(value);
+}
+
+Cell::ValueView Cell::GetValueView() const {
+    switch (contents_.GetKind()) {
+    case CellContents::Kind::EMPTY:
+        return std::monostate();
+    case CellContents::Kind::SHORT_TEXT:
+    case CellContents::Kind::NUMBER_TEXT:
+    case CellContents::Kind::LONG_TEXT:
+        return contents_.GetShownText();
+    case CellContents::Kind::FORMULA:
+        break;
+    }
+    const CellInterface::Value value = EvaluateFormula();
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    return std::get<FormulaError>(value);
 }
 
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    return std::string(GetTextView());
+}
+
+std::string_view Cell::GetTextView() const {
+    switch (contents_.GetKind()) {
+    case CellContents::Kind::EMPTY:
+        return {};
+    case CellContents::Kind::SHORT_TEXT:
+    case CellContents::Kind::NUMBER_TEXT:
+    case CellContents::Kind::LONG_TEXT:
+        return contents_.GetText();
+    case CellContents::Kind::FORMULA:
+        break;
+    }
+    // the formula never changes, so the text stays valid for the lifetime
+    // of the record
+    const FormulaTable::Record& record = GetFormulaRecord(contents_);
+    std::call_once(record.text_once, [&record] {
+        record.text = FORMULA_SIGN + record.formula->GetExpression();
+    });
+    return record.text;
+}
+
+bool Cell::IsEmpty() const {
+    return contents_.GetKind() == CellContents::Kind::EMPTY;
+}
+
+void Cell::WriteValue(TsvWriter& out) const {
+    switch (contents_.GetKind()) {
+    case CellContents::Kind::EMPTY:
+        out.AppendNumber(0.);
+        return;
+    case CellContents::Kind::SHORT_TEXT:
+    case CellContents::Kind::NUMBER_TEXT:
+    case CellContents::Kind::LONG_TEXT:
+        out.Append(contents_.GetShownText());
+        return;
+    case CellContents::Kind::FORMULA:
+        break;
+    }
+    const CellInterface::Value value = EvaluateFormula();
+    if (std::holds_alternative<double>(value)) {
+        out.AppendNumber(std::get<double>(value));
+    }
+    else {
+        out.AppendError(std::get<FormulaError>(value));
+    }
+}
+
+void Cell::WriteText(TsvWriter& out) const {
+    out.Append(GetTextView());
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_.get()->GetReferencedCells();
+    return GetReferencedCellsView().ToVector();
 }
 
-std::unordered_set<Cell*, Cell::PositionHasher> Cell::GetDependentCells() const {
-    return dependent_cells_;
+Span<const Position> Cell::GetReferencedCellsView() const {
+    return GetReferencedCellsOf(contents_);
 }
-void Cell::AddDependentCell(Cell* pos) {
-    dependent_cells_.insert(pos);
+
+std::vector<Range> Cell::GetReferencedRanges() const {
+    return GetReferencedRangesOf(contents_);
 }
-bool Cell::CheckCyclicDependencies(const std::vector<Position>& referenced_cells, const Position& end, std::unordered_set<const Cell*, PositionHasher>& visited) const {
 
-    for (const auto& cell : referenced_cells) {
-        if (cell == end) {
-            return true;
-        }
-        const Cell* ref_cell_ptr = sheet_.GetConcreteCell(cell);
-        if (!visited.count(ref_cell_ptr)) {
-            visited.insert(ref_cell_ptr);
-
-            if (!ref_cell_ptr) {
-                sheet_.SetCell(cell, std::string());
-                ref_cell_ptr = sheet_.GetConcreteCell(cell);
-            }
-            
-            if (ref_cell_ptr->CheckCyclicDependencies(ref_cell_ptr->GetReferencedCells(), end, visited)) {
-                return true;
-            }
-        }
+void Cell::InvalidateCache(bool value_changed) {
+    if (contents_.GetKind() != CellContents::Kind::FORMULA) {
+        return;
     }
-    return false;
+    const FormulaTable::Record& record = GetFormulaRecord(contents_);
+    if (value_changed) {
+        record.state.store(FormulaTable::State::DIRTY, std::memory_order_relaxed);
+    }
+    else if (record.state.load(std::memory_order_relaxed) == FormulaTable::State::CLEAN) {
+        record.state.store(FormulaTable::State::CHECK, std::memory_order_relaxed);
+    }
+    sheet_.GetNumericColumns().Invalidate(record.pos);
 }
 
-void Cell::InvalidateCache() {
-    impl_->InvalidateCache();
+void Cell::MarkPrecedentChanged() const {
+    if (contents_.GetKind() != CellContents::Kind::FORMULA) {
+        return;
+    }
+    FormulaTable::State expected = FormulaTable::State::CHECK;
+    GetFormulaRecord(contents_).state.compare_exchange_strong(expected, FormulaTable::State::DIRTY,
+                                                              std::memory_order_relaxed);
 }
 
 bool Cell::IsCacheValid() const {
-    return impl_->IsCached();
+    return contents_.GetKind() != CellContents::Kind::FORMULA
+        || GetFormulaRecord(contents_).state.load(std::memory_order_acquire) == FormulaTable::State::CLEAN;
 }
 
+bool Cell::Refresh(bool precedent_changed) const {
+    if (contents_.GetKind() != CellContents::Kind::FORMULA) {
+        return false;
+    }
+    const FormulaTable::Record& record = GetFormulaRecord(contents_);
+    if (record.state.load(std::memory_order_acquire) == FormulaTable::State::CLEAN) {
+        return false;
+    }
+    std::lock_guard lock(record.evaluation_mutex);
+    // a reader that evaluated it meanwhile has notified the dependents
+    const FormulaTable::State state = record.state.load(std::memory_order_acquire);
+    if (state == FormulaTable::State::CLEAN
+        || (state == FormulaTable::State::CHECK && !precedent_changed && MarkClean(record))) {
+        return false;
+    }
+    return Recompute(record, /* notify = */ false);
+}
+
+PlaceholderCell& PlaceholderCell::Get() {
+    static PlaceholderCell placeholder;
+    return placeholder;
+}
+
+CellInterface::Value PlaceholderCell::GetValue() const {
+    return 0.;
+}
+
+CellInterface::NumericValue PlaceholderCell::GetNumericValue() const {
+    return 0.;
+}
+
+std::string PlaceholderCell::GetText() const {
+    return {};
+}
+
+std::string_view PlaceholderCell::GetTextView() const {
+    return {};
+}
+
+std::vector<Position> PlaceholderCell::GetReferencedCells() const {
+    return {};
+}
+
+Span<const Position> PlaceholderCell::GetReferencedCellsView() const {
+    return {};
+}
+
+void PlaceholderCell::WriteValue(TsvWriter& out) const {
+    out.AppendNumber(0.);
+}
@@ -2,14 +2,110 @@
 
 #include "common.h"
 #include "formula.h"
+#include "formula_table.h"
 
+#include <cstdint>
 #include <optional>
 #include <functional>
-#include <unordered_set>
+#include <string_view>
+#include <variant>
 
 class Sheet;
+class TsvWriter;
+
+// Contents of a cell as a compact tagged record: nothing, a text or the id
+// of a formula in the FormulaTable of the sheet, 24 bytes in all. Texts of
+// up to SHORT_TEXT_CAPACITY characters are stored inline, and so are the
+// texts of up to NUMBER_TEXT_CAPACITY characters that are numbers (see
+// ParseCellText), together with the number. Longer texts take a single heap
+// block and keep their number next to it. The record of a formula is not
+// owned, whoever drops formula contents releases its id (see Cell).
+class CellContents {
+public:
+    enum class Kind : uint8_t { EMPTY, SHORT_TEXT, NUMBER_TEXT, LONG_TEXT, FORMULA };
+    static constexpr size_t SHORT_TEXT_CAPACITY = 16;
+    static constexpr size_t NUMBER_TEXT_CAPACITY = 8;
+
+    CellContents() = default;
+    // `text` is not empty; throws std::length_error if it is 4 GiB or more
+    explicit CellContents(std::string_view text);
+    explicit CellContents(FormulaTable::Id formula);
+    CellContents(CellContents&& other) noexcept;
+    CellContents& operator=(CellContents&& other) noexcept;
+    ~CellContents();
+
+    Kind GetKind() const {
+        return kind_;
+    }
+    // for texts
+    std::string_view GetText() const {
+        switch (kind_) {
+        case Kind::SHORT_TEXT:
+            return { payload_.short_text, size_ };
+        case Kind::NUMBER_TEXT:
+            return { payload_.number_text.chars, size_ };
+        default:
+            return { payload_.long_text.chars, size_ };
+        }
+    }
+    // the text as its value shows it, without the escape sign
+    std::string_view GetShownText() const {
+        const std::string_view text = GetText();
+        return text[0] == ESCAPE_SIGN ? text.substr(1) : text;
+    }
+    // the number the text represents, if any
+    std::optional<double> GetNumber() const {
+        if (kind_ == Kind::NUMBER_TEXT) {
+            return payload_.number_text.number;
+        }
+        if (kind_ == Kind::LONG_TEXT && has_number_) {
+            return payload_.long_text.number;
+        }
+        return std::nullopt;
+    }
+    // for formulas
+    FormulaTable::Id GetFormula() const {
+        return payload_.formula;
+    }
+
+private:
+    void Reset();
+
+    Kind kind_ = Kind::EMPTY;
+    // for long texts
+    bool has_number_ = false;
+    // length of the text
+    uint32_t size_ = 0;
+    union Payload {
+        char short_text[SHORT_TEXT_CAPACITY];
+        struct {
+            double number;
+            char chars[NUMBER_TEXT_CAPACITY];
+        } number_text;
+        struct {
+            char* chars;
+            double number;
+        } long_text;
+        FormulaTable::Id formula;
+    } payload_{};
+};
+
+// A cell of a Sheet: its contents and the sheet, whose formula table holds
+// the formula and its cached value. Every CellInterface call is a switch
+// over the kind of the contents.
 class Cell : public CellInterface {
 public:
+    // what an edit of a cell means for the formulas that reference it
+    enum class ValueChange {
+        // they see the same value as before
+        NONE,
+        // they see a new value
+        CHANGED,
+        // the cell is a formula that kept its previous value; it marks them
+        // dirty when it is evaluated and the value turns out to differ
+        UNKNOWN,
+    };
+
     explicit Cell(Sheet& sheet);
     ~Cell();
 
@@ -17,39 +113,118 @@ public:
     void Clear(const Position&);
 
     CellInterface::Value GetValue() const override;
+    // without copying the text of text cells
+    CellInterface::NumericValue GetNumericValue() const override;
     std::string GetText() const override;
+    std::string_view GetTextView() const override;
     std::vector<Position> GetReferencedCells() const override;
+    Span<const Position> GetReferencedCellsView() const override;
+    std::vector<Range> GetReferencedRanges() const;
+    // GetValue() without copying: nothing for an empty cell, the shown text
+    // of a text cell, which stays valid until the cell is changed or erased,
+    // or the value of a formula
+    using ValueView = std::variant<std::monostate, std::string_view, double, FormulaError>;
+    ValueView GetValueView() const;
+    // same as GetTextView().empty()
+    bool IsEmpty() const;
+    // append GetValue() and GetText() to `out`; texts are not copied and
+    // numbers are formatted in place
+    void WriteValue(TsvWriter& out) const;
+    void WriteText(TsvWriter& out) const;
     
-    bool operator==(const Cell* other) {
-        return this == other;
-    }
-    class PositionHasher {
-    public:
-        size_t operator()(const Cell* cell) const {
-            if (cell == nullptr) {
-                return 0;
-            }
-            return static_cast<size_t>(hasher_(cell->GetText()));
-        }
-    private:
-        std::hash<std::string> hasher_;
-
-    };
-   
-    std::unordered_set<Cell*, PositionHasher> GetDependentCells() const;  
-    void InvalidateCache();
+    // Marks the cached value of a formula stale: DIRTY if `value_changed`,
+    // a referenced cell is known to have a new value, otherwise CHECK, if it
+    // was clean (see FormulaTable::State).
+    void InvalidateCache(bool value_changed = true);
+    // CHECK to DIRTY, called when a referenced formula is evaluated to a
+    // new value; may run on the recalculation threads
+    void MarkPrecedentChanged() const;
     bool IsCacheValid() const;
-    
-    void AddDependentCell(Cell* pos);
-    
+    // Brings the cache up to date when everything the cell references is:
+    // a formula in CHECK keeps its value unless `precedent_changed`, a dirty
+    // one is evaluated. Returns true if the value differs from the previous
+    // one, the dependents in CHECK are left to the caller then. Used by
+    // Sheet::Recalculate().
+    bool Refresh(bool precedent_changed) const;
+    // Brings the cache of a stale formula up to date, the cells it
+    // references must be up to date already. Used by
+    // Sheet::EvaluateWithPrecedents().
+    void UpdateCache() const;
+
+    // Batch edits (see Sheet::CommitBatch) set a cell in two steps. Stage()
+    // parses the new text into contents the caller keeps aside, throwing
+    // FormulaException like Set(); CommitStaged() installs them and
+    // DiscardStaged() drops them instead. Wiring the dependency graph and
+    // invalidating the dependents are left to the caller.
+    CellContents Stage(const std::string& text, Position pos);
+    Span<const Position> GetStagedReferencedCells(const CellContents& staged) const;
+    std::vector<Range> GetStagedReferencedRanges(const CellContents& staged) const;
+    ValueChange CommitStaged(CellContents staged, Position pos);
+    void DiscardStaged(CellContents& staged);
+
+    // the formula of a formula cell, nullptr for other cells
+    const FormulaInterface* GetFormula() const;
+    // the cached value of a formula cell; unlike GetValue() it neither
+    // evaluates nor counts a cache hit
+    std::optional<CellInterface::Value> GetCachedValue() const;
+
+    // Contents loaded from a snapshot (see snapshot.h), installed without
+    // parsing: a text that is not a formula, or a compiled formula with the
+    // value it had when saved, if any. Like CommitStaged(), the dependency
+    // graph is left to the caller.
+    void RestoreText(std::string text, Position pos);
+    void RestoreFormula(std::unique_ptr<FormulaInterface> formula, Position pos,
+                        std::optional<CellInterface::Value> cache);
+
 private:
-    class Impl;
-    class EmptyImpl;
-    class TextImpl;
-    class FormulaImpl;
-    std::unique_ptr<Impl> impl_;
+    CellContents contents_;
     Sheet& sheet_;
-    std::unordered_set<Cell*, PositionHasher> dependent_cells_;  
-    bool CheckCyclicDependencies(const std::vector<Position>&, const Position&, std::unordered_set<const Cell*, PositionHasher>& visited) const;
-    void InvalidateCacheInDependentCells(const std::unordered_set<Cell*, PositionHasher>& dependent_cells);
-};
\ No newline at end of file
+
+    CellContents MakeContents(const std::string& text, Position pos);
+    CellContents MakeTextContents(std::string_view text) const;
+    // replaces the contents, releasing the formula of the old ones
+    void Install(CellContents contents);
+    // Install() for an edit: a new formula keeps the value the cell had as
+    // its previous value, if it is known
+    ValueChange Replace(CellContents contents);
+    // the value formulas referencing the cell see, if it is known without
+    // evaluating anything
+    std::optional<FormulaInterface::Value> GetKnownNumber() const;
+    // releases the formula of `contents`, if any, and empties them
+    void Release(CellContents& contents);
+    const FormulaTable::Record& GetFormulaRecord(const CellContents& contents) const;
+    Span<const Position> GetReferencedCellsOf(const CellContents& contents) const;
+    std::vector<Range> GetReferencedRangesOf(const CellContents& contents) const;
+    // the cached value of a formula cell, evaluated unless it is current
+    CellInterface::Value EvaluateFormula() const;
+    // evaluates the formula, true if the value differs from the previous
+    // one; then the dependents in CHECK are marked dirty if `notify`
+    bool Recompute(const FormulaTable::Record& record, bool notify) const;
+    // tries to confirm the cache of a formula in CHECK whose referenced
+    // cells are up to date, true if none of them changed
+    bool ConfirmCache(const FormulaTable::Record& record) const;
+    // CHECK to CLEAN
+    bool MarkClean(const FormulaTable::Record& record) const;
+    // updates the sheet's numeric columns from the current contents
+    void PublishNumber(Position pos);
+};
+
+// What GetCell() returns for a position that formulas reference but that
+// holds no cell (see Sheet::GetCell()): empty text, value 0 and no
+// references. It is stateless, so one instance serves every sheet.
+class PlaceholderCell final : public CellInterface {
+public:
+    static PlaceholderCell& Get();
+
+    CellInterface::Value GetValue() const override;
+    CellInterface::NumericValue GetNumericValue() const override;
+    std::string GetText() const override;
+    std::string_view GetTextView() const override;
+    std::vector<Position> GetReferencedCells() const override;
+    Span<const Position> GetReferencedCellsView() const override;
+    // like Cell::WriteValue() of an empty cell
+    void WriteValue(TsvWriter& out) const;
+
+private:
+    PlaceholderCell() = default;
+};
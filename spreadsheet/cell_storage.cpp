@@ -0,0 +1,70 @@
+#include "cell_storage.h"
+#include "sheet.h"
+
+#include <cassert>
+
+int CellStorage::Block::CountTrailingZeros(uint64_t mask) {
+    assert(mask != 0);
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(mask);
+#else
+    int count = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        ++count;
+    }
+    return count;
+#endif
+}
+
+CellStorage::Block::~Block() {
+    for (uint64_t mask = occupied_; mask != 0; mask &= mask - 1) {
+        Slot(CountTrailingZeros(mask))->~Cell();
+    }
+}
+
+Cell* CellStorage::Find(Position pos) const {
+    auto it = blocks_.find(BlockKey(pos.row / BLOCK_SIZE, pos.col / BLOCK_SIZE));
+    if (it == blocks_.end()) {
+        return nullptr;
+    }
+    return it->second->Get(pos.row % BLOCK_SIZE, pos.col % BLOCK_SIZE);
+}
+
+Cell& CellStorage::FindOrCreate(Position pos, Sheet& sheet) {
+    auto& block = blocks_[BlockKey(pos.row / BLOCK_SIZE, pos.col / BLOCK_SIZE)];
+    if (!block) {
+        block = std::make_unique<Block>();
+        sheet.GetInstrumentation().AddAllocation(Allocation::CELL_BLOCK);
+    }
+    const int index = Block::Index(pos.row % BLOCK_SIZE, pos.col % BLOCK_SIZE);
+    if (!block->IsOccupied(index)) {
+        new (block->Slot(index)) Cell(sheet);
+        block->occupied_ |= uint64_t{ 1 } << index;
+        ++version_;
+    }
+    return *block->Slot(index);
+}
+
+void CellStorage::Erase(Position pos) {
+    auto it = blocks_.find(BlockKey(pos.row / BLOCK_SIZE, pos.col / BLOCK_SIZE));
+    if (it == blocks_.end()) {
+        return;
+    }
+    Block& block = *it->second;
+    const int index = Block::Index(pos.row % BLOCK_SIZE, pos.col % BLOCK_SIZE);
+    if (!block.IsOccupied(index)) {
+        return;
+    }
+    block.Slot(index)->~Cell();
+    ++version_;
+    block.occupied_ &= ~(uint64_t{ 1 } << index);
+    if (block.IsEmpty()) {
+        blocks_.erase(it);
+    }
+}
+
+const CellStorage::Block* CellStorage::FindBlock(int block_row, int block_col) const {
+    auto it = blocks_.find(BlockKey(block_row, block_col));
+    return it == blocks_.end() ? nullptr : it->second.get();
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <unordered_map>
+
+class Sheet;
+
+// Sparse cell grid. The sheet is split into BLOCK_SIZE x BLOCK_SIZE blocks
+// which are allocated on the first write and released when they become empty,
+// so memory usage is proportional to the number of populated blocks. Cells
+// are stored in place inside their block and never move, so Cell* stays valid
+// until the cell is erased.
+class CellStorage {
+public:
+    static constexpr int BLOCK_SIZE = 8;
+    static constexpr int BLOCK_CELLS = BLOCK_SIZE * BLOCK_SIZE;
+
+    class Block {
+    public:
+        Block() = default;
+        Block(const Block&) = delete;
+        Block& operator=(const Block&) = delete;
+        ~Block();
+
+        Cell* Get(int row_in_block, int col_in_block) {
+            const int index = Index(row_in_block, col_in_block);
+            return IsOccupied(index) ? Slot(index) : nullptr;
+        }
+        const Cell* Get(int row_in_block, int col_in_block) const {
+            const int index = Index(row_in_block, col_in_block);
+            return IsOccupied(index) ? Slot(index) : nullptr;
+        }
+
+        bool IsEmpty() const {
+            return occupied_ == 0;
+        }
+
+        // calls func(row_in_block, col_in_block, cell) for every stored cell
+        // in row-major order
+        template <typename Func>
+        void ForEach(Func func) const {
+            for (uint64_t mask = occupied_; mask != 0; mask &= mask - 1) {
+                int index = CountTrailingZeros(mask);
+                func(index / BLOCK_SIZE, index % BLOCK_SIZE, *Slot(index));
+            }
+        }
+
+    private:
+        friend class CellStorage;
+
+        static int Index(int row_in_block, int col_in_block) {
+            return row_in_block * BLOCK_SIZE + col_in_block;
+        }
+        static int CountTrailingZeros(uint64_t mask);
+
+        bool IsOccupied(int index) const {
+            return (occupied_ >> index) & 1;
+        }
+        Cell* Slot(int index) const {
+            return std::launder(reinterpret_cast<Cell*>(const_cast<unsigned char*>(storage_)) + index);
+        }
+
+        // cells are constructed in place where occupied_ says, the bitmap
+        // makes a per-cell std::optional flag unnecessary
+        alignas(Cell) unsigned char storage_[BLOCK_CELLS * sizeof(Cell)];
+        // bit i is set when slot i holds a cell
+        uint64_t occupied_ = 0;
+    };
+
+    CellStorage() = default;
+    CellStorage(const CellStorage&) = delete;
+    CellStorage& operator=(const CellStorage&) = delete;
+
+    Cell* Find(Position pos) const;
+    // returns the existing cell or constructs an empty one in place
+    Cell& FindOrCreate(Position pos, Sheet& sheet);
+    void Erase(Position pos);
+
+    const Block* FindBlock(int block_row, int block_col) const;
+
+    size_t GetBlockCount() const {
+        return blocks_.size();
+    }
+
+    // changes whenever a cell is created or erased, see
+    // SheetInterface::GetCellsVersion()
+    uint64_t GetVersion() const {
+        return version_;
+    }
+
+    // calls func(col, cell) for col in [0, cols) of the given row, cell is
+    // nullptr for empty positions; every block is looked up once per row
+    template <typename Func>
+    void ForEachInRow(int row, int cols, Func func) const {
+        const int block_row = row / BLOCK_SIZE;
+        const int row_in_block = row % BLOCK_SIZE;
+        for (int block_col = 0; block_col * BLOCK_SIZE < cols; ++block_col) {
+            const Block* block = FindBlock(block_row, block_col);
+            const int first_col = block_col * BLOCK_SIZE;
+            for (int col = first_col; col < std::min(cols, first_col + BLOCK_SIZE); ++col) {
+                func(col, block ? block->Get(row_in_block, col - first_col) : nullptr);
+            }
+        }
+    }
+
+    // calls func(pos, cell) for every stored cell of the range, looking up
+    // either the blocks the range covers or all the blocks, whichever is less
+    template <typename Func>
+    void ForEachInRange(const Range& range, Func func) const {
+        const int first_block_row = range.top_left.row / BLOCK_SIZE;
+        const int last_block_row = range.bottom_right.row / BLOCK_SIZE;
+        const int first_block_col = range.top_left.col / BLOCK_SIZE;
+        const int last_block_col = range.bottom_right.col / BLOCK_SIZE;
+        const auto visit = [&](Position origin, const Block& block) {
+            block.ForEach([&](int row_in_block, int col_in_block, const Cell& cell) {
+                const Position pos{origin.row + row_in_block, origin.col + col_in_block};
+                if (range.Contains(pos)) {
+                    func(pos, cell);
+                }
+            });
+        };
+        const size_t covered = static_cast<size_t>(last_block_row - first_block_row + 1)
+            * static_cast<size_t>(last_block_col - first_block_col + 1);
+        if (covered > blocks_.size()) {
+            for (const auto& [key, block] : blocks_) {
+                visit(BlockOrigin(key), *block);
+            }
+            return;
+        }
+        for (int block_row = first_block_row; block_row <= last_block_row; ++block_row) {
+            for (int block_col = first_block_col; block_col <= last_block_col; ++block_col) {
+                if (const Block* block = FindBlock(block_row, block_col)) {
+                    visit({block_row * BLOCK_SIZE, block_col * BLOCK_SIZE}, *block);
+                }
+            }
+        }
+    }
+
+    // calls func(pos, cell) for every stored cell, block by block
+    template <typename Func>
+    void ForEachCell(Func func) const {
+        for (const auto& [key, block] : blocks_) {
+            const Position origin = BlockOrigin(key);
+            block->ForEach([&](int row_in_block, int col_in_block, const Cell& cell) {
+                func(Position{origin.row + row_in_block, origin.col + col_in_block}, cell);
+            });
+        }
+    }
+
+private:
+    static uint32_t BlockKey(int block_row, int block_col) {
+        return (static_cast<uint32_t>(block_row) << 16) | static_cast<uint32_t>(block_col);
+    }
+    static Position BlockOrigin(uint32_t key) {
+        return { static_cast<int>(key >> 16) * BLOCK_SIZE, static_cast<int>(key & 0xFFFF) * BLOCK_SIZE };
+    }
+
+    std::unordered_map<uint32_t, std::unique_ptr<Block>> blocks_;
+    uint64_t version_ = 1;
+};
@@ -1,7 +1,11 @@
 #pragma once
 
+#include "span.h"
+
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -26,6 +30,24 @@ struct Position {
     static const Position NONE;
 };
 
+// Прямоугольный диапазон ячеек, включающий обе угловые ячейки, например A1:B3.
+struct Range {
+    Position top_left;
+    Position bottom_right;
+
+    bool operator==(const Range& rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    // Количество ячеек в диапазоне.
+    size_t GetCellCount() const;
+    std::string ToString() const;
+
+    // Диапазон с теми же ячейками, у которого top_left не правее и не ниже
+    // bottom_right.
+    static Range FromCorners(Position first, Position second);
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -100,11 +122,18 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Число, которое представляет видимый текст ячейки в формулах: текст из
+// цифр и точек, начало которого читается как число. Для другого текста
+// возвращает nullopt.
+std::optional<double> ParseCellText(std::string_view text);
+
 class CellInterface {
 public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
     // формулы
     using Value = std::variant<std::string, double, FormulaError>;
+    // Значение ячейки, как его видят формулы
+    using NumericValue = std::variant<double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
@@ -116,11 +145,23 @@ public:
     // редактирование. В случае текстовой ячейки это её текст (возможно,
     // содержащий экранирующие символы). В случае формулы - её выражение.
     virtual std::string GetText() const = 0;
+    // То же, что GetText(), но без копирования: строка принадлежит ячейке и
+    // действительна, пока ячейка не изменена или не удалена.
+    virtual std::string_view GetTextView() const = 0;
 
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+    // Тот же список без копирования; действителен, пока ячейка не изменена
+    // или не удалена.
+    virtual Span<const Position> GetReferencedCellsView() const = 0;
+
+    // Возвращает значение ячейки в виде числа для вычисления формул: число,
+    // ошибку формулы или ошибку #VALUE! для текста, который не является
+    // числом (см. ParseCellText). Реализация по умолчанию преобразует
+    // GetValue(), ячейки могут хранить готовое значение.
+    virtual NumericValue GetNumericValue() const;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
@@ -167,6 +208,26 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Версия набора ячеек таблицы. Меняется каждый раз, когда ячейка создаётся
+    // или удаляется, то есть когда указатели, полученные от GetCell(), могут
+    // стать недействительными. Пока версия не изменилась, эти указатели можно
+    // хранить и не искать ячейки заново. UNSTABLE_CELLS_VERSION означает, что
+    // таблица такой гарантии не даёт.
+    static constexpr uint64_t UNSTABLE_CELLS_VERSION = 0;
+    virtual uint64_t GetCellsVersion() const {
+        return UNSTABLE_CELLS_VERSION;
+    }
+
+    // Записывает в out значения ячеек диапазона range в виде чисел, по
+    // строкам, если все они уже известны: числа, тексты, являющиеся числами,
+    // и пустые ячейки (нули). Возвращает false, если среди ячеек есть ошибки,
+    // другие тексты или ещё не вычисленные формулы; тогда значения нужно
+    // получить через GetCell(). Реализация по умолчанию всегда возвращает
+    // false.
+    virtual bool GetRangeNumbers(const Range& range, double* out) const {
+        return false;
+    }
 };
 
 // Создаёт готовую к работе пустую таблицу.
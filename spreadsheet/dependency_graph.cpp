@@ -0,0 +1,331 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <cassert>
+
+void DependencyGraph::SetReferences(Position cell, Span<const Position> references, Span<const Range> ranges) {
+    auto existing = Find(cell);
+    if (!existing && references.empty() && ranges.empty()) {
+        return;
+    }
+    const NodeId node = existing ? *existing : FindOrCreate(cell);
+
+    // unlink the old references
+    std::vector<NodeId> old_precedents = std::move(nodes_[node].precedents);
+    nodes_[node].precedents.clear();
+    for (NodeId precedent : old_precedents) {
+        auto& dependents = nodes_[precedent].dependents;
+        auto it = std::find(dependents.begin(), dependents.end(), node);
+        assert(it != dependents.end());
+        *it = dependents.back();
+        dependents.pop_back();
+    }
+
+    // link the new ones
+    std::vector<NodeId> new_precedents;
+    new_precedents.reserve(references.size());
+    for (const Position& reference : references) {
+        const NodeId precedent = FindOrCreate(reference);
+        new_precedents.push_back(precedent);
+        nodes_[precedent].dependents.push_back(node);
+    }
+    nodes_[node].precedents = std::move(new_precedents);
+
+    RemoveRangeEdges(node);
+    for (const Range& range : ranges) {
+        AddRangeEdge(node, range);
+    }
+    // dropped references never break the ranks, new ones may
+    if (!references.empty() || !ranges.empty()) {
+        unranked_.push_back(node);
+    }
+
+    for (NodeId precedent : old_precedents) {
+        ReleaseIfUnused(precedent);
+    }
+    ReleaseIfUnused(node);
+}
+
+void DependencyGraph::Reserve(size_t node_count) {
+    index_.reserve(node_count);
+    nodes_.reserve(node_count);
+}
+
+std::optional<DependencyGraph::NodeId> DependencyGraph::Find(Position cell) const {
+    auto it = index_.find(PackPosition(cell));
+    if (it == index_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+bool DependencyGraph::HasDependents(Position cell) const {
+    auto node = Find(cell);
+    return node && !nodes_[*node].dependents.empty();
+}
+
+bool DependencyGraph::IsSelfReference(Position cell, Span<const Position> references, Span<const Range> ranges) {
+    if (std::find(references.begin(), references.end(), cell) != references.end()) {
+        return true;
+    }
+    for (const Range& range : ranges) {
+        if (range.Contains(cell)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool DependencyGraph::WouldCreateCycle(Position cell, Span<const Position> references,
+                                       Span<const Range> ranges) const {
+    if (IsSelfReference(cell, references, ranges)) {
+        return true;
+    }
+
+    RepairRanks();
+    const auto target = Find(cell);
+    const uint32_t target_rank = target ? ranks_[*target] : 0;
+    // everything that depends on `cell` ranks above it, and a path from it
+    // to one of the references never climbs above that reference
+    uint32_t bound = 0;
+    for (const Position& reference : references) {
+        if (auto node = Find(reference)) {
+            bound = std::max(bound, ranks_[*node]);
+        }
+    }
+    for (const Range& range : ranges) {
+        bound = std::max(bound, GetMaxRank(range));
+    }
+    if (bound <= target_rank) {
+        return false;
+    }
+
+    std::vector<Position> sorted_copy;
+    if (!std::is_sorted(references.begin(), references.end())) {
+        sorted_copy = references.ToVector();
+        std::sort(sorted_copy.begin(), sorted_copy.end());
+        references = sorted_copy;
+    }
+    // walk everything that depends on `cell` up to the bound: a cycle
+    // appears if one of those formulas is going to be referenced by it
+    NextEpoch();
+    stack_.clear();
+    auto visit = [this, bound](NodeId node) {
+        if (ranks_[node] <= bound && Visit(node)) {
+            stack_.push_back(node);
+        }
+    };
+    ForEachDependent(cell, visit);
+    while (!stack_.empty()) {
+        const NodeId node = stack_.back();
+        stack_.pop_back();
+        const Position pos = GetPosition(node);
+        if (std::binary_search(references.begin(), references.end(), pos)) {
+            return true;
+        }
+        for (const Range& range : ranges) {
+            if (range.Contains(pos)) {
+                return true;
+            }
+        }
+        ForEachDependent(node, visit);
+    }
+    return false;
+}
+
+bool DependencyGraph::HasCycleThrough(Span<const Position> cells) const {
+    // in_degrees_[node] counts the reached formulas that `node` still waits
+    // for; a node is reached when it is visited in this epoch
+    NextEpoch();
+    if (in_degrees_.size() < nodes_.size()) {
+        in_degrees_.resize(nodes_.size());
+    }
+    reached_.clear();
+    auto reach = [this](NodeId node) {
+        if (Visit(node)) {
+            in_degrees_[node] = 0;
+            reached_.push_back(node);
+        }
+    };
+    for (const Position& cell : cells) {
+        if (auto node = Find(cell)) {
+            reach(*node);
+        }
+    }
+    for (size_t i = 0; i < reached_.size(); ++i) {
+        ForEachDependent(reached_[i], [this, &reach](NodeId dependent) {
+            reach(dependent);
+            ++in_degrees_[dependent];
+        });
+    }
+
+    stack_.clear();
+    for (NodeId node : reached_) {
+        if (in_degrees_[node] == 0) {
+            stack_.push_back(node);
+        }
+    }
+    size_t sorted = 0;
+    while (!stack_.empty()) {
+        const NodeId node = stack_.back();
+        stack_.pop_back();
+        ++sorted;
+        ForEachDependent(node, [this](NodeId dependent) {
+            if (--in_degrees_[dependent] == 0) {
+                stack_.push_back(dependent);
+            }
+        });
+    }
+    // the nodes left unsorted are on a cycle or depend on one
+    return sorted < reached_.size();
+}
+
+void DependencyGraph::RepairRanks() const {
+    ranks_.resize(nodes_.size());
+    if (unranked_.empty()) {
+        return;
+    }
+    // raise the changed formulas above their references, then push every
+    // raise to the dependents; a node raised before one of its references
+    // is raised again from there
+    stack_.clear();
+    for (NodeId node : unranked_) {
+        uint32_t required = 0;
+        for (NodeId precedent : nodes_[node].precedents) {
+            required = std::max(required, ranks_[precedent] + 1);
+        }
+        for (RangeEdgeId edge : nodes_[node].range_edges) {
+            required = std::max(required, GetMaxRank(range_edges_[edge].range) + 1);
+        }
+        if (ranks_[node] < required) {
+            ranks_[node] = required;
+            stack_.push_back(node);
+        }
+    }
+    unranked_.clear();
+    while (!stack_.empty()) {
+        const NodeId node = stack_.back();
+        stack_.pop_back();
+        const uint32_t rank = ranks_[node];
+        ForEachDependent(node, [this, rank](NodeId dependent) {
+            if (ranks_[dependent] <= rank) {
+                ranks_[dependent] = rank + 1;
+                stack_.push_back(dependent);
+            }
+        });
+    }
+}
+
+uint32_t DependencyGraph::GetMaxRank(const Range& range) const {
+    uint32_t max_rank = 0;
+    // look the cells of the range up, or go through the nodes if there are
+    // fewer of them
+    if (range.GetCellCount() <= index_.size()) {
+        for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+            for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                if (auto node = Find({ row, col })) {
+                    max_rank = std::max(max_rank, ranks_[*node]);
+                }
+            }
+        }
+    }
+    else {
+        for (const auto& [key, node] : index_) {
+            if (range.Contains(UnpackPosition(key))) {
+                max_rank = std::max(max_rank, ranks_[node]);
+            }
+        }
+    }
+    return max_rank;
+}
+
+void DependencyGraph::NextEpoch() const {
+    // new entries are 0, which is never a current epoch
+    visit_epochs_.resize(nodes_.size());
+    if (++epoch_ == 0) {
+        std::fill(visit_epochs_.begin(), visit_epochs_.end(), 0);
+        epoch_ = 1;
+    }
+}
+
+void DependencyGraph::AddRangeEdge(NodeId formula, const Range& range) {
+    RangeEdgeId edge;
+    if (free_range_edges_.empty()) {
+        edge = static_cast<RangeEdgeId>(range_edges_.size());
+        range_edges_.emplace_back();
+    }
+    else {
+        edge = free_range_edges_.back();
+        free_range_edges_.pop_back();
+    }
+    range_edges_[edge] = { range, formula };
+    ++range_edge_count_;
+    nodes_[formula].range_edges.push_back(edge);
+
+    const size_t last_bucket = static_cast<size_t>(range.bottom_right.col / RANGE_BUCKET_WIDTH);
+    if (range_buckets_.size() <= last_bucket) {
+        range_buckets_.resize(last_bucket + 1);
+    }
+    for (size_t bucket = range.top_left.col / RANGE_BUCKET_WIDTH; bucket <= last_bucket; ++bucket) {
+        range_buckets_[bucket].push_back(edge);
+    }
+}
+
+void DependencyGraph::RemoveRangeEdges(NodeId formula) {
+    for (RangeEdgeId edge : nodes_[formula].range_edges) {
+        const Range& range = range_edges_[edge].range;
+        const size_t last_bucket = static_cast<size_t>(range.bottom_right.col / RANGE_BUCKET_WIDTH);
+        for (size_t bucket = range.top_left.col / RANGE_BUCKET_WIDTH; bucket <= last_bucket; ++bucket) {
+            auto& edges = range_buckets_[bucket];
+            auto it = std::find(edges.begin(), edges.end(), edge);
+            assert(it != edges.end());
+            *it = edges.back();
+            edges.pop_back();
+        }
+        free_range_edges_.push_back(edge);
+        --range_edge_count_;
+    }
+    nodes_[formula].range_edges.clear();
+}
+
+DependencyGraph::NodeId DependencyGraph::FindOrCreate(Position cell) {
+    const PositionKey key = PackPosition(cell);
+    auto [it, inserted] = index_.emplace(key, 0);
+    if (!inserted) {
+        return it->second;
+    }
+    NodeId node;
+    if (free_nodes_.empty()) {
+        node = static_cast<NodeId>(nodes_.size());
+        nodes_.emplace_back();
+    }
+    else {
+        node = free_nodes_.back();
+        free_nodes_.pop_back();
+    }
+    nodes_[node].key = key;
+    if (node < ranks_.size()) {
+        // a reused node references nothing yet
+        ranks_[node] = 0;
+    }
+    it->second = node;
+    return node;
+}
+
+void DependencyGraph::ReleaseIfUnused(NodeId node) {
+    Node& data = nodes_[node];
+    if (!data.precedents.empty() || !data.dependents.empty() || !data.range_edges.empty()) {
+        return;
+    }
+    // a node referencing itself is released both as a precedent and as the
+    // node, and its key may already belong to another node then
+    auto it = index_.find(data.key);
+    if (it == index_.end() || it->second != node) {
+        return;
+    }
+    index_.erase(it);
+    data.precedents.shrink_to_fit();
+    data.dependents.shrink_to_fit();
+    data.range_edges.shrink_to_fit();
+    free_nodes_.push_back(node);
+}
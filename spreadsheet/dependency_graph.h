@@ -0,0 +1,200 @@
+#pragma once
+
+#include "common.h"
+#include "span.h"
+
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// Cell position packed into one 32-bit key: row in the high half, column in
+// the low half (both are below 2^16, see Position::MAX_ROWS/MAX_COLS).
+using PositionKey = uint32_t;
+
+inline PositionKey PackPosition(Position pos) {
+    return (static_cast<uint32_t>(pos.row) << 16) | static_cast<uint32_t>(pos.col);
+}
+
+inline Position UnpackPosition(PositionKey key) {
+    return { static_cast<int>(key >> 16), static_cast<int>(key & 0xFFFF) };
+}
+
+// Graph of references between cells. A node exists for every position that
+// references other cells or is referenced by a formula, whether the position
+// holds a cell or not. Precedent edges go from a formula to the cells it
+// references, dependent edges go the opposite way; both are kept per node as
+// flat arrays of node ids.
+//
+// A range referenced by a formula is a single range edge instead of an edge
+// per cell, so the cells of a range need no nodes. Range edges are found by
+// the column buckets they overlap; ForEachDependent() reports both kinds.
+//
+// Every node has a topological rank: a formula ranks above every node it
+// references, directly or through a range, and positions without a node
+// rank 0. Ranks are repaired lazily before a cycle check, after the
+// references of some nodes changed, and only ever grow, so they need not
+// be the exact heights. A cycle check walks the dependents of the edited
+// cell and cuts off every path that climbs above the highest rank among
+// the new references; if none of them ranks above the cell, there is no
+// walk at all. The walks use an explicit stack and per-node visit epochs,
+// so they neither recurse nor allocate once the scratch arrays have grown.
+// The scratch state makes the checks unsafe to run concurrently, like edits.
+class DependencyGraph {
+public:
+    using NodeId = uint32_t;
+
+    // Replaces all outgoing references of `cell` with `references` and
+    // `ranges`.
+    void SetReferences(Position cell, Span<const Position> references, Span<const Range> ranges = {});
+
+    // makes room for `node_count` nodes, e.g. before wiring a loaded sheet
+    void Reserve(size_t node_count);
+
+    std::optional<NodeId> Find(Position cell) const;
+    Position GetPosition(NodeId node) const {
+        return UnpackPosition(nodes_[node].key);
+    }
+
+    // cells that `node` references
+    const std::vector<NodeId>& GetPrecedents(NodeId node) const {
+        return nodes_[node].precedents;
+    }
+    // formulas that reference `node` directly, without the ones that
+    // reference it through a range
+    const std::vector<NodeId>& GetDependents(NodeId node) const {
+        return nodes_[node].dependents;
+    }
+    // true if a formula references `cell` directly
+    bool HasDependents(Position cell) const;
+
+    // Calls func(NodeId) for every formula that references `cell`, directly
+    // or through a range; a formula is reported once per reference.
+    template <typename Func>
+    void ForEachDependent(Position cell, Func&& func) const;
+    template <typename Func>
+    void ForEachDependent(NodeId node, Func&& func) const;
+
+    // Returns true if setting `references` and `ranges` as the references of
+    // `cell` would create a cycle, i.e. `cell` is one of them or is reachable
+    // from them. Sorted references, like the ones of a formula, are searched
+    // without copying them. The graph must be acyclic.
+    bool WouldCreateCycle(Position cell, Span<const Position> references, Span<const Range> ranges = {}) const;
+
+    // Returns true if `cell` is one of `references` or lies in one of
+    // `ranges`, the cycles that need no graph to be found.
+    static bool IsSelfReference(Position cell, Span<const Position> references, Span<const Range> ranges = {});
+
+    // Returns true if the graph has a cycle through one of `cells`; used to
+    // check many changed cells at once after their references are set. One
+    // pass of Kahn's algorithm over the cells that depend on them.
+    bool HasCycleThrough(Span<const Position> cells) const;
+
+    size_t GetNodeCount() const {
+        return index_.size();
+    }
+    // all node ids are below this bound, so they can index plain arrays
+    size_t GetNodeIdBound() const {
+        return nodes_.size();
+    }
+
+private:
+    using RangeEdgeId = uint32_t;
+
+    struct Node {
+        PositionKey key = 0;
+        std::vector<NodeId> precedents;
+        std::vector<NodeId> dependents;
+        // ranges the node references
+        std::vector<RangeEdgeId> range_edges;
+    };
+
+    struct RangeEdge {
+        Range range;
+        NodeId formula = 0;
+    };
+
+    // columns per bucket of range edges
+    static constexpr int RANGE_BUCKET_WIDTH = 16;
+
+    NodeId FindOrCreate(Position cell);
+    // releases the node if nothing references it and it references nothing;
+    // does nothing for a node that is released already
+    void ReleaseIfUnused(NodeId node);
+    // raises the ranks of unranked_ and of everything that depends on them
+    void RepairRanks() const;
+    // highest rank of the nodes inside `range`, 0 if there are none
+    uint32_t GetMaxRank(const Range& range) const;
+    // starts a walk: every node counts as not visited
+    void NextEpoch() const;
+    // marks `node` visited in the current walk, false if it already was
+    bool Visit(NodeId node) const {
+        if (visit_epochs_[node] == epoch_) {
+            return false;
+        }
+        visit_epochs_[node] = epoch_;
+        return true;
+    }
+    void AddRangeEdge(NodeId formula, const Range& range);
+    void RemoveRangeEdges(NodeId formula);
+    template <typename Func>
+    void ForEachRangeDependent(Position cell, Func& func) const;
+
+    std::unordered_map<PositionKey, NodeId> index_;
+    std::vector<Node> nodes_;
+    std::vector<NodeId> free_nodes_;
+
+    // ranks_[node], see the class comment; repaired by the const cycle
+    // checks, nodes beyond its size rank 0
+    mutable std::vector<uint32_t> ranks_;
+    // nodes whose references changed since the last RepairRanks()
+    mutable std::vector<NodeId> unranked_;
+
+    // scratch state of the walks
+    mutable std::vector<uint32_t> visit_epochs_;
+    mutable uint32_t epoch_ = 0;
+    mutable std::vector<NodeId> stack_;
+    mutable std::vector<NodeId> reached_;
+    mutable std::vector<int> in_degrees_;
+
+    std::vector<RangeEdge> range_edges_;
+    std::vector<RangeEdgeId> free_range_edges_;
+    size_t range_edge_count_ = 0;
+    // range_buckets_[i] holds the range edges that overlap columns
+    // [i * RANGE_BUCKET_WIDTH, (i + 1) * RANGE_BUCKET_WIDTH)
+    std::vector<std::vector<RangeEdgeId>> range_buckets_;
+};
+
+template <typename Func>
+void DependencyGraph::ForEachDependent(Position cell, Func&& func) const {
+    if (auto node = Find(cell)) {
+        for (NodeId dependent : nodes_[*node].dependents) {
+            func(dependent);
+        }
+    }
+    ForEachRangeDependent(cell, func);
+}
+
+template <typename Func>
+void DependencyGraph::ForEachDependent(NodeId node, Func&& func) const {
+    for (NodeId dependent : nodes_[node].dependents) {
+        func(dependent);
+    }
+    ForEachRangeDependent(GetPosition(node), func);
+}
+
+template <typename Func>
+void DependencyGraph::ForEachRangeDependent(Position cell, Func& func) const {
+    if (range_edge_count_ == 0) {
+        return;
+    }
+    const size_t bucket = static_cast<size_t>(cell.col / RANGE_BUCKET_WIDTH);
+    if (bucket >= range_buckets_.size()) {
+        return;
+    }
+    for (RangeEdgeId edge : range_buckets_[bucket]) {
+        if (range_edges_[edge].range.Contains(cell)) {
+            func(range_edges_[edge].formula);
+        }
+    }
+}
@@ -1,12 +1,16 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "formula_parser.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <mutex>
 #include <cassert>
-#include <cctype>
 #include <sstream>
-#include <set>
+#include <unordered_map>
 
 using namespace std::literals;
 
@@ -14,94 +18,298 @@ std::ostream& operator<<(std::ostream& output, FormulaError err) {
     return output << err.ToString();
 }
 
+FormulaInterface::Value GetCellNumber(const CellInterface* cell) {
+    // no cell
+    if (cell == nullptr) {
+        return 0.;
+    }
+    return cell->GetNumericValue();
+}
+
 namespace {
 
 class Formula : public FormulaInterface {
 public:
 // Реализуйте следующие методы:
-    explicit Formula(std::string expression) 
-        : ast_(ParseFormulaAST(std::move(expression))), 
-          referenced_cells_(ast_.GetCells().begin(), ast_.GetCells().end())
+    explicit Formula(FormulaAST ast)
+        : ast_(std::make_shared<const FormulaAST>(std::move(ast)))
     {}
 
+    // `ast` references cells relative to `anchor`
+    Formula(std::shared_ptr<const FormulaAST> ast, Position anchor)
+        : ast_(std::move(ast)), anchor_(anchor) {
+        const auto cells = ast_->GetCells();
+        if (!cells.empty() && (anchor_.row != 0 || anchor_.col != 0)) {
+            // already sorted and deduplicated by FormulaAST, moving all
+            // cells by the same offset keeps the order
+            cells_.reset(new Position[cells.size()]);
+            std::transform(cells.begin(), cells.end(), cells_.get(), [this](Position cell) {
+                return Translate(cell);
+            });
+        }
+    }
+
     Value Evaluate(const SheetInterface& sheet) const override {
-        try {
-            return ast_.Execute(
-                [&sheet](const Position& pos) {
-                    // no cell
-                    if (sheet.GetCell(pos) == nullptr)  {
-                        return 0.;
-                    }
+        const auto cells = ast_->GetCells();
+        ResolveSlots(sheet);
 
-                    auto value = sheet.GetCell(pos)->GetValue();
+        // values of the referenced cells, indexed like GetCells()
+        constexpr size_t INLINE_VALUES_SIZE = 16;
+        double inline_values[INLINE_VALUES_SIZE];
+        std::vector<double> heap_values;
+        double* values = inline_values;
+        if (cells.size() > INLINE_VALUES_SIZE) {
+            heap_values.resize(cells.size());
+            values = heap_values.data();
+        }
 
-                    // as number
-                    if (std::holds_alternative<double>(value)) {
-                        return std::get<double>(value);
-                    }
-                    // as text
-                    else if (std::holds_alternative<std::string>(value)) {
-                        try {
-                            std::string tmp = std::get<std::string>(value);
-                            if (std::all_of(tmp.cbegin(), tmp.cend(), 
-                                [](char ch) {
-                                         return (std::isdigit(ch) || ch == '.');
-                                })) {
-
-                                return std::stod(tmp);
-                            }
-                            else {
-                                throw FormulaError(FormulaError::Category::Value);
-                               //return 0.;
-                            }
-                        }
-                        catch (...)
-                        {
-                            throw FormulaError(FormulaError::Category::Value);
+        for (size_t i = 0; i < cells.size(); ++i) {
+            const Value number = GetCellNumber(slots_[i]);
+            if (std::holds_alternative<FormulaError>(number)) {
+                return number;
+            }
+            values[i] = std::get<double>(number);
+        }
+
+        const auto ranges = ast_->GetRanges();
+        if (ranges.empty()) {
+            return ast_->Execute(values);
+        }
+        std::vector<ASTImpl::RangeStats> stats(ranges.size());
+        // the values of one range are gathered into a contiguous buffer for
+        // ASTImpl::Aggregate; it is local because evaluating a cell of the
+        // range may evaluate another formula with ranges
+        std::vector<double> range_values;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            const Range range = Translate(ranges[i]);
+            range_values.resize(range.GetCellCount());
+            // the sheet's numeric columns have them unless some cell is an
+            // error, a non-numeric text or a formula still to be evaluated
+            if (!sheet.GetRangeNumbers(range, range_values.data())) {
+                double* out = range_values.data();
+                for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+                    for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                        const Value number = GetCellNumber(sheet.GetCell({ row, col }));
+                        if (std::holds_alternative<FormulaError>(number)) {
+                            return number;
                         }
+                        *out++ = std::get<double>(number);
                     }
-                    //CellInterface::FormulaError
-                    else {
-                        throw std::get<FormulaError>(value);
-                    }
-                    //return 0.;
                 }
-            );
-        }
-        catch (const FormulaError& err) {
-            return err;
+            }
+            stats[i] = ASTImpl::Aggregate(range_values.data(), range_values.size());
         }
+        return ast_->Execute(values, stats.data());
     }
 
     std::string GetExpression() const override {
         std::stringstream ss;
-        ast_.PrintFormula(ss);
+        ast_->PrintFormula(ss, anchor_);
         return ss.str();
     }
 
     std::vector<Position> GetReferencedCells() const override {
-        std::vector<Position> result;
+        return GetReferencedCellsView().ToVector();
+    }
 
-        std::set<Position> unique_ref_cells(referenced_cells_.begin(), referenced_cells_.end());
-        for (const auto& cell : unique_ref_cells)
-        {
-            result.push_back(cell);
+    Span<const Position> GetReferencedCellsView() const override {
+        if (cells_) {
+            return { cells_.get(), ast_->GetCells().size() };
         }
-        return result;
+        return ast_->GetCells();
+    }
+
+    CompiledFormula GetCompiled() const {
+        return { ast_, anchor_ };
+    }
+
+    std::vector<Range> GetReferencedRanges() const override {
+        std::vector<Range> ranges;
+        ranges.reserve(ast_->GetRanges().size());
+        for (const Range& range : ast_->GetRanges()) {
+            ranges.push_back(Translate(range));
+        }
+        return ranges;
     }
 
 private:
-    FormulaAST ast_;
-    std::vector<Position> referenced_cells_;
+    // Looks the referenced cells up once and keeps the pointers while the
+    // sheet reports the same cells version.
+    void ResolveSlots(const SheetInterface& sheet) const {
+        const uint64_t version = sheet.GetCellsVersion();
+        if (slots_sheet_ == &sheet && slots_version_ == version
+            && version != SheetInterface::UNSTABLE_CELLS_VERSION) {
+            return;
+        }
+        const auto cells = GetReferencedCellsView();
+        slots_.resize(cells.size());
+        for (size_t i = 0; i < cells.size(); ++i) {
+            slots_[i] = sheet.GetCell(cells[i]);
+        }
+        slots_sheet_ = &sheet;
+        slots_version_ = version;
+    }
+
+    Position Translate(Position cell) const {
+        return { cell.row + anchor_.row, cell.col + anchor_.col };
+    }
+
+    Range Translate(const Range& range) const {
+        return { Translate(range.top_left), Translate(range.bottom_right) };
+    }
+
+    // may be shared with other cells through a FormulaTemplateCache
+    std::shared_ptr<const FormulaAST> ast_;
+    Position anchor_{ 0, 0 };
+    // ast_'s cells moved to the anchor, null when they are absolute already
+    std::unique_ptr<Position[]> cells_;
+    // cells referenced by the formula (nullptr for empty positions) at
+    // slots_version_ of slots_sheet_
+    mutable std::vector<const CellInterface*> slots_;
+    mutable const SheetInterface* slots_sheet_ = nullptr;
+    mutable uint64_t slots_version_ = SheetInterface::UNSTABLE_CELLS_VERSION;
 };
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     try {
-        return std::make_unique<Formula>(std::move(expression));
+        return std::make_unique<Formula>(ParseFormulaAST(expression));
     }
     catch (const std::exception&)
     {
         throw FormulaException("Formula parse error");
     }
+}
+
+CompiledFormula GetCompiledFormula(const FormulaInterface& formula) {
+    // every FormulaInterface of this library is a Formula
+    return static_cast<const Formula&>(formula).GetCompiled();
+}
+
+std::unique_ptr<FormulaInterface> MakeFormula(CompiledFormula compiled) {
+    return std::make_unique<Formula>(std::move(compiled.ast), compiled.anchor);
+}
+
+struct FormulaTemplateCache::Impl {
+    // Positions referenced by the stored programs are offsets from the anchor.
+    // Entries do not keep templates alive, expired ones are dropped once the
+    // map has grown to prune_at.
+    std::mutex mutex;
+    std::unordered_map<std::string, std::weak_ptr<const FormulaAST>> templates;
+    size_t prune_at = MIN_PRUNE_AT;
+
+    static constexpr size_t MIN_PRUNE_AT = 1024;
+
+    void Prune() {
+        for (auto it = templates.begin(); it != templates.end();) {
+            it = it->second.expired() ? templates.erase(it) : std::next(it);
+        }
+        prune_at = std::max(MIN_PRUNE_AT, 2 * templates.size());
+    }
+};
+
+FormulaTemplateCache::FormulaTemplateCache()
+    : impl_(std::make_unique<Impl>()) {
+}
+
+FormulaTemplateCache::~FormulaTemplateCache() = default;
+
+size_t FormulaTemplateCache::GetTemplateCount() const {
+    std::lock_guard lock(impl_->mutex);
+    return std::count_if(impl_->templates.begin(), impl_->templates.end(), [](const auto& entry) {
+        return !entry.second.expired();
+    });
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position anchor,
+                                               FormulaTemplateCache& cache) {
+    thread_local std::string key;
+    if (!MakeFormulaTemplateKey(expression, anchor, key)) {
+        // not a valid formula, let the parser report it
+        return ParseFormula(std::move(expression));
+    }
+
+    auto& impl = *cache.impl_;
+    {
+        std::lock_guard lock(impl.mutex);
+        auto it = impl.templates.find(key);
+        if (it != impl.templates.end()) {
+            if (auto ast = it->second.lock()) {
+                return std::make_unique<Formula>(std::move(ast), anchor);
+            }
+        }
+    }
+
+    std::shared_ptr<const FormulaAST> ast;
+    try {
+        // compile at the anchor and move the cells to be relative to it
+        const FormulaAST absolute = ParseFormulaAST(expression);
+        auto relative = [anchor](Position cell) {
+            return Position{ cell.row - anchor.row, cell.col - anchor.col };
+        };
+        std::vector<Position> cells;
+        cells.reserve(absolute.GetCells().size());
+        for (const Position cell : absolute.GetCells()) {
+            cells.push_back(relative(cell));
+        }
+        std::vector<Range> ranges;
+        ranges.reserve(absolute.GetRanges().size());
+        for (const Range& range : absolute.GetRanges()) {
+            ranges.push_back({ relative(range.top_left), relative(range.bottom_right) });
+        }
+        ast = std::make_shared<const FormulaAST>(absolute.GetProgram(), absolute.GetNumbers(), cells, ranges);
+    }
+    catch (const std::exception&) {
+        throw FormulaException("Formula parse error");
+    }
+
+    std::lock_guard lock(impl.mutex);
+    auto& entry = impl.templates[key];
+    if (auto existing = entry.lock()) {
+        // another thread compiled the same template meanwhile
+        ast = std::move(existing);
+    }
+    else {
+        entry = ast;
+        if (impl.templates.size() >= impl.prune_at) {
+            impl.Prune();
+        }
+    }
+    return std::make_unique<Formula>(std::move(ast), anchor);
+}
+
+std::vector<std::unique_ptr<FormulaInterface>> ParseFormulas(const std::vector<std::string>& expressions,
+                                                             size_t thread_count) {
+    constexpr size_t GRAIN = 256;
+
+    std::vector<std::unique_ptr<FormulaInterface>> formulas(expressions.size());
+    // index of the first invalid expression, so the error does not depend
+    // on the order in which the threads got to it
+    std::atomic<size_t> first_error = expressions.size();
+
+    auto parse_range = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end && i < first_error.load(std::memory_order_relaxed); ++i) {
+            try {
+                formulas[i] = std::make_unique<Formula>(ParseFormulaAST(expressions[i]));
+            }
+            catch (const std::exception&) {
+                size_t current = first_error.load();
+                while (i < current && !first_error.compare_exchange_weak(current, i)) {
+                }
+            }
+        }
+    };
+
+    if (thread_count <= 1 || expressions.size() <= GRAIN) {
+        parse_range(0, expressions.size());
+    }
+    else {
+        ThreadPool pool(thread_count - 1);
+        pool.ParallelFor(expressions.size(), GRAIN, parse_range);
+    }
+
+    if (first_error < expressions.size()) {
+        throw FormulaException("Formula parse error at index " + std::to_string(first_error.load()));
+    }
+    return formulas;
 }
\ No newline at end of file
@@ -3,12 +3,17 @@
 #include "common.h"
 
 #include <memory>
+#include <string>
 #include <vector>
 
+class FormulaAST;
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Функции SUM, AVG, MIN и MAX от чисел, выражений и диапазонов:
+//   SUM(A1:B3,C1*2). Пустые ячейки диапазона считаются нулями.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -34,8 +39,69 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+    // Тот же список без копирования, хранится в формуле.
+    virtual Span<const Position> GetReferencedCellsView() const = 0;
+
+    // Возвращает диапазоны, которые задействованы в вычислении формулы, в
+    // порядке их появления в выражении. Ячейки диапазонов не входят в
+    // GetReferencedCells(), если не указаны в формуле отдельно.
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
 };
 
+// Значение ячейки в виде числа для вычисления формул: число, ошибка ячейки
+// или ошибка #VALUE! для текста, который не является числом. Отсутствующая
+// ячейка (nullptr) считается нулём.
+FormulaInterface::Value GetCellNumber(const CellInterface* cell);
+
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Откомпилированная формула: программа и позиция, относительно которой в ней
+// указаны ячейки. Одну программу могут разделять несколько формул.
+struct CompiledFormula {
+    std::shared_ptr<const FormulaAST> ast;
+    Position anchor;
+};
+
+// Возвращает программу формулы, созданной одной из функций этого файла.
+CompiledFormula GetCompiledFormula(const FormulaInterface& formula);
+
+// Создаёт формулу из готовой программы, не разбирая выражение (например,
+// при загрузке сохранённого листа).
+std::unique_ptr<FormulaInterface> MakeFormula(CompiledFormula compiled);
+
+// Кэш откомпилированных формул. Формула, скопированная из ячейки в ячейку
+// (=A1*B1 в C1, =A2*B2 в C2, ...), в относительной форме одна и та же, поэтому
+// её программа хранится один раз и разделяется всеми такими ячейками, а
+// каждая ячейка хранит только свою позицию. Потокобезопасен.
+class FormulaTemplateCache {
+public:
+    FormulaTemplateCache();
+    FormulaTemplateCache(const FormulaTemplateCache&) = delete;
+    FormulaTemplateCache& operator=(const FormulaTemplateCache&) = delete;
+    ~FormulaTemplateCache();
+
+    // Количество различных формул, используемых хотя бы одной ячейкой.
+    size_t GetTemplateCount() const;
+
+private:
+    friend std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position anchor,
+                                                          FormulaTemplateCache& cache);
+
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// Парсит выражение формулы, находящейся в ячейке anchor, и возвращает объект
+// формулы. Программа формулы берётся из кэша, если там уже есть такая же
+// формула относительно своей ячейки. Бросает FormulaException в случае, если
+// формула синтаксически некорректна.
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position anchor,
+                                               FormulaTemplateCache& cache);
+
+// Парсит набор выражений, распределяя работу между thread_count потоками.
+// Результат i соответствует выражению i. Бросает FormulaException, если хотя
+// бы одно выражение синтаксически некорректно.
+std::vector<std::unique_ptr<FormulaInterface>> ParseFormulas(const std::vector<std::string>& expressions,
+                                                             size_t thread_count = 1);
\ No newline at end of file
@@ -0,0 +1,233 @@
+#include "formula_parser.h"
+
+#include "FormulaBaseListener.h"
+#include "FormulaLexer.h"
+#include "FormulaParser.h"
+
+#include <atomic>
+#include <cassert>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+
+namespace ASTImpl {
+namespace {
+using Op = Instruction::Op;
+
+// The listener is called in post-order, so the program is produced by simply
+// appending an instruction on every exit.
+class ParseASTListener final : public FormulaBaseListener {
+public:
+    explicit ParseASTListener(ProgramBuffers& buffers)
+        : program_(buffers.program), numbers_(buffers.numbers), cells_(buffers.cells)
+        , ranges_(buffers.ranges) {
+        buffers.Clear();
+    }
+
+    FormulaAST BuildAST() {
+        assert(depth_ == 1);
+        depth_ = 0;
+        return FormulaAST(program_, numbers_, cells_, ranges_);
+    }
+
+public:
+    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
+        assert(depth_ >= 1);
+
+        Op op;
+        if (ctx->SUB()) {
+            op = Op::UnaryMinus;
+        } else {
+            assert(ctx->ADD() != nullptr);
+            op = Op::UnaryPlus;
+        }
+        program_.push_back({ op });
+    }
+
+    void exitLiteral(FormulaParser::LiteralContext* ctx) override {
+        double value = 0;
+        auto valueStr = ctx->NUMBER()->getSymbol()->getText();
+        std::istringstream in(valueStr);
+        in >> value;
+        if (!in) {
+            throw ParsingError("Invalid number: " + valueStr);
+        }
+
+        program_.push_back({ Op::PushNumber, static_cast<uint32_t>(numbers_.size()) });
+        numbers_.push_back(value);
+        ++depth_;
+    }
+
+    void exitCell(FormulaParser::CellContext* ctx) override {
+        auto value_str = ctx->CELL()->getSymbol()->getText();
+        auto value = Position::FromString(value_str);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid position: " + value_str);
+        }
+
+        program_.push_back({ Op::LoadCell, static_cast<uint32_t>(cells_.size()) });
+        cells_.push_back(value);
+        ++depth_;
+    }
+
+    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+        assert(depth_ >= 2);
+
+        Op op;
+        if (ctx->ADD()) {
+            op = Op::Add;
+        }
+        else if (ctx->SUB()) {
+            op = Op::Subtract;
+        }
+        else if (ctx->MUL()) {
+            op = Op::Multiply;
+        }
+        else {
+            assert(ctx->DIV() != nullptr);
+            op = Op::Divide;
+        }
+        program_.push_back({ op });
+        --depth_;
+    }
+
+    void enterFunction(FormulaParser::FunctionContext* ctx) override {
+        functions_.push_back(GetFunctionOps(ctx->FUNC()->getSymbol()->getText()));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        const auto args = static_cast<uint32_t>(ctx->arg().size());
+        assert(args > 0 && depth_ >= 2 * args);
+
+        program_.push_back({ functions_.back().function, args });
+        functions_.pop_back();
+        depth_ -= 2 * args - 1;
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        const auto first_str = ctx->CELL(0)->getSymbol()->getText();
+        const auto second_str = ctx->CELL(1)->getSymbol()->getText();
+        const auto first = Position::FromString(first_str);
+        const auto second = Position::FromString(second_str);
+        if (!first.IsValid() || !second.IsValid()) {
+            throw FormulaException("Invalid range: " + first_str + ":" + second_str);
+        }
+
+        program_.push_back({ functions_.back().range, static_cast<uint32_t>(ranges_.size()) });
+        ranges_.push_back(Range::FromCorners(first, second));
+        depth_ += 2;
+    }
+
+    void exitArgument(FormulaParser::ArgumentContext* /* ctx */) override {
+        assert(depth_ >= 1);
+
+        program_.push_back({ Op::ScalarArgument });
+        ++depth_;
+    }
+
+    void visitErrorNode(antlr4::tree::ErrorNode* node) override
+    {
+        throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
+    }
+
+private:
+    std::vector<Instruction>& program_;
+    std::vector<double>& numbers_;
+    std::vector<Position>& cells_;
+    std::vector<Range>& ranges_;
+    // functions whose arguments are being parsed, innermost last
+    std::vector<FunctionOps> functions_;
+    // number of values the program leaves on the stack so far
+    size_t depth_ = 0;
+};
+
+class BailErrorListener : public antlr4::BaseErrorListener {
+public:
+    void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
+                    size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
+                    std::exception_ptr /* e */
+                    ) override {
+        throw ParsingError("Error when lexing: " + msg);
+    }
+};
+
+}  // namespace
+}  // namespace ASTImpl
+
+struct FormulaASTParser::State {
+    State() {
+        lexer.removeErrorListeners();
+        lexer.addErrorListener(&error_listener);
+        parser.setErrorHandler(std::make_shared<antlr4::BailErrorStrategy>());
+        parser.removeErrorListeners();
+    }
+
+    antlr4::ANTLRInputStream input;
+    FormulaLexer lexer{ &input };
+    antlr4::CommonTokenStream tokens{ &lexer };
+    FormulaParser parser{ &tokens };
+    ASTImpl::BailErrorListener error_listener;
+    ASTImpl::ProgramBuffers buffers;
+};
+
+FormulaASTParser::FormulaASTParser()
+    : state_(std::make_unique<State>()) {
+}
+
+FormulaASTParser::~FormulaASTParser() = default;
+
+FormulaAST FormulaASTParser::Parse(std::string_view expression) {
+    using namespace antlr4;
+
+    // every setter below resets its object, which also recovers the state
+    // left behind by a previous input that failed to parse
+    state_->input.load(expression.data(), expression.size(), /* lenient */ false);
+    state_->lexer.setInputStream(&state_->input);
+    state_->tokens.setTokenSource(&state_->lexer);
+    state_->parser.setTokenStream(&state_->tokens);
+
+    tree::ParseTree* tree = state_->parser.main();
+    ASTImpl::ParseASTListener listener(state_->buffers);
+    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+
+    return listener.BuildAST();
+}
+
+FormulaASTParser& FormulaASTParser::ForCurrentThread() {
+    thread_local FormulaASTParser parser;
+    return parser;
+}
+
+namespace {
+#ifdef SPREADSHEET_NATIVE_PARSER
+std::atomic<FormulaParserBackend> default_backend{ FormulaParserBackend::Native };
+#else
+std::atomic<FormulaParserBackend> default_backend{ FormulaParserBackend::Antlr };
+#endif
+}  // namespace
+
+FormulaParserBackend GetDefaultFormulaParserBackend() {
+    return default_backend.load(std::memory_order_relaxed);
+}
+
+void SetDefaultFormulaParserBackend(FormulaParserBackend backend) {
+    default_backend.store(backend, std::memory_order_relaxed);
+}
+
+FormulaAST ParseFormulaAST(std::string_view expression, FormulaParserBackend backend) {
+    if (backend == FormulaParserBackend::Native) {
+        return ParseFormulaASTNative(expression);
+    }
+    return FormulaASTParser::ForCurrentThread().Parse(expression);
+}
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    const std::string expression(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(expression);
+}
+
+FormulaAST ParseFormulaAST(std::string_view expression) {
+    return ParseFormulaAST(expression, GetDefaultFormulaParserBackend());
+}
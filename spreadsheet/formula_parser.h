@@ -0,0 +1,56 @@
+#pragma once
+
+#include "FormulaAST.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Parsers that can build FormulaAST. Both accept the grammar in Formula.g4
+// and produce identical programs; ANTLR is the reference implementation.
+enum class FormulaParserBackend {
+    Antlr,
+    Native,
+};
+
+// Backend used by ParseFormulaAST(std::string_view) and so by ParseFormula().
+// Native when the library is built with SPREADSHEET_NATIVE_PARSER, ANTLR
+// otherwise; may be changed at runtime.
+FormulaParserBackend GetDefaultFormulaParserBackend();
+void SetDefaultFormulaParserBackend(FormulaParserBackend backend);
+
+FormulaAST ParseFormulaAST(std::string_view expression, FormulaParserBackend backend);
+
+// Hand-written recursive-descent parser; allocates nothing beyond the
+// block of the returned AST. Throws like FormulaASTParser::Parse().
+FormulaAST ParseFormulaASTNative(std::string_view expression);
+
+// Writes the tokens of `expression` into `key` with every cell reference
+// replaced by its offset from `anchor` (R<rows>C<columns>), so formulas
+// copied from one cell to another get equal keys and compile to the same
+// program relative to their anchors. Returns false if the expression cannot
+// be lexed or references an invalid position.
+bool MakeFormulaTemplateKey(std::string_view expression, Position anchor, std::string& key);
+
+// The ANTLR backend. The input stream, lexer, token stream, parser and error
+// strategy are created once and reset for every input instead of being
+// rebuilt per formula; the generated DFA and prediction caches are shared by
+// all parsers anyway. A parser must only be used by one thread at a time,
+// ForCurrentThread() gives each thread its own.
+class FormulaASTParser {
+public:
+    FormulaASTParser();
+    FormulaASTParser(const FormulaASTParser&) = delete;
+    FormulaASTParser& operator=(const FormulaASTParser&) = delete;
+    ~FormulaASTParser();
+
+    // Throws ParsingError or FormulaException for invalid expressions; the
+    // parser stays usable afterwards.
+    FormulaAST Parse(std::string_view expression);
+
+    static FormulaASTParser& ForCurrentThread();
+
+private:
+    struct State;
+    std::unique_ptr<State> state_;
+};
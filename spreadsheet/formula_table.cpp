@@ -0,0 +1,31 @@
+#include "formula_table.h"
+
+#include <cassert>
+#include <utility>
+
+FormulaTable::Id FormulaTable::Add(std::unique_ptr<FormulaInterface> formula, Position pos,
+                                   std::optional<CellInterface::Value> cache) {
+    Id id;
+    if (!free_ids_.empty()) {
+        id = free_ids_.back();
+        free_ids_.pop_back();
+    }
+    else {
+        if (capacity_used_ == chunks_.size() * CHUNK_SIZE) {
+            chunks_.push_back(std::make_unique<std::optional<Record>[]>(CHUNK_SIZE));
+        }
+        id = static_cast<Id>(capacity_used_++);
+    }
+    // emplaced rather than assigned, a once_flag cannot be reset
+    chunks_[id / CHUNK_SIZE][id % CHUNK_SIZE].emplace(std::move(formula), pos, std::move(cache));
+    ++size_;
+    return id;
+}
+
+void FormulaTable::Release(Id id) {
+    auto& record = chunks_[id / CHUNK_SIZE][id % CHUNK_SIZE];
+    assert(record);
+    record.reset();
+    free_ids_.push_back(id);
+    --size_;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Formulas of the cells of one sheet together with their evaluation state.
+// A formula cell only keeps the id of its record (see CellContents). Records
+// live in chunks of CHUNK_SIZE that are never moved or freed, so a record
+// stays where it is while the recalculation threads evaluate it; ids of
+// released records are reused by the next Add().
+class FormulaTable {
+public:
+    using Id = uint32_t;
+
+    // How far the cache of a formula can be trusted. A formula becomes
+    // CLEAN only after the formulas referencing it have been marked for a
+    // new value, if it got one: a cell that is CLEAN has told its
+    // dependents, so they are DIRTY or their CHECK can be confirmed without
+    // evaluating them. Readers rely on this without taking the lock of the
+    // record, also while another thread evaluates it.
+    enum class State : uint8_t {
+        // the cache holds the current value
+        CLEAN,
+        // something the formula depends on was changed, but the direct
+        // precedents may still have their old values; the cache is current
+        // unless one of them turns out to have a new one
+        CHECK,
+        // a direct precedent has a new value, the formula has to be
+        // evaluated; the cache holds the previous value, if there is one
+        DIRTY,
+    };
+
+    struct Record {
+        Record(std::unique_ptr<FormulaInterface> formula, Position pos,
+               std::optional<CellInterface::Value> cache)
+            : formula(std::move(formula)), pos(pos), cache(std::move(cache)),
+            state(this->cache ? State::CLEAN : State::DIRTY)
+        {}
+
+        std::unique_ptr<FormulaInterface> formula;
+        // the cell of the formula
+        Position pos;
+        // filled on the first evaluation and kept, as the previous value,
+        // after one of the referenced cells is changed (see
+        // Sheet::InvalidateDependents)
+        mutable std::optional<CellInterface::Value> cache;
+        // changed from the recalculation threads, see Sheet::Recalculate()
+        mutable std::atomic<State> state;
+        // held by the thread that brings a stale cache up to date, so that
+        // concurrent readers (see Sheet::LockForReading) evaluate a formula
+        // once; a clean cache is read without it. A thread holds one of
+        // these locks at a time: the stale formulas a read depends on are
+        // brought up to date first, each under its own lock (see
+        // Sheet::EvaluateWithPrecedents), so evaluating a formula finds its
+        // references clean and locks nothing.
+        mutable std::mutex evaluation_mutex;
+        // distinguishes the first evaluation from a recomputation after
+        // invalidation
+        mutable bool was_evaluated = false;
+        // the canonical text, printed from the program on first use
+        mutable std::once_flag text_once;
+        mutable std::string text;
+    };
+
+    FormulaTable() = default;
+    FormulaTable(const FormulaTable&) = delete;
+    FormulaTable& operator=(const FormulaTable&) = delete;
+
+    Id Add(std::unique_ptr<FormulaInterface> formula, Position pos,
+           std::optional<CellInterface::Value> cache = std::nullopt);
+    void Release(Id id);
+
+    Record& Get(Id id) {
+        return *chunks_[id / CHUNK_SIZE][id % CHUNK_SIZE];
+    }
+    const Record& Get(Id id) const {
+        return *chunks_[id / CHUNK_SIZE][id % CHUNK_SIZE];
+    }
+
+    // number of records in use
+    size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    static constexpr size_t CHUNK_SIZE = 256;
+
+    std::vector<std::unique_ptr<std::optional<Record>[]>> chunks_;
+    std::vector<Id> free_ids_;
+    // records ever handed out, free or not
+    size_t capacity_used_ = 0;
+    size_t size_ = 0;
+};
@@ -0,0 +1,114 @@
+#include "instrumentation.h"
+
+std::string_view ToString(Phase phase) {
+    switch (phase) {
+    case Phase::PARSE:
+        return "parse";
+    case Phase::CYCLE_CHECK:
+        return "cycle_check";
+    case Phase::INVALIDATION:
+        return "invalidation";
+    case Phase::EVALUATION:
+        return "evaluation";
+    case Phase::RECALCULATION:
+        return "recalculation";
+    case Phase::COUNT:
+        break;
+    }
+    return "unknown";
+}
+
+std::string_view ToString(Allocation allocation) {
+    switch (allocation) {
+    case Allocation::CELL_BLOCK:
+        return "cell_block";
+    case Allocation::LONG_TEXT:
+        return "long_text";
+    case Allocation::FORMULA:
+        return "formula";
+    case Allocation::COUNT:
+        break;
+    }
+    return "unknown";
+}
+
+#ifdef SPREADSHEET_INSTRUMENTATION
+
+namespace {
+void UpdateMax(std::atomic<uint64_t>& max, uint64_t value) {
+    uint64_t current = max.load(std::memory_order_relaxed);
+    while (current < value && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+void Add(std::atomic<uint64_t>& counter, uint64_t value = 1) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+}
+}  // namespace
+
+void Instrumentation::AddTime(Phase phase, std::chrono::steady_clock::duration duration) const {
+    const auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    size_t bucket = 0;
+    while (bucket + 1 < InstrumentationStatistics::HISTOGRAM_BUCKETS && (ns >> (bucket + 1)) != 0) {
+        ++bucket;
+    }
+    PhaseCounters& counters = phases_[static_cast<size_t>(phase)];
+    Add(counters.count);
+    Add(counters.total_ns, ns);
+    UpdateMax(counters.max_ns, ns);
+    Add(counters.histogram[bucket]);
+}
+
+void Instrumentation::AddRead(size_t evaluations, size_t search_depth) const {
+    Add(stale_reads_);
+    Add(read_evaluations_, evaluations);
+    UpdateMax(max_read_evaluations_, evaluations);
+    UpdateMax(max_search_depth_, search_depth);
+}
+
+void Instrumentation::AddAllocation(Allocation allocation) const {
+    Add(allocations_[static_cast<size_t>(allocation)]);
+}
+
+InstrumentationStatistics Instrumentation::GetStatistics() const {
+    InstrumentationStatistics statistics;
+    statistics.enabled = true;
+    for (size_t phase = 0; phase < PHASE_COUNT; ++phase) {
+        const PhaseCounters& counters = phases_[phase];
+        InstrumentationStatistics::PhaseStatistics& out = statistics.phases[phase];
+        out.count = counters.count.load(std::memory_order_relaxed);
+        out.total_ns = counters.total_ns.load(std::memory_order_relaxed);
+        out.max_ns = counters.max_ns.load(std::memory_order_relaxed);
+        for (size_t bucket = 0; bucket < out.histogram.size(); ++bucket) {
+            out.histogram[bucket] = counters.histogram[bucket].load(std::memory_order_relaxed);
+        }
+    }
+    statistics.stale_reads = stale_reads_.load(std::memory_order_relaxed);
+    statistics.read_evaluations = read_evaluations_.load(std::memory_order_relaxed);
+    statistics.max_read_evaluations = max_read_evaluations_.load(std::memory_order_relaxed);
+    statistics.max_search_depth = max_search_depth_.load(std::memory_order_relaxed);
+    for (size_t allocation = 0; allocation < ALLOCATION_COUNT; ++allocation) {
+        statistics.allocations[allocation] = allocations_[allocation].load(std::memory_order_relaxed);
+    }
+    return statistics;
+}
+
+void Instrumentation::Reset() {
+    for (PhaseCounters& counters : phases_) {
+        counters.count = 0;
+        counters.total_ns = 0;
+        counters.max_ns = 0;
+        for (auto& bucket : counters.histogram) {
+            bucket = 0;
+        }
+    }
+    stale_reads_ = 0;
+    read_evaluations_ = 0;
+    max_read_evaluations_ = 0;
+    max_search_depth_ = 0;
+    for (auto& allocation : allocations_) {
+        allocation = 0;
+    }
+}
+
+#endif
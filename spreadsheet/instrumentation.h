@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Where a sheet spends its time
+enum class Phase {
+    // compiling formula texts, including the template lookup
+    PARSE,
+    // checking that an edit creates no circular dependency
+    CYCLE_CHECK,
+    // marking the dependents of edited cells stale
+    INVALIDATION,
+    // running one formula program, without the formulas it references
+    EVALUATION,
+    // one Sheet::Recalculate()
+    RECALCULATION,
+    COUNT,
+};
+inline constexpr size_t PHASE_COUNT = static_cast<size_t>(Phase::COUNT);
+std::string_view ToString(Phase phase);
+
+// What a sheet allocates on the heap for its cells
+enum class Allocation {
+    // a block of CellStorage
+    CELL_BLOCK,
+    // a text too long to be stored in the cell
+    LONG_TEXT,
+    // a compiled formula of a cell
+    FORMULA,
+    COUNT,
+};
+inline constexpr size_t ALLOCATION_COUNT = static_cast<size_t>(Allocation::COUNT);
+std::string_view ToString(Allocation allocation);
+
+// Counters of a sheet, see Sheet::GetInstrumentationStatistics(). All zero
+// unless the library is built with SPREADSHEET_INSTRUMENTATION.
+struct InstrumentationStatistics {
+    static constexpr size_t HISTOGRAM_BUCKETS = 32;
+
+    struct PhaseStatistics {
+        uint64_t count = 0;
+        uint64_t total_ns = 0;
+        uint64_t max_ns = 0;
+        // histogram[i] counts the durations of [2^i, 2^(i+1)) ns, the last
+        // bucket also the longer ones
+        std::array<uint64_t, HISTOGRAM_BUCKETS> histogram{};
+    };
+
+    bool enabled = false;
+    std::array<PhaseStatistics, PHASE_COUNT> phases{};
+    // reads of stale formulas (GetValue() of a cell, GetValues()) and the
+    // formulas they evaluated or confirmed, nothing for clean values
+    uint64_t stale_reads = 0;
+    uint64_t read_evaluations = 0;
+    uint64_t max_read_evaluations = 0;
+    // evaluation does not recurse, formulas reached from a read are found
+    // with an explicit stack; the deepest it got
+    uint64_t max_search_depth = 0;
+    std::array<uint64_t, ALLOCATION_COUNT> allocations{};
+
+    const PhaseStatistics& Get(Phase phase) const {
+        return phases[static_cast<size_t>(phase)];
+    }
+    uint64_t Get(Allocation allocation) const {
+        return allocations[static_cast<size_t>(allocation)];
+    }
+};
+
+#ifdef SPREADSHEET_INSTRUMENTATION
+
+// Counters updated from the hot paths of a sheet, also from the
+// recalculation threads; every update is a relaxed atomic operation.
+class Instrumentation {
+public:
+    static constexpr bool ENABLED = true;
+
+    // adds the time from construction to destruction to a phase
+    class Timer {
+    public:
+        Timer(const Instrumentation& instrumentation, Phase phase)
+            : instrumentation_(instrumentation), phase_(phase), start_(std::chrono::steady_clock::now()) {
+        }
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+        ~Timer() {
+            instrumentation_.AddTime(phase_, std::chrono::steady_clock::now() - start_);
+        }
+
+    private:
+        const Instrumentation& instrumentation_;
+        Phase phase_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    void AddRead(size_t evaluations, size_t search_depth) const;
+    void AddAllocation(Allocation allocation) const;
+
+    InstrumentationStatistics GetStatistics() const;
+    void Reset();
+
+private:
+    struct PhaseCounters {
+        std::atomic<uint64_t> count{ 0 };
+        std::atomic<uint64_t> total_ns{ 0 };
+        std::atomic<uint64_t> max_ns{ 0 };
+        std::array<std::atomic<uint64_t>, InstrumentationStatistics::HISTOGRAM_BUCKETS> histogram{};
+    };
+
+    void AddTime(Phase phase, std::chrono::steady_clock::duration duration) const;
+
+    mutable std::array<PhaseCounters, PHASE_COUNT> phases_;
+    mutable std::atomic<uint64_t> stale_reads_{ 0 };
+    mutable std::atomic<uint64_t> read_evaluations_{ 0 };
+    mutable std::atomic<uint64_t> max_read_evaluations_{ 0 };
+    mutable std::atomic<uint64_t> max_search_depth_{ 0 };
+    mutable std::array<std::atomic<uint64_t>, ALLOCATION_COUNT> allocations_{};
+};
+
+#else
+
+// Without SPREADSHEET_INSTRUMENTATION every call is empty and compiled out.
+class Instrumentation {
+public:
+    static constexpr bool ENABLED = false;
+
+    class Timer {
+    public:
+        Timer(const Instrumentation&, Phase) {
+        }
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+    };
+
+    void AddRead(size_t, size_t) const {
+    }
+    void AddAllocation(Allocation) const {
+    }
+
+    InstrumentationStatistics GetStatistics() const {
+        return {};
+    }
+    void Reset() {
+    }
+};
+
+#endif
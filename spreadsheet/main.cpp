@@ -1,7 +1,25 @@
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <limits>
+#include <map>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
 #include "common.h"
 #include "formula.h"
+#include "formula_parser.h"
+#include "numeric_columns.h"
+#include "sheet.h"
+#include "sheet_snapshot.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -12,6 +30,10 @@ inline Position operator"" _pos(const char* str, std::size_t) {
     return Position::FromString(str);
 }
 
+inline std::ostream& operator<<(std::ostream& output, const Range& range) {
+    return output << "(" << range.top_left << ", " << range.bottom_right << ")";
+}
+
 inline std::ostream& operator<<(std::ostream& output, Size size) {
     return output << "(" << size.rows << ", " << size.cols << ")";
 }
@@ -346,6 +368,1571 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestFormulaCache() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2+A2");
+
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 2u);
+    // A2 is evaluated first and then read once, from the cache, even though
+    // it occurs twice
+    ASSERT_EQUAL(sheet.GetCacheStatistics().hits, 1u);
+
+    sheet.ResetCacheStatistics();
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 0u);
+    ASSERT_EQUAL(sheet.GetCacheStatistics().hits, 1u);
+
+    sheet.SetCell("A1"_pos, "2");
+    sheet.ResetCacheStatistics();
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 2u);
+    ASSERT_EQUAL(sheet.GetCacheStatistics().recomputes, 2u);
+}
+
+void TestSparseStorage() {
+    Sheet sheet;
+    const Position far{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+    sheet.SetCell(far, "far");
+    sheet.SetCell("B2"_pos, "=XFD16384");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell(far)->GetValue()), "far");
+    ASSERT(sheet.GetCell(Position{Position::MAX_ROWS - 1, 0}) == nullptr);
+
+    sheet.ClearCell("B2"_pos);
+    sheet.ClearCell(far);
+    ASSERT(sheet.GetCell(far) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+
+    CellStorage storage;
+    storage.FindOrCreate("A1"_pos, sheet);
+    storage.FindOrCreate("H8"_pos, sheet);
+    storage.FindOrCreate("I9"_pos, sheet);
+    ASSERT_EQUAL(storage.GetBlockCount(), 2u);
+    storage.Erase("I9"_pos);
+    ASSERT_EQUAL(storage.GetBlockCount(), 1u);
+    ASSERT(storage.Find("H8"_pos) != nullptr);
+    ASSERT(storage.Find("I9"_pos) == nullptr);
+}
+
+void TestPrintableSizeTracking() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("C5"_pos, "x");
+    sheet->SetCell("E2"_pos, "=C5");
+    sheet->SetCell("A1"_pos, "=J20");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 5}));
+
+    sheet->ClearCell("C5"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 5}));
+
+    sheet->SetCell("E2"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestDependencyGraph() {
+    DependencyGraph graph;
+    graph.SetReferences("B1"_pos, std::vector{"A1"_pos, "A2"_pos});
+    graph.SetReferences("C1"_pos, std::vector{"B1"_pos});
+    ASSERT(graph.HasDependents("A1"_pos));
+    ASSERT(!graph.HasDependents("C1"_pos));
+    ASSERT(graph.WouldCreateCycle("A1"_pos, std::vector{"C1"_pos}));
+    ASSERT(graph.WouldCreateCycle("A1"_pos, std::vector{"A1"_pos}));
+    ASSERT(!graph.WouldCreateCycle("D1"_pos, std::vector{"C1"_pos}));
+
+    auto b1 = graph.Find("B1"_pos);
+    ASSERT(b1.has_value());
+    ASSERT_EQUAL(graph.GetPrecedents(*b1).size(), 2u);
+    ASSERT_EQUAL(graph.GetPosition(graph.GetDependents(*b1).front()), "C1"_pos);
+
+    graph.SetReferences("B1"_pos, std::vector{"A2"_pos});
+    ASSERT(!graph.Find("A1"_pos).has_value());
+    graph.SetReferences("C1"_pos, {});
+    graph.SetReferences("B1"_pos, {});
+    ASSERT_EQUAL(graph.GetNodeCount(), 0u);
+}
+
+void TestRecalculateLongChain() {
+    Sheet sheet;
+    constexpr int chain_length = 40000;
+    auto link = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+    sheet.SetCell(link(0), "1");
+    for (int i = 1; i < chain_length; ++i) {
+        sheet.SetCell(link(i), "=" + link(i - 1).ToString() + "+1");
+    }
+    sheet.SetCell("Z1"_pos, "=A1*2");
+
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, static_cast<size_t>(chain_length));
+    ASSERT_EQUAL(sheet.GetCell(link(chain_length - 1))->GetValue(),
+                 CellInterface::Value(static_cast<double>(chain_length)));
+
+    sheet.SetCell("A1"_pos, "2");
+    sheet.ResetCacheStatistics();
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCacheStatistics().recomputes, static_cast<size_t>(chain_length));
+    ASSERT_EQUAL(sheet.GetCell(link(chain_length - 1))->GetValue(),
+                 CellInterface::Value(static_cast<double>(chain_length + 1)));
+    ASSERT_EQUAL(sheet.GetCell("Z1"_pos)->GetValue(), CellInterface::Value(4.0));
+}
+
+void TestParallelRecalculate() {
+    Sheet sheet;
+    sheet.SetThreadCount(4);
+    ASSERT_EQUAL(sheet.GetThreadCount(), 4u);
+
+    constexpr int rows = 5000;
+    sheet.SetCell("E1"_pos, "3");
+    for (int row = 0; row < rows; ++row) {
+        const std::string a = Position{row, 0}.ToString();
+        const std::string b = Position{row, 1}.ToString();
+        sheet.SetCell(Position{row, 0}, std::to_string(row));
+        sheet.SetCell(Position{row, 1}, "=" + a + "*E1");
+        sheet.SetCell(Position{row, 2}, "=" + b + "+" + a);
+    }
+    sheet.SetCell("D1"_pos, "=C1+C4999");
+
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, static_cast<size_t>(2 * rows + 1));
+    ASSERT_EQUAL(sheet.GetCell("C4999"_pos)->GetValue(), CellInterface::Value(4998.0 * 4));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(4998.0 * 4));
+
+    sheet.SetCell("E1"_pos, "1");
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(4998.0 * 2));
+
+    sheet.SetThreadCount(1);
+    ASSERT_EQUAL(sheet.GetThreadCount(), 1u);
+}
+
+void TestFormulaProgram() {
+    auto reformat = [](std::string expr) {
+        return ParseFormula(std::move(expr))->GetExpression();
+    };
+    ASSERT_EQUAL(reformat("-(1+2)*A1"), "-(1+2)*A1");
+    ASSERT_EQUAL(reformat("1-(2-3)"), "1-(2-3)");
+    ASSERT_EQUAL(reformat("(1/2)/(3*4)"), "1/2/(3*4)");
+    ASSERT_EQUAL(reformat("+(1+2)/-B2"), "+(1+2)/-B2");
+
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    // right-nested expression needs a deeper evaluation stack than the inline one
+    std::string deep = "A1";
+    for (int i = 0; i < 40; ++i) {
+        deep = "1+(" + deep + ")";
+    }
+    auto formula = ParseFormula(deep);
+    ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), 42.0);
+    ASSERT_EQUAL(formula->GetReferencedCells(), std::vector{"A1"_pos});
+
+    // references are resolved once and looked up again after cells appear
+    auto b1 = ParseFormula("B1*2");
+    ASSERT_EQUAL(std::get<double>(b1->Evaluate(*sheet)), 0.0);
+    sheet->SetCell("B1"_pos, "3");
+    ASSERT_EQUAL(std::get<double>(b1->Evaluate(*sheet)), 6.0);
+    sheet->SetCell("B1"_pos, "4");
+    ASSERT_EQUAL(std::get<double>(b1->Evaluate(*sheet)), 8.0);
+    sheet->ClearCell("B1"_pos);
+    ASSERT_EQUAL(std::get<double>(b1->Evaluate(*sheet)), 0.0);
+}
+
+void TestErrorPropagation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=1/0");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("A3"_pos, "=A2*0");
+    sheet->SetCell("B1"_pos, ".");
+    sheet->SetCell("B2"_pos, "=B1");
+    sheet->SetCell("B3"_pos, "=B2/0");
+
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+
+    sheet->SetCell("A1"_pos, "=4/2");
+    sheet->SetCell("B1"_pos, "1.5");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(1.5));
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+}
+void TestBatchParsing() {
+    // the parser of this thread is reused after a failed input
+    try {
+        ParseFormula("1+");
+        ASSERT(false);
+    }
+    catch (const FormulaException&) {
+    }
+    ASSERT_EQUAL(ParseFormula("(A1+B2)*3")->GetExpression(), "(A1+B2)*3");
+
+    std::vector<std::string> expressions;
+    for (int i = 0; i < 2000; ++i) {
+        expressions.push_back("A" + std::to_string(i + 1) + "*(" + std::to_string(i) + "+B1)");
+    }
+    for (size_t threads : { 1u, 4u }) {
+        auto formulas = ParseFormulas(expressions, threads);
+        ASSERT_EQUAL(formulas.size(), expressions.size());
+        for (size_t i = 0; i < formulas.size(); ++i) {
+            ASSERT_EQUAL(formulas[i]->GetExpression(), expressions[i]);
+        }
+    }
+
+    expressions[1500] = "A1+*2";
+    expressions[700] = "ZZZZ1";
+    try {
+        ParseFormulas(expressions, 4);
+        ASSERT(false);
+    }
+    catch (const FormulaException& e) {
+        ASSERT_EQUAL(std::string(e.what()), "Formula parse error at index 700");
+    }
+}
+// Every expression must either fail with both backends or produce the same
+// program with both; ANTLR is the reference.
+void TestNativeParser() {
+    auto parse = [](const std::string& expr, FormulaParserBackend backend) -> std::optional<FormulaAST> {
+        try {
+            return ParseFormulaAST(expr, backend);
+        }
+        catch (const std::exception&) {
+            return std::nullopt;
+        }
+    };
+    auto check = [&](const std::string& expr) {
+        auto reference = parse(expr, FormulaParserBackend::Antlr);
+        auto native = parse(expr, FormulaParserBackend::Native);
+        ASSERT_EQUAL(reference.has_value(), native.has_value());
+        if (!reference) {
+            return;
+        }
+        std::ostringstream reference_text;
+        std::ostringstream native_text;
+        reference->PrintFormula(reference_text);
+        native->PrintFormula(native_text);
+        ASSERT_EQUAL(reference_text.str(), native_text.str());
+        ASSERT_EQUAL(reference->GetCells().ToVector(), native->GetCells().ToVector());
+        ASSERT_EQUAL(reference->GetRanges().ToVector(), native->GetRanges().ToVector());
+        const auto reference_program = reference->GetProgram();
+        const auto native_program = native->GetProgram();
+        ASSERT_EQUAL(reference_program.size(), native_program.size());
+        for (size_t i = 0; i < reference_program.size(); ++i) {
+            ASSERT(reference_program[i].op == native_program[i].op);
+            ASSERT_EQUAL(reference_program[i].arg, native_program[i].arg);
+        }
+        const std::vector<double> values(reference->GetCells().size(), 1.5);
+        const std::vector<ASTImpl::RangeStats> stats(reference->GetRanges().size(), { 6, 1, 3, 3 });
+        const auto reference_result = reference->Execute(values.data(), stats.data());
+        const auto native_result = native->Execute(values.data(), stats.data());
+        ASSERT(reference_result == native_result);
+    };
+
+    for (const char* expr : { "1", "-A1*2", "1-2-3", "8/4/2", "+-+1", "((A1))", " 1 +\t2\n", "1e3", ".5E-1",
+                              "1.", "1e", "1E+", "A1B2", "a1", "A0", "ZZZZ1", "()", "1+", "(1", "1)", "",
+                              "SUM(A1:B2)", "-AVG(B2:A1,1)*2", "MIN(A1,A1*2:B1)", "MAX((A1):B1)", "SUM1",
+                              "SUM(A1)", "SUM()", "SUM(1,)", "SUM A1", "SUMA1", "SUMX(1)", "MAX(A1+B1,C1:C1)",
+                              "AVG(MIN(A1:A9),SUM(A1,B1:C2))", "SUM(A1:A0)", "A1:B2", "(SUM)(1)",
+                              "1E-400", "2.5e-330", "4e-320", "-1E-400*A1", "1e308", "1e400", "1.8e308",
+                              "A1+1E999" }) {
+        check(expr);
+    }
+
+    // random token soup, mostly invalid, plus random well-formed expressions
+    std::mt19937 random(12);
+    const std::vector<std::string> tokens = { "(", ")", "+", "-", "*", "/", "A1", "B22", "ZZ9", "AAAA1", "A0",
+                                              "7", "2.5", ".5", "1e3", "3E-2", " ", "1.", "x", "E", "SUM(",
+                                              "MAX(", ":", "," };
+    for (int i = 0; i < 3000; ++i) {
+        std::string expr;
+        const size_t length = random() % 10 + 1;
+        for (size_t j = 0; j < length; ++j) {
+            expr += tokens[random() % tokens.size()];
+        }
+        check(expr);
+    }
+
+    std::function<std::string(int)> generate = [&](int depth) -> std::string {
+        switch (depth > 0 ? random() % 5 : random() % 2) {
+        case 0:
+            return std::to_string(random() % 100) + (random() % 2 ? ".25" : "");
+        case 1:
+            return Position{ static_cast<int>(random() % 50), static_cast<int>(random() % 30) }.ToString();
+        case 2:
+            return std::string(random() % 2 ? "-" : "+") + generate(depth - 1);
+        case 3:
+            return "(" + generate(depth - 1) + ")";
+        case 4:
+            if (random() % 3 == 0) {
+                return std::string(random() % 2 ? "SUM(" : "MIN(") + generate(depth - 1) + ",B2:"
+                       + Position{ static_cast<int>(random() % 50), static_cast<int>(random() % 30) }.ToString()
+                       + ")";
+            }
+            [[fallthrough]];
+        default:
+            return generate(depth - 1) + "+-*/"[random() % 4] + generate(depth - 1);
+        }
+    };
+    for (int i = 0; i < 1000; ++i) {
+        const std::string expr = generate(6);
+        ASSERT(parse(expr, FormulaParserBackend::Native).has_value());
+        check(expr);
+    }
+
+    const auto backend = GetDefaultFormulaParserBackend();
+    SetDefaultFormulaParserBackend(FormulaParserBackend::Native);
+    ASSERT_EQUAL(ParseFormula("1+(2*A1)")->GetExpression(), "1+2*A1");
+    ASSERT_EQUAL(ParseFormula("1E-400")->GetExpression(), "0");
+    SetDefaultFormulaParserBackend(backend);
+}
+void TestFormulaStorage() {
+    FormulaAST ast = ParseFormulaAST("B2*2.5+A1/(B2-7)+A1");
+    const auto program = ast.GetProgram();
+    const auto cells = ast.GetCells();
+    ASSERT_EQUAL(cells.ToVector(), (std::vector{ "A1"_pos, "B2"_pos }));
+    ASSERT_EQUAL(program.size(), 11u);
+    // the program and the cells share one block
+    ASSERT(static_cast<const void*>(program.data() + program.size()) == static_cast<const void*>(cells.data()));
+
+    // moving the formula keeps the block in place
+    FormulaAST moved = std::move(ast);
+    ASSERT(moved.GetProgram().data() == program.data());
+    const double values[] = { 4, 9 };
+    ASSERT(moved.Execute(values) == FormulaAST::Result(9 * 2.5 + 4.0 / 2 + 4));
+
+    // resetting a cell over and over frees the previous formula each time
+    auto sheet = CreateSheet();
+    for (int i = 0; i < 1000; ++i) {
+        sheet->SetCell("C1"_pos, "=A1+" + std::to_string(i));
+    }
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetText(), "=A1+999");
+}
+void TestFormulaTemplates() {
+    Sheet sheet;
+    const auto& templates = sheet.GetFormulaTemplates();
+    for (int row = 0; row < 1000; ++row) {
+        const std::string n = std::to_string(row + 1);
+        sheet.SetCell({ row, 0 }, n);
+        sheet.SetCell({ row, 1 }, "2");
+        sheet.SetCell({ row, 2 }, row % 2 ? "=A" + n + "*B" + n : "=A" + n + " * B" + n);
+    }
+    ASSERT_EQUAL(templates.GetTemplateCount(), 1u);
+    ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetValue(), CellInterface::Value(1000.0));
+    ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetText(), "=A500*B500");
+    ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetReferencedCells(), (std::vector{ "A500"_pos, "B500"_pos }));
+
+    // references above and to the left of the anchor; 1E5 is a number, not E5
+    sheet.SetCell("E10"_pos, "=A1+1E5");
+    sheet.SetCell("E11"_pos, "=A2+1E5");
+    ASSERT_EQUAL(templates.GetTemplateCount(), 2u);
+    ASSERT_EQUAL(sheet.GetCell("E11"_pos)->GetText(), "=A2+100000");
+    ASSERT_EQUAL(sheet.GetCell("E11"_pos)->GetValue(), CellInterface::Value(100002.0));
+
+    // tokens are kept apart in the key
+    sheet.SetCell("F1"_pos, "=12");
+    try {
+        sheet.SetCell("F2"_pos, "=1 2");
+        ASSERT(false);
+    }
+    catch (const FormulaException&) {
+    }
+
+    for (int row = 0; row < 1000; ++row) {
+        sheet.ClearCell({ row, 2 });
+    }
+    ASSERT_EQUAL(templates.GetTemplateCount(), 2u);
+}
+void TestRangeFunctions() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "2");
+    sheet->SetCell("B1"_pos, "3");
+    sheet->SetCell("B2"_pos, "=A1+A2");
+    sheet->SetCell("C1"_pos, "=SUM(A1:B2)");
+    sheet->SetCell("C2"_pos, "=AVG(B2:A1)");
+    sheet->SetCell("C3"_pos, "=MIN(A1:B2,0.5)");
+    sheet->SetCell("C4"_pos, "=MAX(A1:A2,B1*2)+1");
+    // A3 does not exist and counts as zero
+    sheet->SetCell("C5"_pos, "=SUM(A1:A3)");
+    sheet->SetCell("C6"_pos, "=SUM((1+2)*A1,A1:A2)/AVG(A1:A3)");
+    sheet->SetCell("D1"_pos, "=C1*2");
+
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(9.0));
+    ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetValue(), CellInterface::Value(2.25));
+    ASSERT_EQUAL(sheet->GetCell("C3"_pos)->GetValue(), CellInterface::Value(0.5));
+    ASSERT_EQUAL(sheet->GetCell("C4"_pos)->GetValue(), CellInterface::Value(7.0));
+    ASSERT_EQUAL(sheet->GetCell("C5"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(sheet->GetCell("C6"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(18.0));
+    ASSERT(sheet->GetCell("A3"_pos) == nullptr);
+
+    ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetText(), "=AVG(A1:B2)");
+    ASSERT_EQUAL(sheet->GetCell("C4"_pos)->GetText(), "=MAX(A1:A2,B1*2)+1");
+    ASSERT_EQUAL(sheet->GetCell("C6"_pos)->GetText(), "=SUM((1+2)*A1,A1:A2)/AVG(A1:A3)");
+    ASSERT(sheet->GetCell("C1"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(sheet->GetCell("C4"_pos)->GetReferencedCells(), std::vector{ "B1"_pos });
+    ASSERT_EQUAL(ParseFormula("SUM(B2:A1,C3)")->GetReferencedRanges(),
+                 (std::vector{ Range{ "A1"_pos, "B2"_pos } }));
+
+    // changes inside a range reach the formula and its dependents, also for
+    // cells created after the formula
+    sheet->SetCell("A3"_pos, "10");
+    ASSERT_EQUAL(sheet->GetCell("C5"_pos)->GetValue(), CellInterface::Value(13.0));
+    sheet->SetCell("A1"_pos, "5");
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(17.0));
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(34.0));
+
+    // errors of the cells in a range propagate
+    sheet->SetCell("A2"_pos, "text");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    sheet->SetCell("A2"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(17.0));
+
+    // cycles through ranges are rejected and leave the sheet unchanged
+    auto expect_cycle = [&sheet](Position pos, const std::string& text) {
+        try {
+            sheet->SetCell(pos, text);
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+    };
+    expect_cycle("E1"_pos, "=SUM(D1:E1)");
+    expect_cycle("A1"_pos, "=D1");
+    sheet->SetCell("F5"_pos, "=MAX(G1:G9)");
+    expect_cycle("G3"_pos, "=F5+1");
+    ASSERT(sheet->GetCell("E1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "5");
+    ASSERT(sheet->GetCell("G3"_pos) == nullptr);
+
+    // invalid ranges
+    for (const char* text : { "=SUM(A1:)", "=SUM(A1:B)", "=A1:B2", "=SUM(A1:ZZZZZ1)" }) {
+        try {
+            sheet->SetCell("H1"_pos, text);
+            ASSERT(false);
+        }
+        catch (const FormulaException&) {
+        }
+    }
+
+    // a moving window copied down is one template
+    Sheet window;
+    for (int row = 0; row < 100; ++row) {
+        window.SetCell({ row, 0 }, "1");
+        window.SetCell({ row, 1 }, "=SUM(A" + std::to_string(row + 1) + ":A" + std::to_string(row + 3) + ")");
+    }
+    ASSERT_EQUAL(window.GetFormulaTemplates().GetTemplateCount(), 1u);
+    ASSERT_EQUAL(window.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(window.GetCell("B100"_pos)->GetValue(), CellInterface::Value(1.0));
+    window.SetCell("A100"_pos, "5");
+    ASSERT_EQUAL(window.GetCell("B98"_pos)->GetValue(), CellInterface::Value(7.0));
+    ASSERT_EQUAL(window.GetCell("B100"_pos)->GetValue(), CellInterface::Value(5.0));
+    ASSERT_EQUAL(window.GetCell("B98"_pos)->GetText(), "=SUM(A98:A100)");
+}
+void TestNumericColumns() {
+    NumericColumns columns;
+    std::vector<double> out(24, -1);
+    // nothing stored yet: zeros, without allocating
+    ASSERT(columns.Gather({ "A1"_pos, "C8"_pos }, out.data()));
+    ASSERT(std::all_of(out.begin(), out.end(), [](double x) { return x == 0; }));
+    ASSERT_EQUAL(columns.GetChunkCount(), 0u);
+
+    // a range across two chunks of two columns
+    columns.SetNumber({ 63, 1 }, 1.5);
+    columns.SetNumber({ 64, 1 }, 2.5);
+    columns.SetNumber({ 64, 2 }, -3);
+    ASSERT(columns.Gather({ { 62, 1 }, { 65, 2 } }, out.data()));
+    ASSERT_EQUAL(std::vector(out.begin(), out.begin() + 8), (std::vector<double>{ 0, 0, 1.5, 0, 2.5, -3, 0, 0 }));
+    columns.Invalidate({ 65, 2 });
+    ASSERT(!columns.Gather({ { 62, 1 }, { 65, 2 } }, out.data()));
+    ASSERT(columns.Gather({ { 62, 1 }, { 65, 1 } }, out.data()));
+    columns.SetNumber({ 65, 2 }, 4);
+    ASSERT(columns.Gather({ { 65, 2 }, { 65, 2 } }, out.data()));
+    ASSERT_EQUAL(out[0], 4.0);
+
+    // the sheet keeps its columns in sync with the cells
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "'2");
+    sheet.SetCell("A3"_pos, "=A1+A2");
+    sheet.SetCell("B1"_pos, "=SUM(A1:A4)");
+    const Range column{ "A1"_pos, "A4"_pos };
+    double values[4];
+    // A3 is not evaluated yet
+    ASSERT(!sheet.GetRangeNumbers(column, values));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT(sheet.GetRangeNumbers(column, values));
+    ASSERT_EQUAL(std::vector(values, values + 4), (std::vector<double>{ 1, 2, 3, 0 }));
+
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT(!sheet.GetRangeNumbers(column, values));
+    sheet.Recalculate();
+    ASSERT(sheet.GetRangeNumbers(column, values));
+    ASSERT_EQUAL(std::vector(values, values + 4), (std::vector<double>{ 5, 2, 7, 0 }));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(14.0));
+
+    // errors and texts are left to the cells
+    sheet.SetCell("A4"_pos, "text");
+    ASSERT(!sheet.GetRangeNumbers(column, values));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    sheet.ClearCell("A4"_pos);
+    sheet.SetCell("A2"_pos, "=1/0");
+    sheet.Recalculate();
+    ASSERT(!sheet.GetRangeNumbers(column, values));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+    sheet.ClearCell("A2"_pos);
+    sheet.Recalculate();
+    ASSERT(sheet.GetRangeNumbers(column, values));
+    ASSERT_EQUAL(std::vector(values, values + 4), (std::vector<double>{ 5, 0, 5, 0 }));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    // formulas evaluated in parallel are read by the next level of formulas
+    Sheet parallel;
+    parallel.SetThreadCount(4);
+    for (int row = 0; row < 2000; ++row) {
+        parallel.SetCell({ row, 0 }, "=" + std::to_string(row));
+    }
+    for (int row = 0; row < 1000; ++row) {
+        parallel.SetCell({ row, 1 }, "=SUM(A" + std::to_string(row + 1) + ":A" + std::to_string(row + 1000) + ")");
+    }
+    parallel.Recalculate();
+    ASSERT_EQUAL(parallel.GetCell("B1"_pos)->GetValue(), CellInterface::Value(499500.0));
+    ASSERT_EQUAL(parallel.GetCell("B1000"_pos)->GetValue(), CellInterface::Value(1498500.0));
+}
+void TestNumericText() {
+    ASSERT(ParseCellText("12") == std::optional(12.0));
+    ASSERT(ParseCellText("0.25") == std::optional(0.25));
+    ASSERT(ParseCellText(".5") == std::optional(0.5));
+    ASSERT(ParseCellText("3.") == std::optional(3.0));
+    ASSERT(ParseCellText("1.5.2") == std::optional(1.5));
+    for (const char* text : { "", ".", "..1", "1e3", "-1", " 1", "abc", "12a" }) {
+        ASSERT(!ParseCellText(text).has_value());
+    }
+    ASSERT(!ParseCellText(std::string(400, '9')).has_value());
+
+    auto sheet = CreateSheet();
+    const std::pair<const char*, CellInterface::NumericValue> cases[] = {
+        { "12", 12.0 },
+        { "'7", 7.0 },
+        { "1.5.2", 1.5 },
+        { "abc", FormulaError(FormulaError::Category::Value) },
+        { "1e3", FormulaError(FormulaError::Category::Value) },
+        { "'", FormulaError(FormulaError::Category::Value) },
+        { "=", FormulaError(FormulaError::Category::Value) },
+        { "=2*3", 6.0 },
+        { "=1/0", FormulaError(FormulaError::Category::Arithmetic) },
+    };
+    for (const auto& [text, number] : cases) {
+        sheet->SetCell("A1"_pos, text);
+        sheet->SetCell("B1"_pos, "=A1");
+        ASSERT(sheet->GetCell("A1"_pos)->GetNumericValue() == number);
+        const auto value = sheet->GetCell("B1"_pos)->GetValue();
+        if (std::holds_alternative<double>(number)) {
+            ASSERT_EQUAL(value, CellInterface::Value(std::get<double>(number)));
+        }
+        else {
+            ASSERT_EQUAL(value, CellInterface::Value(std::get<FormulaError>(number)));
+        }
+    }
+    sheet->ClearCell("A1"_pos);
+    ASSERT(sheet->GetCell("A1"_pos)->GetNumericValue() == CellInterface::NumericValue(0.0));
+}
+void TestBatchEdits() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    // edits are applied on commit, the last edit of a cell wins
+    sheet.BeginBatch();
+    ASSERT(sheet.IsInBatch());
+    for (int row = 1; row < 1000; ++row) {
+        sheet.SetCell({ row, 0 }, "=A" + std::to_string(row) + "+1");
+    }
+    sheet.SetCell("A1"_pos, "7");
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("C1"_pos, "=SUM(A1:A1000)");
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    sheet.CommitBatch();
+    ASSERT(!sheet.IsInBatch());
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("A1000"_pos)->GetValue(), CellInterface::Value(1004.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1000 * 5 + 999 * 1000 / 2.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1000, 3 }));
+
+    // a cycle anywhere in the batch rejects all of it
+    auto expect_cycle = [&sheet](const std::vector<std::pair<Position, std::string>>& edits) {
+        try {
+            sheet.SetCells(edits);
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT(!sheet.IsInBatch());
+    };
+    expect_cycle({ { "D1"_pos, "1" }, { "E1"_pos, "=F1" }, { "F1"_pos, "=E1" } });
+    expect_cycle({ { "D1"_pos, "1" }, { "A1"_pos, "=A999" } });
+    expect_cycle({ { "D1"_pos, "1" }, { "A1"_pos, "=C1" } });
+    expect_cycle({ { "E5"_pos, "=MAX(E1:E9)" } });
+    expect_cycle({ { "G5"_pos, "=G5" } });
+    expect_cycle({ { "D1"_pos, "1" }, { "G6"_pos, "=G6+1" } });
+    // a self-reference leaves no node behind that later cells would share
+    sheet.SetCell("H1"_pos, "=G5+1");
+    sheet.SetCell("H2"_pos, "=G6+1");
+    sheet.SetCell("G5"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("H1"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(sheet.GetCell("H2"_pos)->GetValue(), CellInterface::Value(1.0));
+    sheet.ClearCell("H1"_pos);
+    sheet.ClearCell("H2"_pos);
+    sheet.ClearCell("G5"_pos);
+    {
+        DependencyGraph graph;
+        const Position self = "A1"_pos;
+        graph.SetReferences(self, { &self, 1 });
+        graph.SetReferences(self, {});
+        ASSERT_EQUAL(graph.GetNodeCount(), 0u);
+        const Position b1 = "B1"_pos;
+        const Position c1 = "C1"_pos;
+        graph.SetReferences(c1, { &b1, 1 });
+        ASSERT(*graph.Find(b1) != *graph.Find(c1));
+    }
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("F1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "5");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1000, 3 }));
+
+    // so does an invalid formula
+    try {
+        sheet.SetCells({ { "D1"_pos, "1" }, { "A1"_pos, "=1+" } });
+        ASSERT(false);
+    }
+    catch (const FormulaException&) {
+    }
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+
+    // the graph is as before: edits of A1 still reach its dependents
+    sheet.SetCell("A1"_pos, "0");
+    ASSERT_EQUAL(sheet.GetCell("A1000"_pos)->GetValue(), CellInterface::Value(999.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // formulas replaced in a batch are invalidated once and recalculated
+    sheet.ResetCacheStatistics();
+    sheet.SetCells({ { "A500"_pos, "=1000" }, { "A1"_pos, "1" }, { "A1000"_pos, "=A999*0" } });
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell("A999"_pos)->GetValue(), CellInterface::Value(1499.0));
+    ASSERT_EQUAL(sheet.GetCell("A1000"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+    // every formula once: A2:A1000, B1 and C1
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 999u + 2u);
+
+    // cleared cells go away unless they are referenced
+    sheet.BeginBatch();
+    sheet.ClearCell("C1"_pos);
+    sheet.ClearCell("B1"_pos);
+    sheet.ClearCell("A2"_pos);
+    sheet.CommitBatch();
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("A2"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1000, 1 }));
+
+    // misuse
+    sheet.BeginBatch();
+    try {
+        sheet.BeginBatch();
+        ASSERT(false);
+    }
+    catch (const std::logic_error&) {
+    }
+    sheet.CancelBatch();
+    try {
+        sheet.CommitBatch();
+        ASSERT(false);
+    }
+    catch (const std::logic_error&) {
+    }
+    try {
+        sheet.SetCells({ { "D1"_pos, "1" }, { Position{ -1, 0 }, "1" } });
+        ASSERT(false);
+    }
+    catch (const InvalidPositionException&) {
+    }
+    ASSERT(!sheet.IsInBatch());
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+}
+// what PrintValues() and PrintTexts() wrote through an ostream per cell
+std::string StreamSheet(const SheetInterface& sheet, bool values) {
+    std::ostringstream out;
+    const Size size = sheet.GetPrintableSize();
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            if (col > 0) {
+                out << '\t';
+            }
+            if (const CellInterface* cell = sheet.GetCell({ row, col })) {
+                if (values) {
+                    out << cell->GetValue();
+                }
+                else {
+                    out << cell->GetText();
+                }
+            }
+        }
+        out << '\n';
+    }
+    return out.str();
+}
+
+void TestTsvExport() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=1/3");
+    sheet.SetCell("B1"_pos, "=1000000*1000");
+    sheet.SetCell("C1"_pos, "=0.1+0.2");
+    sheet.SetCell("D1"_pos, "=-2.5");
+    sheet.SetCell("A2"_pos, "=123456789");
+    sheet.SetCell("B2"_pos, "=1/0");
+    sheet.SetCell("C2"_pos, "'=escaped");
+    sheet.SetCell("D2"_pos, "=C3+A1");
+    sheet.SetCell("A3"_pos, "0.000012345678");
+    sheet.SetCell("D3"_pos, "text");
+    ASSERT(sheet.GetCell("C3"_pos) != nullptr);
+
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "0.333333\t1e+09\t0.3\t-2.5\n"
+                               "1.23457e+08\t#ARITHM!\t=escaped\t0.333333\n"
+                               "0.000012345678\t\t0\ttext\n");
+    ASSERT_EQUAL(values.str(), StreamSheet(sheet, true));
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), StreamSheet(sheet, false));
+
+    // the smallest buffer flushes after almost every cell
+    char small[TsvWriter::MAX_NUMBER_LENGTH];
+    std::ostringstream small_values;
+    sheet.ExportValues(small_values, { small, sizeof(small) });
+    ASSERT_EQUAL(small_values.str(), values.str());
+    sheet.SetCell("B3"_pos, std::string(100, 'x'));
+    std::ostringstream small_texts;
+    sheet.ExportTexts(small_texts, { small, sizeof(small) });
+    ASSERT_EQUAL(small_texts.str(), StreamSheet(sheet, false));
+    try {
+        sheet.ExportTexts(small_texts, { small, sizeof(small) - 1 });
+        ASSERT(false);
+    }
+    catch (const std::invalid_argument&) {
+    }
+
+    // blocks of rows rendered in parallel come out in order
+    Sheet serial;
+    Sheet parallel;
+    parallel.SetThreadCount(4);
+    const int rows = 5 * Sheet::EXPORT_BLOCK_ROWS + 17;
+    for (Sheet* target : { &serial, &parallel }) {
+        for (int row = 0; row < rows; ++row) {
+            target->SetCell({ row, 0 }, std::to_string(row));
+            if (row % 3 != 0) {
+                target->SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "/7");
+            }
+            if (row % 5 == 0) {
+                target->SetCell({ row, 3 }, "label" + std::to_string(row));
+            }
+        }
+    }
+    std::ostringstream serial_values;
+    std::ostringstream parallel_values;
+    serial.PrintValues(serial_values);
+    parallel.PrintValues(parallel_values);
+    ASSERT_EQUAL(parallel_values.str(), serial_values.str());
+    ASSERT_EQUAL(serial_values.str(), StreamSheet(serial, true));
+    std::ostringstream parallel_texts;
+    parallel.PrintTexts(parallel_texts);
+    ASSERT_EQUAL(parallel_texts.str(), StreamSheet(serial, false));
+}
+void TestSnapshot() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2.5");
+    sheet.SetCell("D1"_pos, "'=quoted");
+    sheet.SetCell("D2"_pos, "text");
+    for (int row = 0; row < 100; ++row) {
+        // copied down, one program shared by all of them
+        sheet.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2+SUM(A1:A2)");
+    }
+    sheet.SetCell("C1"_pos, "=1/0");
+    sheet.SetCell("C2"_pos, "=MAX(B1:B100,-(A1))+E5");
+    sheet.SetCell("C3"_pos, "=D2");
+    sheet.Recalculate();
+
+    std::stringstream with_values;
+    SaveSnapshot(sheet, with_values);
+    const std::string data = with_values.str();
+    auto loaded = LoadSnapshot({ data.data(), data.size() });
+    ASSERT_EQUAL(StreamSheet(*loaded, false), StreamSheet(sheet, false));
+    ASSERT_EQUAL(loaded->GetPrintableSize(), sheet.GetPrintableSize());
+    ASSERT(loaded->GetCell("E5"_pos) != nullptr);
+    ASSERT_EQUAL(loaded->GetCell("C2"_pos)->GetReferencedCells(), (std::vector{ "A1"_pos, "E5"_pos }));
+    ASSERT_EQUAL(loaded->GetFormulaTemplates().GetTemplateCount(), 0u);
+    // the cached values are restored, nothing is evaluated
+    loaded->Recalculate();
+    ASSERT_EQUAL(loaded->GetCacheStatistics().misses, 0u);
+    ASSERT_EQUAL(StreamSheet(*loaded, true), StreamSheet(sheet, true));
+    ASSERT_EQUAL(loaded->GetCell("C2"_pos)->GetValue(), CellInterface::Value(8.5));
+
+    // the dependency graph is restored too
+    loaded->SetCell("A2"_pos, "10");
+    ASSERT_EQUAL(loaded->GetCell("B1"_pos)->GetValue(), CellInterface::Value(13.0));
+    ASSERT_EQUAL(loaded->GetCell("C2"_pos)->GetValue(), CellInterface::Value(31.0));
+    try {
+        loaded->SetCell("A1"_pos, "=C2");
+        ASSERT(false);
+    }
+    catch (const CircularDependencyException&) {
+    }
+
+    std::stringstream without_values;
+    SaveSnapshot(sheet, without_values, false);
+    auto recomputed = LoadSnapshot({ without_values.str().data(), without_values.str().size() });
+    recomputed->Recalculate();
+    ASSERT_EQUAL(recomputed->GetCacheStatistics().misses, 103u);
+    ASSERT_EQUAL(StreamSheet(*recomputed, true), StreamSheet(sheet, true));
+
+    // through a file, mapped where possible
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test.snapshot").string();
+    SaveSnapshotFile(sheet, path);
+    auto from_file = LoadSnapshotFile(path);
+    ASSERT_EQUAL(StreamSheet(*from_file, true), StreamSheet(sheet, true));
+    std::ofstream(path, std::ios::trunc).close();
+    try {
+        LoadSnapshotFile(path);
+        ASSERT(false);
+    }
+    catch (const SnapshotError&) {
+    }
+    std::filesystem::remove(path);
+
+    // damaged snapshots are rejected or load as some other valid sheet
+    Sheet small;
+    small.SetCell("A1"_pos, "=SUM(B1:B2)+B3*2");
+    small.SetCell("B1"_pos, "text");
+    std::stringstream small_stream;
+    SaveSnapshot(small, small_stream);
+    const std::string small_data = small_stream.str();
+    for (size_t size = 0; size < small_data.size(); ++size) {
+        try {
+            LoadSnapshot({ small_data.data(), size });
+            ASSERT(false);
+        }
+        catch (const SnapshotError&) {
+        }
+    }
+    for (size_t i = 0; i < small_data.size(); ++i) {
+        for (const char bits : { 0x01, 0x40, -0x80 }) {
+            std::string damaged = small_data;
+            damaged[i] ^= bits;
+            try {
+                LoadSnapshot({ damaged.data(), damaged.size() });
+            }
+            catch (const SnapshotError&) {
+            }
+        }
+    }
+}
+void TestTextView() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "'=escaped");
+    sheet.SetCell("A2"_pos, "=1 + (A1)*2");
+    sheet.SetCell("A3"_pos, "=A1");
+    const CellInterface* formula = sheet.GetCell("A2"_pos);
+    ASSERT_EQUAL(formula->GetTextView(), "=1+A1*2");
+    ASSERT_EQUAL(formula->GetText(), "=1+A1*2");
+    // printed once, later calls see the same string
+    ASSERT(formula->GetTextView().data() == formula->GetTextView().data());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetTextView(), "'=escaped");
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    sheet.SetCell("B1"_pos, "=B2");
+    ASSERT(sheet.GetCell("B2"_pos)->GetTextView().empty());
+
+    // setting the canonical text again changes nothing
+    sheet.Recalculate();
+    sheet.ResetCacheStatistics();
+    sheet.SetCell("A2"_pos, "=1+A1*2");
+    ASSERT(sheet.GetCell("A2"_pos) == formula);
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 0u);
+    // another spelling of it is a new formula
+    sheet.SetCell("A2"_pos, "=1+(A1*2)");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetTextView(), "=1+A1*2");
+
+    // the text is printed once even if several threads ask for it first
+    Sheet parallel;
+    parallel.SetThreadCount(4);
+    for (int row = 0; row < 2 * Sheet::EXPORT_BLOCK_ROWS; ++row) {
+        parallel.SetCell({ row, 0 }, "=B" + std::to_string(row + 1) + "+1");
+    }
+    std::ostringstream texts;
+    parallel.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), StreamSheet(parallel, false));
+}
+void TestReferencedCellsView() {
+    Sheet sheet;
+    sheet.SetCell("C1"_pos, "=B1+A1+B1");
+    sheet.SetCell("C2"_pos, "=B2+A2+B2");
+    const CellInterface* c1 = sheet.GetCell("C1"_pos);
+    const auto view = c1->GetReferencedCellsView();
+    ASSERT_EQUAL(view.ToVector(), (std::vector{ "A1"_pos, "B1"_pos }));
+    ASSERT_EQUAL(c1->GetReferencedCells(), view.ToVector());
+    // stored once, not rebuilt per call
+    ASSERT(c1->GetReferencedCellsView().data() == view.data());
+    // C2 shares the program of C1 but has its own cells
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetReferencedCellsView().ToVector(), (std::vector{ "A2"_pos, "B2"_pos }));
+    ASSERT(sheet.GetCell("A1"_pos)->GetReferencedCellsView().empty());
+
+    auto formula = ParseFormula("D4*A1");
+    ASSERT_EQUAL(formula->GetReferencedCellsView().ToVector(), (std::vector{ "A1"_pos, "D4"_pos }));
+
+    // references that are not sorted still work with range edges around
+    DependencyGraph graph;
+    graph.SetReferences("B1"_pos, {}, std::vector{ Range{ "A1"_pos, "A5"_pos } });
+    graph.SetReferences("C1"_pos, std::vector{ "B1"_pos });
+    ASSERT(graph.WouldCreateCycle("A3"_pos, std::vector{ "Z9"_pos, "C1"_pos }));
+    ASSERT(!graph.WouldCreateCycle("A7"_pos, std::vector{ "Z9"_pos, "C1"_pos }));
+}
+void TestCycleDetection() {
+    // the graph against a plain search over the references it was given
+    std::mt19937 random(23);
+    std::uniform_int_distribution<int> coordinate(0, 4);
+    std::uniform_int_distribution<int> count(0, 3);
+    std::map<Position, std::pair<std::vector<Position>, std::vector<Range>>> model;
+    auto reaches = [&model](Position from, Position target) {
+        std::set<Position> visited;
+        std::vector<Position> stack{ from };
+        while (!stack.empty()) {
+            const Position pos = stack.back();
+            stack.pop_back();
+            if (pos == target) {
+                return true;
+            }
+            if (!visited.insert(pos).second) {
+                continue;
+            }
+            auto it = model.find(pos);
+            if (it == model.end()) {
+                continue;
+            }
+            stack.insert(stack.end(), it->second.first.begin(), it->second.first.end());
+            for (const Range& range : it->second.second) {
+                for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+                    for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                        stack.push_back({ row, col });
+                    }
+                }
+            }
+        }
+        return false;
+    };
+
+    DependencyGraph graph;
+    for (int step = 0; step < 5000; ++step) {
+        const Position cell{ coordinate(random), coordinate(random) };
+        std::vector<Position> references;
+        for (int i = count(random); i > 0; --i) {
+            references.push_back({ coordinate(random), coordinate(random) });
+        }
+        std::sort(references.begin(), references.end());
+        references.erase(std::unique(references.begin(), references.end()), references.end());
+        std::vector<Range> ranges;
+        if (count(random) == 0) {
+            ranges.push_back(Range::FromCorners({ coordinate(random), coordinate(random) },
+                                                { coordinate(random), coordinate(random) }));
+        }
+
+        bool expected = false;
+        for (const Position& reference : references) {
+            expected = expected || reaches(reference, cell);
+        }
+        for (const Range& range : ranges) {
+            for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+                for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                    expected = expected || reaches({ row, col }, cell);
+                }
+            }
+        }
+        ASSERT_EQUAL(graph.WouldCreateCycle(cell, references, ranges), expected);
+        if (!expected) {
+            graph.SetReferences(cell, references, ranges);
+            model[cell] = { references, ranges };
+        }
+    }
+
+    // long chains are walked without recursion
+    Sheet sheet;
+    constexpr int CHAIN_LENGTH = 50000;
+    auto chain_cell = [](int i) {
+        return Position{ i / 256, i % 256 };
+    };
+    for (int i = 1; i < CHAIN_LENGTH; ++i) {
+        sheet.SetCell(chain_cell(i), "=" + chain_cell(i - 1).ToString() + "+1");
+    }
+    try {
+        sheet.SetCell(chain_cell(0), "=" + chain_cell(CHAIN_LENGTH - 1).ToString());
+        ASSERT(false);
+    }
+    catch (const CircularDependencyException&) {
+    }
+    // ranks below the edited cell need no walk at all
+    sheet.SetCell(chain_cell(CHAIN_LENGTH), "=" + chain_cell(0).ToString() + "+SUM(A1:C3)");
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell(chain_cell(CHAIN_LENGTH - 1))->GetValue(), CellInterface::Value(double(CHAIN_LENGTH - 1)));
+}
+void TestPlaceholderCells() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1+C5*2");
+    // referenced positions get no cells, only the shared placeholder
+    ASSERT(sheet.GetConcreteCell("B1"_pos) == nullptr);
+    ASSERT(sheet.GetConcreteCell("C5"_pos) == nullptr);
+    ASSERT(sheet.GetCell("B1"_pos) == &PlaceholderCell::Get());
+    ASSERT(sheet.GetCell("C5"_pos) == &PlaceholderCell::Get());
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "");
+    ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // an empty text creates nothing
+    sheet.SetCell("C5"_pos, "");
+    sheet.SetCell("D1"_pos, "");
+    ASSERT(sheet.GetConcreteCell("C5"_pos) == nullptr);
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+
+    // text promotes a placeholder to a cell, clearing demotes it again
+    const uint64_t version = sheet.GetCellsVersion();
+    sheet.SetCell("C5"_pos, "3");
+    ASSERT(sheet.GetConcreteCell("C5"_pos) != nullptr);
+    ASSERT(sheet.GetCellsVersion() != version);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+    sheet.ClearCell("C5"_pos);
+    ASSERT(sheet.GetConcreteCell("C5"_pos) == nullptr);
+    ASSERT(sheet.GetCell("C5"_pos) == &PlaceholderCell::Get());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // placeholders print like empty cells did
+    sheet.SetCell("C1"_pos, "x");
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "0\t0\tx\n");
+    ASSERT_EQUAL(values.str(), StreamSheet(sheet, true));
+
+    // batches create no cells for references or empty texts either
+    sheet.SetCells({ { "D2"_pos, "=E7" }, { "E8"_pos, "" } });
+    ASSERT(sheet.GetConcreteCell("E7"_pos) == nullptr);
+    ASSERT(sheet.GetCell("E7"_pos) == &PlaceholderCell::Get());
+    ASSERT(sheet.GetCell("E8"_pos) == nullptr);
+
+    // dropped references leave nothing behind
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("C5"_pos) == nullptr);
+    ASSERT(!sheet.GetDependencyGraph().Find("B1"_pos));
+}
+
+void TestCompactCells() {
+    static_assert(sizeof(CellContents) <= 24);
+
+    Sheet sheet;
+    const std::string short_text(CellContents::SHORT_TEXT_CAPACITY, 'x');
+    const std::string long_text = short_text + "y";
+    sheet.SetCell("A1"_pos, short_text);
+    sheet.SetCell("A2"_pos, long_text);
+    sheet.SetCell("A3"_pos, "'12");
+    sheet.SetCell("A4"_pos, "1000");
+    sheet.SetCell("A5"_pos, "=A3+A4");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), short_text);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), long_text);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(std::string("12")));
+    ASSERT(sheet.GetCell("A3"_pos)->GetNumericValue() == CellInterface::NumericValue(12.0));
+    ASSERT(sheet.GetCell("A1"_pos)->GetNumericValue()
+           == CellInterface::NumericValue(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetValue(), CellInterface::Value(1012.0));
+    ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "=A3+A4");
+
+    ASSERT(CellContents("'12").GetKind() == CellContents::Kind::NUMBER_TEXT);
+    ASSERT(CellContents(short_text).GetKind() == CellContents::Kind::SHORT_TEXT);
+    ASSERT(CellContents("1234567.5").GetKind() == CellContents::Kind::LONG_TEXT);
+    ASSERT(CellContents("1234567.5").GetNumber() == std::optional<double>(1234567.5));
+    ASSERT(!CellContents(long_text).GetNumber());
+    sheet.SetCell("A6"_pos, "1234567.5");
+    ASSERT(sheet.GetCell("A6"_pos)->GetNumericValue() == CellInterface::NumericValue(1234567.5));
+
+    // contents move between cells without copying the long text
+    CellContents moved(long_text);
+    CellContents target(short_text);
+    target = std::move(moved);
+    ASSERT(target.GetKind() == CellContents::Kind::LONG_TEXT);
+    ASSERT_EQUAL(std::string(target.GetText()), long_text);
+    ASSERT(moved.GetKind() == CellContents::Kind::EMPTY);
+
+    // formula records are released by replaced, cleared and rejected cells
+    const FormulaTable& formulas = sheet.GetFormulaTable();
+    ASSERT_EQUAL(formulas.GetSize(), 1u);
+    sheet.SetCell("B1"_pos, "=A5*2");
+    sheet.SetCell("B2"_pos, "=B1+1");
+    ASSERT_EQUAL(formulas.GetSize(), 3u);
+    sheet.SetCell("B1"_pos, "=A5*3");
+    ASSERT_EQUAL(formulas.GetSize(), 3u);
+    try {
+        sheet.SetCell("B1"_pos, "=B2");
+        ASSERT(false);
+    }
+    catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(formulas.GetSize(), 3u);
+    try {
+        sheet.SetCells({ { "C1"_pos, "=C2" }, { "C2"_pos, "=C1" } });
+        ASSERT(false);
+    }
+    catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(formulas.GetSize(), 3u);
+    sheet.SetCell("B2"_pos, "text");
+    sheet.ClearCell("B1"_pos);
+    ASSERT_EQUAL(formulas.GetSize(), 1u);
+    ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetValue(), CellInterface::Value(1012.0));
+}
+
+void TestValueChangeCutoff() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=1+1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    for (int row = 1; row < 100; ++row) {
+        sheet.SetCell({ row, 1 }, "=" + Position{ row - 1, 1 }.ToString() + "+1");
+    }
+    sheet.SetCell("C1"_pos, "=SUM(B1:B100)");
+    sheet.Recalculate();
+
+    // the same value in another form: only the edited formula is evaluated
+    sheet.ResetCacheStatistics();
+    sheet.SetCell("A1"_pos, "=2");
+    sheet.Recalculate();
+    Sheet::CacheStatistics stats = sheet.GetCacheStatistics();
+    ASSERT_EQUAL(stats.invalidated, 101u);
+    ASSERT_EQUAL(stats.misses, 1u);
+    ASSERT_EQUAL(stats.unchanged, 1u);
+    ASSERT_EQUAL(stats.cut_off, 101u);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(100.0 * 4 + 99.0 * 100 / 2));
+
+    // a new value goes all the way
+    sheet.ResetCacheStatistics();
+    sheet.SetCell("A1"_pos, "=3");
+    sheet.Recalculate();
+    stats = sheet.GetCacheStatistics();
+    ASSERT_EQUAL(stats.misses, 102u);
+    ASSERT_EQUAL(stats.cut_off, 0u);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(100.0 * 6 + 99.0 * 100 / 2));
+
+    // read lazily, the chain is confirmed link by link
+    sheet.ResetCacheStatistics();
+    sheet.SetCell("A1"_pos, "=1+2");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(8.0));
+    stats = sheet.GetCacheStatistics();
+    ASSERT_EQUAL(stats.misses, 1u);
+    ASSERT_EQUAL(stats.cut_off, 3u);
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 1u);
+
+    // a text with the same number leaves the formulas alone
+    sheet.SetCell("D1"_pos, "5");
+    sheet.SetCell("D2"_pos, "=D1*0");
+    sheet.SetCell("D3"_pos, "=D2+1");
+    sheet.Recalculate();
+    sheet.ResetCacheStatistics();
+    sheet.SetCell("D1"_pos, "5.0");
+    ASSERT_EQUAL(sheet.GetCacheStatistics().invalidated, 0u);
+    // a new number that the first formula absorbs
+    sheet.SetCell("D1"_pos, "7");
+    sheet.Recalculate();
+    stats = sheet.GetCacheStatistics();
+    ASSERT_EQUAL(stats.invalidated, 2u);
+    ASSERT_EQUAL(stats.misses, 1u);
+    ASSERT_EQUAL(stats.unchanged, 1u);
+    ASSERT_EQUAL(stats.cut_off, 1u);
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    // a formula with no node of its own that only a range references
+    {
+        Sheet ranged;
+        ranged.SetCell("A1"_pos, "=5");
+        ranged.SetCell("B1"_pos, "=SUM(A1:A2)");
+        std::ostringstream before;
+        ranged.PrintValues(before);
+        ASSERT_EQUAL(before.str(), "5\t5\n");
+        ranged.SetCell("A1"_pos, "=1+2");
+        std::ostringstream after;
+        ranged.PrintValues(after);
+        ASSERT_EQUAL(after.str(), "3\t3\n");
+        ranged.SetCell("A1"_pos, "=2+2");
+        ranged.Recalculate();
+        ASSERT_EQUAL(ranged.GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0));
+    }
+
+    // a formula recomputed twice, with a new value and then with the same
+    // one: the second cutoff must not hide the first change
+    sheet.SetCell("E1"_pos, "2");
+    sheet.SetCell("E2"_pos, "=E1*E1");
+    sheet.SetCell("E3"_pos, "=E2+1");
+    sheet.Recalculate();
+    for (bool recalculate : { false, true }) {
+        const double value = recalculate ? 4 : 3;
+        sheet.SetCell("E1"_pos, std::to_string(static_cast<int>(value)));
+        ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetValue(), CellInterface::Value(value * value));
+        sheet.SetCell("E1"_pos, "=-" + std::to_string(static_cast<int>(value)));
+        sheet.ResetCacheStatistics();
+        if (recalculate) {
+            sheet.Recalculate();
+        }
+        else {
+            ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetValue(), CellInterface::Value(value * value));
+        }
+        ASSERT_EQUAL(sheet.GetCacheStatistics().unchanged, 1u);
+        ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetValue(), CellInterface::Value(value * value + 1));
+    }
+
+    // random edits against the same texts entered into a fresh sheet
+    std::mt19937 random(26);
+    std::uniform_int_distribution<int> coordinate(0, 3);
+    std::uniform_int_distribution<int> kind(0, 5);
+    Sheet edited;
+    for (int step = 0; step < 2000; ++step) {
+        const Position pos{ coordinate(random), coordinate(random) };
+        const std::string ref = Position{ coordinate(random), coordinate(random) }.ToString();
+        const std::string texts[] = {
+            std::to_string(coordinate(random)),
+            "=" + ref + "*0+" + std::to_string(coordinate(random)),
+            "=" + ref + "+1",
+            "=SUM(A1:" + ref + ")",
+            "=1/" + ref,
+            "",
+        };
+        try {
+            edited.SetCell(pos, texts[kind(random)]);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        // a few edits pile up between the checks, which read lazily or
+        // after a recalculation
+        if (step % 4 != 3) {
+            continue;
+        }
+        if (step % 8 == 3) {
+            edited.Recalculate();
+        }
+        Sheet fresh;
+        for (int row = 0; row < 4; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                if (const CellInterface* cell = edited.GetCell({ row, col })) {
+                    fresh.SetCell({ row, col }, cell->GetText());
+                }
+            }
+        }
+        for (int row = 0; row < 4; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                const CellInterface* cell = edited.GetCell({ row, col });
+                if (cell && !cell->GetText().empty()) {
+                    ASSERT_EQUAL(cell->GetValue(), fresh.GetCell({ row, col })->GetValue());
+                }
+            }
+        }
+    }
+}
+
+void TestViewportValues() {
+    using View = Cell::ValueView;
+    Sheet sheet;
+    // deep enough to overflow the stack if evaluated recursively
+    const int chain_length = 50000;
+    sheet.SetCell(Position{ 1000, 0 }, "1");
+    for (int i = 1; i < chain_length; ++i) {
+        const Position prev{ 1000 + (i - 1) / 256, (i - 1) % 256 };
+        sheet.SetCell(Position{ 1000 + i / 256, i % 256 }, "=" + prev.ToString() + "+1");
+    }
+    sheet.SetCell("A1"_pos, "=B1+Z1");
+    sheet.SetCell("B1"_pos, "text");
+    sheet.SetCell("C1"_pos, "=SUM(E1:E3)");
+    sheet.SetCell("E1"_pos, "=1+1");
+    sheet.SetCell("E3"_pos, "=E1*3");
+    sheet.SetCell("A50"_pos, "=E1+100");
+
+    std::vector<View> values(2 * 3);
+    sheet.ResetCacheStatistics();
+    sheet.GetValues("A1"_pos, { 2, 3 }, { values.data(), values.size() });
+    ASSERT(values[0] == View(FormulaError(FormulaError::Category::Value)));
+    ASSERT(values[1] == View(std::string_view("text")));
+    ASSERT(values[2] == View(8.0));
+    for (size_t i = 3; i < values.size(); ++i) {
+        ASSERT(std::holds_alternative<std::monostate>(values[i]));
+    }
+    // A1, C1 and the formulas of E1:E3, nothing else
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 4u);
+    ASSERT(!sheet.GetConcreteCell("A50"_pos)->IsCacheValid());
+    ASSERT(!sheet.GetConcreteCell(Position{ 1000, 1 })->IsCacheValid());
+
+    const Position last{ 1000 + (chain_length - 1) / 256, (chain_length - 1) % 256 };
+    sheet.GetValues(last, { 1, 1 }, { values.data(), 1 });
+    ASSERT(values[0] == View(static_cast<double>(chain_length)));
+    ASSERT(!sheet.GetConcreteCell("A50"_pos)->IsCacheValid());
+
+    // an edit leaves the area stale again, like GetValue() would see it
+    sheet.SetCell("E1"_pos, "=5");
+    sheet.GetValues("C1"_pos, { 1, 1 }, { values.data(), 1 });
+    ASSERT(values[0] == View(20.0));
+    ASSERT(sheet.GetCell("A50"_pos)->GetValue() == CellInterface::Value(105.0));
+
+    try {
+        sheet.GetValues("A1"_pos, { 3, 3 }, { values.data(), values.size() });
+        ASSERT(false);
+    }
+    catch (const std::invalid_argument&) {
+    }
+    try {
+        sheet.GetValues(Position{ Position::MAX_ROWS - 1, 0 }, { 2, 1 }, { values.data(), values.size() });
+        ASSERT(false);
+    }
+    catch (const InvalidPositionException&) {
+    }
+}
+
+void TestConcurrentReaders() {
+    // B = 2 * A in one of two forms, C1 sums B, D = B + 1; readers check
+    // that every state they see is consistent while a writer edits
+    const int rows = 64;
+    Sheet sheet;
+    sheet.SetThreadCount(2);
+    for (int row = 0; row < rows; ++row) {
+        const std::string a = Position{ row, 0 }.ToString();
+        sheet.SetCell({ row, 0 }, std::to_string(row));
+        sheet.SetCell({ row, 1 }, "=" + a + "*2");
+        sheet.SetCell({ row, 3 }, "=" + Position{ row, 1 }.ToString() + "+1");
+    }
+    sheet.SetCell("C1"_pos, "=SUM(B1:B" + std::to_string(rows) + ")");
+
+    const auto number = [&sheet](Position pos) {
+        return std::get<double>(sheet.GetCell(pos)->GetNumericValue());
+    };
+    std::atomic<bool> done{ false };
+    std::atomic<int> failures{ 0 };
+    const auto read = [&](unsigned seed) {
+        std::mt19937 random(seed);
+        std::vector<Cell::ValueView> values(rows);
+        std::ostringstream out;
+        while (!done) {
+            auto lock = sheet.LockForReading();
+            const int row = static_cast<int>(random() % rows);
+            switch (random() % 4) {
+            case 0:
+                sheet.Recalculate();
+                break;
+            case 1:
+                sheet.GetValues({ 0, 3 }, { rows, 1 }, { values.data(), values.size() });
+                break;
+            case 2:
+                out.str({});
+                sheet.PrintValues(out);
+                break;
+            default:
+                break;
+            }
+            double sum = 0;
+            for (int i = 0; i < rows; ++i) {
+                sum += 2 * number({ i, 0 });
+            }
+            if (number({ row, 3 }) != 2 * number({ row, 0 }) + 1 || number("C1"_pos) != sum) {
+                ++failures;
+            }
+        }
+    };
+    std::vector<std::thread> readers;
+    for (unsigned seed = 1; seed <= 3; ++seed) {
+        readers.emplace_back(read, seed);
+    }
+    std::mt19937 random(7);
+    for (int edit = 0; edit < 300; ++edit) {
+        auto lock = sheet.LockForWriting();
+        const int row = static_cast<int>(random() % rows);
+        const std::string a = Position{ row, 0 }.ToString();
+        if (edit % 2 == 0) {
+            sheet.SetCell({ row, 0 }, std::to_string(random() % 100));
+        }
+        else {
+            // the same value, which readers confirm instead of evaluating
+            sheet.SetCell({ row, 1 }, edit % 4 == 1 ? "=" + a + "+" + a : "=" + a + "*2");
+        }
+        lock.unlock();
+        std::this_thread::yield();
+    }
+    done = true;
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    ASSERT_EQUAL(failures.load(), 0);
+}
+
+void TestReadDuringRecalculate() {
+    // B = A and C = B; a reader evaluates the dirty Bs while Recalculate()
+    // runs, which must not take a B it finds clean as unchanged and confirm
+    // the C after it with the old value
+    const int rows = 256;
+    Sheet sheet;
+    sheet.SetThreadCount(2);
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell({ row, 0 }, "0");
+        sheet.SetCell({ row, 1 }, "=" + Position{ row, 0 }.ToString());
+        sheet.SetCell({ row, 2 }, "=" + Position{ row, 1 }.ToString());
+    }
+    sheet.Recalculate();
+    for (int round = 1; round <= 40; ++round) {
+        {
+            auto lock = sheet.LockForWriting();
+            for (int row = 0; row < rows; ++row) {
+                sheet.SetCell({ row, 0 }, std::to_string(round));
+            }
+        }
+        std::thread reader([&sheet] {
+            auto lock = sheet.LockForReading();
+            for (int row = rows - 1; row >= 0; --row) {
+                sheet.GetCell({ row, 1 })->GetValue();
+            }
+        });
+        {
+            auto lock = sheet.LockForReading();
+            sheet.Recalculate();
+        }
+        reader.join();
+        for (int row = 0; row < rows; ++row) {
+            ASSERT_EQUAL(sheet.GetCell({ row, 2 })->GetValue(), CellInterface::Value(static_cast<double>(round)));
+        }
+    }
+}
+
+void TestSheetSnapshot() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1*2");
+    sheet.SetCell("B1"_pos, "text");
+    sheet.SetCell("C1"_pos, "=SUM(A1:A2)");
+    const auto before = sheet.TakeSnapshot();
+    sheet.SetCell("A1"_pos, "5");
+    sheet.ClearCell("B1"_pos);
+    sheet.SetCells({ { "D1"_pos, "=A2+1" }, { "C1"_pos, "=A1" } });
+    const auto after = sheet.TakeSnapshot();
+    sheet.SetCell("A1"_pos, "7");
+
+    const Sheet& old_sheet = before->GetSheet();
+    ASSERT_EQUAL(before->GetCellCount(), 4u);
+    ASSERT_EQUAL(old_sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(old_sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(old_sheet.GetCell("B1"_pos)->GetText(), "text");
+    ASSERT(old_sheet.GetCell("D1"_pos) == nullptr);
+    ASSERT_EQUAL(after->GetSheet().GetCell("D1"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT_EQUAL(after->GetSheet().GetCell("C1"_pos)->GetText(), "=A1");
+    ASSERT(after->GetSheet().GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(15.0));
+    // the program is shared, not parsed again
+    ASSERT(GetCompiledFormula(*old_sheet.GetConcreteCell("A2"_pos)->GetFormula()).ast
+           == GetCompiledFormula(*sheet.GetConcreteCell("A2"_pos)->GetFormula()).ast);
+
+    // printed on another thread while the sheet keeps changing
+    Sheet live;
+    for (int row = 0; row < 300; ++row) {
+        live.SetCell({ row, 0 }, std::to_string(row));
+        live.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+    }
+    std::ostringstream expected;
+    live.PrintValues(expected);
+    const auto snapshot = live.TakeSnapshot();
+    std::string printed;
+    std::thread reader([&snapshot, &printed] {
+        std::ostringstream out;
+        snapshot->GetSheet().PrintValues(out);
+        printed = out.str();
+    });
+    for (int edit = 0; edit < 1000; ++edit) {
+        live.SetCell({ edit % 400, edit % 3 }, std::to_string(edit));
+        if (edit % 100 == 0) {
+            live.TakeSnapshot();
+        }
+    }
+    reader.join();
+    ASSERT_EQUAL(printed, expected.str());
+    ASSERT_EQUAL(snapshot->GetCellCount(), 600u);
+}
+
+void TestInstrumentation() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2+1");
+    sheet.SetCell("A4"_pos, "=A3+1");
+    sheet.SetCell("B1"_pos, std::string(100, 'x'));
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(4.0));
+    // a clean read is not counted
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    const InstrumentationStatistics statistics = sheet.GetInstrumentationStatistics();
+    ASSERT_EQUAL(statistics.enabled, Instrumentation::ENABLED);
+    if (!Instrumentation::ENABLED) {
+        ASSERT_EQUAL(statistics.Get(Phase::PARSE).count, 0u);
+        ASSERT_EQUAL(statistics.stale_reads, 0u);
+        ASSERT_EQUAL(statistics.Get(Allocation::CELL_BLOCK), 0u);
+        return;
+    }
+    ASSERT_EQUAL(statistics.Get(Phase::PARSE).count, 3u);
+    ASSERT_EQUAL(statistics.Get(Phase::CYCLE_CHECK).count, 3u);
+    ASSERT_EQUAL(statistics.Get(Phase::EVALUATION).count, 3u);
+    ASSERT_EQUAL(statistics.Get(Phase::RECALCULATION).count, 0u);
+    const InstrumentationStatistics::PhaseStatistics& parse = statistics.Get(Phase::PARSE);
+    uint64_t histogram_count = 0;
+    for (uint64_t bucket : parse.histogram) {
+        histogram_count += bucket;
+    }
+    ASSERT_EQUAL(histogram_count, parse.count);
+    ASSERT(parse.max_ns <= parse.total_ns);
+
+    ASSERT_EQUAL(statistics.stale_reads, 1u);
+    ASSERT_EQUAL(statistics.read_evaluations, 3u);
+    ASSERT_EQUAL(statistics.max_read_evaluations, 3u);
+    ASSERT(statistics.max_search_depth >= 3u);
+
+    // all the cells are in the first block
+    ASSERT_EQUAL(statistics.Get(Allocation::CELL_BLOCK), 1u);
+    ASSERT_EQUAL(statistics.Get(Allocation::LONG_TEXT), 1u);
+    ASSERT_EQUAL(statistics.Get(Allocation::FORMULA), 3u);
+
+    sheet.SetCell("A1"_pos, "2");
+    sheet.Recalculate();
+    const InstrumentationStatistics recalculated = sheet.GetInstrumentationStatistics();
+    ASSERT_EQUAL(recalculated.Get(Phase::RECALCULATION).count, 1u);
+    ASSERT_EQUAL(recalculated.Get(Phase::EVALUATION).count, 6u);
+    ASSERT(recalculated.Get(Phase::INVALIDATION).count > statistics.Get(Phase::INVALIDATION).count);
+
+    sheet.ResetInstrumentation();
+    ASSERT_EQUAL(sheet.GetInstrumentationStatistics().Get(Phase::EVALUATION).count, 0u);
+    ASSERT_EQUAL(sheet.GetInstrumentationStatistics().Get(Allocation::FORMULA), 0u);
+}
+
 }  // namespace
 
 int main() {
@@ -369,4 +1956,33 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestSparseStorage);
+    RUN_TEST(tr, TestPrintableSizeTracking);
+    RUN_TEST(tr, TestDependencyGraph);
+    RUN_TEST(tr, TestRecalculateLongChain);
+    RUN_TEST(tr, TestParallelRecalculate);
+    RUN_TEST(tr, TestFormulaProgram);
+    RUN_TEST(tr, TestErrorPropagation);
+    RUN_TEST(tr, TestBatchParsing);
+    RUN_TEST(tr, TestNativeParser);
+    RUN_TEST(tr, TestFormulaStorage);
+    RUN_TEST(tr, TestFormulaTemplates);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestNumericColumns);
+    RUN_TEST(tr, TestNumericText);
+    RUN_TEST(tr, TestBatchEdits);
+    RUN_TEST(tr, TestTsvExport);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestTextView);
+    RUN_TEST(tr, TestReferencedCellsView);
+    RUN_TEST(tr, TestCycleDetection);
+    RUN_TEST(tr, TestPlaceholderCells);
+    RUN_TEST(tr, TestCompactCells);
+    RUN_TEST(tr, TestValueChangeCutoff);
+    RUN_TEST(tr, TestViewportValues);
+    RUN_TEST(tr, TestConcurrentReaders);
+    RUN_TEST(tr, TestReadDuringRecalculate);
+    RUN_TEST(tr, TestSheetSnapshot);
+    RUN_TEST(tr, TestInstrumentation);
 }
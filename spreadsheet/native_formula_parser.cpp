@@ -0,0 +1,421 @@
+#include "formula_parser.h"
+
+#include <cctype>
+#include <charconv>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <system_error>
+
+// Hand-written parser for the grammar in Formula.g4. It lexes on the fly with
+// one token of lookahead and emits the postfix program into buffers reused by
+// the thread, so only the FormulaAST block is allocated. Precedence,
+// associativity and the set of accepted inputs follow the ANTLR parser, which
+// is kept as the reference (see TestNativeParser).
+
+namespace ASTImpl {
+namespace {
+using Op = Instruction::Op;
+
+// deeper nesting of parentheses and unary operators is rejected instead of
+// overflowing the call stack
+constexpr int MAX_NESTING_DEPTH = 10000;
+
+enum class TokenType {
+    LeftParen,
+    RightParen,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Colon,
+    Comma,
+    Number,
+    Func,
+    Cell,
+    End,
+};
+
+struct Token {
+    TokenType type = TokenType::End;
+    std::string_view text;
+};
+
+bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Splits an expression into tokens the way FormulaLexer does: the longest
+// match wins and whitespace is skipped.
+class Lexer {
+public:
+    explicit Lexer(std::string_view input)
+        : input_(input) {
+    }
+
+    // throws ParsingError on characters that do not start a token
+    Token Next() {
+        // WS: [ \t\n\r]+ -> skip
+        while (pos_ < input_.size()
+               && (input_[pos_] == ' ' || input_[pos_] == '\t' || input_[pos_] == '\n' || input_[pos_] == '\r')) {
+            ++pos_;
+        }
+        if (pos_ == input_.size()) {
+            return { TokenType::End, {} };
+        }
+
+        const size_t start = pos_;
+        TokenType type;
+        switch (input_[pos_]) {
+        case '(':
+            type = TokenType::LeftParen;
+            break;
+        case ')':
+            type = TokenType::RightParen;
+            break;
+        case '+':
+            type = TokenType::Add;
+            break;
+        case '-':
+            type = TokenType::Sub;
+            break;
+        case '*':
+            type = TokenType::Mul;
+            break;
+        case '/':
+            type = TokenType::Div;
+            break;
+        case ':':
+            type = TokenType::Colon;
+            break;
+        case ',':
+            type = TokenType::Comma;
+            break;
+        default:
+            if (const size_t end = MatchNumber(start); end != start) {
+                type = TokenType::Number;
+                pos_ = end;
+            }
+            else if (const size_t end = MatchCell(start); end != start) {
+                type = TokenType::Cell;
+                pos_ = end;
+            }
+            // checked after cells: SUM1 is the longer match and so a cell
+            else if (const size_t end = MatchFunc(start); end != start) {
+                type = TokenType::Func;
+                pos_ = end;
+            }
+            else {
+                throw ParsingError("Error when lexing: token recognition error at: '"
+                                   + std::string(1, input_[start]) + "'");
+            }
+        }
+        if (pos_ == start) {
+            ++pos_;
+        }
+        return { type, input_.substr(start, pos_ - start) };
+    }
+
+private:
+    size_t SkipDigits(size_t pos) const {
+        while (pos < input_.size() && IsDigit(input_[pos])) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    // returns the end of the longest match, or `start` if there is none
+    size_t MatchNumber(size_t start) const {
+        size_t end = SkipDigits(start);
+        if (end < input_.size() && input_[end] == '.') {
+            const size_t fraction_end = SkipDigits(end + 1);
+            if (fraction_end > end + 1) {
+                end = fraction_end;
+            }
+        }
+        if (end == start) {
+            return start;
+        }
+        if (end < input_.size() && (input_[end] == 'e' || input_[end] == 'E')) {
+            size_t exponent = end + 1;
+            if (exponent < input_.size() && (input_[exponent] == '+' || input_[exponent] == '-')) {
+                ++exponent;
+            }
+            const size_t exponent_end = SkipDigits(exponent);
+            if (exponent_end > exponent) {
+                end = exponent_end;
+            }
+        }
+        return end;
+    }
+
+    // CELL: [A-Z]+[0-9]+
+    size_t MatchCell(size_t start) const {
+        size_t letters_end = start;
+        while (letters_end < input_.size() && input_[letters_end] >= 'A' && input_[letters_end] <= 'Z') {
+            ++letters_end;
+        }
+        const size_t end = SkipDigits(letters_end);
+        return letters_end > start && end > letters_end ? end : start;
+    }
+
+    // FUNC: 'SUM' | 'AVG' | 'MIN' | 'MAX'
+    size_t MatchFunc(size_t start) const {
+        const std::string_view name = input_.substr(start, 3);
+        return name == "SUM" || name == "AVG" || name == "MIN" || name == "MAX" ? start + 3 : start;
+    }
+
+    std::string_view input_;
+    size_t pos_ = 0;
+};
+
+class NativeParser {
+public:
+    NativeParser(std::string_view expression, ProgramBuffers& buffers)
+        : lexer_(expression)
+        , program_(buffers.program)
+        , numbers_(buffers.numbers)
+        , cells_(buffers.cells)
+        , ranges_(buffers.ranges) {
+        buffers.Clear();
+        Advance();
+    }
+
+    FormulaAST Parse() {
+        ParseExpression(0, 0);
+        if (current_.type != TokenType::End) {
+            throw ParsingError("Error when parsing: " + std::string(current_.text));
+        }
+        return FormulaAST(program_, numbers_, cells_, ranges_);
+    }
+
+private:
+    void Advance() {
+        current_ = lexer_.Next();
+    }
+
+    // binding strength of a binary operator, 0 for other tokens
+    static int GetBinaryPrecedence(TokenType type) {
+        switch (type) {
+        case TokenType::Add:
+        case TokenType::Sub:
+            return 1;
+        case TokenType::Mul:
+        case TokenType::Div:
+            return 2;
+        default:
+            return 0;
+        }
+    }
+
+    static Op GetBinaryOp(TokenType type) {
+        switch (type) {
+        case TokenType::Add:
+            return Op::Add;
+        case TokenType::Sub:
+            return Op::Subtract;
+        case TokenType::Mul:
+            return Op::Multiply;
+        default:
+            return Op::Divide;
+        }
+    }
+
+    // operators are left-associative: the right operand only takes operators
+    // that bind stronger than the current one
+    void ParseExpression(int min_precedence, int nesting) {
+        ParseUnary(nesting);
+        ParseBinaryTail(min_precedence, nesting);
+    }
+
+    // the operators that follow an already parsed left operand
+    void ParseBinaryTail(int min_precedence, int nesting) {
+        while (GetBinaryPrecedence(current_.type) > min_precedence) {
+            const TokenType op = current_.type;
+            Advance();
+            ParseExpression(GetBinaryPrecedence(op), nesting);
+            program_.push_back({ GetBinaryOp(op) });
+        }
+    }
+
+    // a unary operator applies to the closest operand: -A1*2 is (-A1)*2
+    void ParseUnary(int nesting) {
+        if (++nesting > MAX_NESTING_DEPTH) {
+            throw ParsingError("Formula is nested too deeply");
+        }
+        const TokenType type = current_.type;
+        if (type == TokenType::Add || type == TokenType::Sub) {
+            Advance();
+            ParseUnary(nesting);
+            program_.push_back({ type == TokenType::Sub ? Op::UnaryMinus : Op::UnaryPlus });
+            return;
+        }
+        ParsePrimary(nesting);
+    }
+
+    void ParsePrimary(int nesting) {
+        switch (current_.type) {
+        case TokenType::LeftParen:
+            Advance();
+            ParseExpression(0, nesting);
+            if (current_.type != TokenType::RightParen) {
+                throw ParsingError("Error when parsing: missing ')'");
+            }
+            Advance();
+            return;
+        case TokenType::Number:
+            AddNumber(current_.text);
+            Advance();
+            return;
+        case TokenType::Cell:
+            AddCell(current_.text);
+            Advance();
+            return;
+        case TokenType::Func:
+            ParseFunction(nesting);
+            return;
+        default:
+            throw ParsingError("Error when parsing: unexpected "
+                               + std::string(current_.type == TokenType::End ? "end" : current_.text));
+        }
+    }
+
+    // FUNC '(' arg (',' arg)* ')'
+    void ParseFunction(int nesting) {
+        const FunctionOps ops = GetFunctionOps(current_.text);
+        Advance();
+        if (current_.type != TokenType::LeftParen) {
+            throw ParsingError("Error when parsing: missing '('");
+        }
+        uint32_t args = 0;
+        do {
+            Advance();
+            ParseArgument(ops.range, nesting);
+            ++args;
+        } while (current_.type == TokenType::Comma);
+        if (current_.type != TokenType::RightParen) {
+            throw ParsingError("Error when parsing: missing ')'");
+        }
+        Advance();
+        program_.push_back({ ops.function, args });
+    }
+
+    // CELL ':' CELL | expr; an argument that starts with a cell is only a
+    // range if a colon follows
+    void ParseArgument(Op range_op, int nesting) {
+        if (current_.type == TokenType::Cell) {
+            const std::string_view first = current_.text;
+            Advance();
+            if (current_.type == TokenType::Colon) {
+                Advance();
+                if (current_.type != TokenType::Cell) {
+                    throw ParsingError("Error when parsing: expected a cell after ':'");
+                }
+                AddRange(range_op, first, current_.text);
+                Advance();
+                return;
+            }
+            AddCell(first);
+            ParseBinaryTail(0, nesting);
+        }
+        else {
+            ParseExpression(0, nesting);
+        }
+        program_.push_back({ Op::ScalarArgument });
+    }
+
+    void AddNumber(std::string_view text) {
+        double value = 0;
+        const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (error == std::errc::result_out_of_range && end == text.data() + text.size()) {
+            // read as the reference parser does: underflow gives zero, only
+            // overflow is an error
+            std::istringstream in{ std::string(text) };
+            in >> value;
+            if (!in) {
+                throw ParsingError("Invalid number: " + std::string(text));
+            }
+        }
+        else if (error != std::errc() || end != text.data() + text.size()) {
+            throw ParsingError("Invalid number: " + std::string(text));
+        }
+        program_.push_back({ Op::PushNumber, static_cast<uint32_t>(numbers_.size()) });
+        numbers_.push_back(value);
+    }
+
+    void AddCell(std::string_view text) {
+        const Position pos = Position::FromString(text);
+        if (!pos.IsValid()) {
+            throw FormulaException("Invalid position: " + std::string(text));
+        }
+        program_.push_back({ Op::LoadCell, static_cast<uint32_t>(cells_.size()) });
+        cells_.push_back(pos);
+    }
+
+    void AddRange(Op range_op, std::string_view first_text, std::string_view second_text) {
+        const Position first = Position::FromString(first_text);
+        const Position second = Position::FromString(second_text);
+        if (!first.IsValid() || !second.IsValid()) {
+            throw FormulaException("Invalid range: " + std::string(first_text) + ":" + std::string(second_text));
+        }
+        program_.push_back({ range_op, static_cast<uint32_t>(ranges_.size()) });
+        ranges_.push_back(Range::FromCorners(first, second));
+    }
+
+    Lexer lexer_;
+    Token current_;
+
+    std::vector<Instruction>& program_;
+    std::vector<double>& numbers_;
+    std::vector<Position>& cells_;
+    std::vector<Range>& ranges_;
+};
+
+}  // namespace
+}  // namespace ASTImpl
+
+FormulaAST ParseFormulaASTNative(std::string_view expression) {
+    thread_local ASTImpl::ProgramBuffers buffers;
+    return ASTImpl::NativeParser(expression, buffers).Parse();
+}
+
+namespace {
+void AppendInt(std::string& out, int value) {
+    char buffer[16];
+    const auto result = std::to_chars(std::begin(buffer), std::end(buffer), value);
+    out.append(buffer, result.ptr);
+}
+}  // namespace
+
+bool MakeFormulaTemplateKey(std::string_view expression, Position anchor, std::string& key) {
+    using namespace ASTImpl;
+
+    key.clear();
+    try {
+        Lexer lexer(expression);
+        for (Token token = lexer.Next(); token.type != TokenType::End; token = lexer.Next()) {
+            // separated, so that "1 2" and "12" get different keys
+            if (!key.empty()) {
+                key += ' ';
+            }
+            if (token.type != TokenType::Cell) {
+                key += token.text;
+                continue;
+            }
+            // both corners of a range are separate cell tokens
+            const Position pos = Position::FromString(token.text);
+            if (!pos.IsValid()) {
+                return false;
+            }
+            key += 'R';
+            AppendInt(key, pos.row - anchor.row);
+            key += 'C';
+            AppendInt(key, pos.col - anchor.col);
+        }
+    }
+    catch (const ParsingError&) {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,89 @@
+#include "numeric_columns.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+void NumericColumns::SetNumber(Position pos, double value) {
+    Chunk* chunk = FindChunk(pos);
+    if (!chunk) {
+        // positions of a missing chunk already read as zero
+        if (value == 0 && !std::signbit(value)) {
+            return;
+        }
+        chunk = &FindOrCreateChunk(pos);
+    }
+    const int row = pos.row % CHUNK_ROWS;
+    chunk->values[row] = value;
+    chunk->known.fetch_or(uint64_t{ 1 } << row, std::memory_order_release);
+}
+
+void NumericColumns::Invalidate(Position pos) {
+    Chunk& chunk = FindOrCreateChunk(pos);
+    chunk.known.fetch_and(~(uint64_t{ 1 } << (pos.row % CHUNK_ROWS)), std::memory_order_relaxed);
+}
+
+bool NumericColumns::Gather(const Range& range, double* out) const {
+    assert(range.IsValid());
+    const size_t width = static_cast<size_t>(range.bottom_right.col - range.top_left.col + 1);
+    for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+        // the column goes to every width-th element of out
+        double* column_out = out + (col - range.top_left.col);
+        const auto* chunks = static_cast<size_t>(col) < columns_.size() ? &columns_[col] : nullptr;
+        for (int row = range.top_left.row; row <= range.bottom_right.row;) {
+            const size_t chunk_index = static_cast<size_t>(row / CHUNK_ROWS);
+            const int first = row % CHUNK_ROWS;
+            const int count = std::min(CHUNK_ROWS - first, range.bottom_right.row - row + 1);
+            const Chunk* chunk = chunks && chunk_index < chunks->size() ? (*chunks)[chunk_index].get() : nullptr;
+            if (!chunk) {
+                for (int i = 0; i < count; ++i) {
+                    column_out[i * width] = 0;
+                }
+            }
+            else {
+                const uint64_t mask = (count == CHUNK_ROWS ? ~uint64_t{ 0 } : (uint64_t{ 1 } << count) - 1) << first;
+                if ((chunk->known.load(std::memory_order_acquire) & mask) != mask) {
+                    return false;
+                }
+                const double* values = chunk->values + first;
+                if (width == 1) {
+                    std::copy(values, values + count, column_out);
+                }
+                else {
+                    for (int i = 0; i < count; ++i) {
+                        column_out[i * width] = values[i];
+                    }
+                }
+            }
+            column_out += count * width;
+            row += count;
+        }
+    }
+    return true;
+}
+
+NumericColumns::Chunk* NumericColumns::FindChunk(Position pos) const {
+    if (static_cast<size_t>(pos.col) >= columns_.size()) {
+        return nullptr;
+    }
+    const auto& chunks = columns_[pos.col];
+    const size_t chunk_index = static_cast<size_t>(pos.row / CHUNK_ROWS);
+    return chunk_index < chunks.size() ? chunks[chunk_index].get() : nullptr;
+}
+
+NumericColumns::Chunk& NumericColumns::FindOrCreateChunk(Position pos) {
+    if (static_cast<size_t>(pos.col) >= columns_.size()) {
+        columns_.resize(pos.col + 1);
+    }
+    auto& chunks = columns_[pos.col];
+    const size_t chunk_index = static_cast<size_t>(pos.row / CHUNK_ROWS);
+    if (chunk_index >= chunks.size()) {
+        chunks.resize(chunk_index + 1);
+    }
+    auto& chunk = chunks[chunk_index];
+    if (!chunk) {
+        chunk = std::make_unique<Chunk>();
+        ++chunk_count_;
+    }
+    return *chunk;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Columnar shadow of the numeric values of a sheet, so that ranges can be
+// read as dense arrays of doubles instead of cell by cell. Every column is
+// split into chunks of CHUNK_ROWS rows holding the values and a bitmap of
+// the rows whose value is known: a number, a text that is a number or an
+// empty cell (zero). Bits are clear for errors, other texts and formulas
+// that are not evaluated since they were set or invalidated. Positions in
+// chunks that were never allocated hold no cells and read as zeros; chunks
+// stay allocated once created.
+//
+// Chunks are only allocated by SetNumber()/Invalidate() while the sheet is
+// edited. During evaluation SetNumber() is called from the recalculation
+// threads for formula cells, whose chunks always exist by then; the bitmap
+// is atomic, values are published before their bits.
+class NumericColumns {
+public:
+    static constexpr int CHUNK_ROWS = 64;
+
+    NumericColumns() = default;
+    NumericColumns(const NumericColumns&) = delete;
+    NumericColumns& operator=(const NumericColumns&) = delete;
+
+    void SetNumber(Position pos, double value);
+    // the value of `pos` is unknown until the next SetNumber()
+    void Invalidate(Position pos);
+
+    // Copies the values of `range` into `out` row by row; returns false if
+    // some of them are not known, `out` is left partially written then.
+    bool Gather(const Range& range, double* out) const;
+
+    size_t GetChunkCount() const {
+        return chunk_count_;
+    }
+
+private:
+    struct Chunk {
+        double values[CHUNK_ROWS] = {};
+        // bit i is set when values[i] is the current value of its cell
+        std::atomic<uint64_t> known{ ~uint64_t{ 0 } };
+    };
+
+    Chunk* FindChunk(Position pos) const;
+    Chunk& FindOrCreateChunk(Position pos);
+
+    // columns_[col][row / CHUNK_ROWS], nullptr for chunks without cells
+    std::vector<std::vector<std::unique_ptr<Chunk>>> columns_;
+    size_t chunk_count_ = 0;
+};
@@ -0,0 +1,58 @@
+#include "persistent_grid.h"
+
+#include <atomic>
+#include <utility>
+
+static_assert(static_cast<size_t>(Position::MAX_ROWS / PersistentGrid::BLOCK_SIZE) << 11
+              <= 64 * 256 * 256, "the tree does not cover the sheet");
+
+PersistentGrid::PersistentGrid()
+    : root_(std::make_shared<Root>()), owner_(NewOwner()) {
+    root_->owner = owner_;
+}
+
+uint64_t PersistentGrid::NewOwner() {
+    static std::atomic<uint64_t> next_owner{ 1 };
+    return next_owner++;
+}
+
+const CellSource* PersistentGrid::Find(Position pos) const {
+    const uint32_t key = BlockKey(pos);
+    const Middle* middle = root_->children[key / (MIDDLE_FANOUT * LEAF_FANOUT)].get();
+    if (!middle) {
+        return nullptr;
+    }
+    const Leaf* leaf = middle->children[key / LEAF_FANOUT % MIDDLE_FANOUT].get();
+    if (!leaf) {
+        return nullptr;
+    }
+    const Block* block = leaf->children[key % LEAF_FANOUT].get();
+    if (!block) {
+        return nullptr;
+    }
+    return block->cells[(pos.row % BLOCK_SIZE) * BLOCK_SIZE + pos.col % BLOCK_SIZE].get();
+}
+
+void PersistentGrid::Set(Position pos, Entry entry) {
+    if (!entry && !Find(pos)) {
+        // nothing to remove, and no nodes to copy for it
+        return;
+    }
+    const uint32_t key = BlockKey(pos);
+    Root& root = Own(root_);
+    Middle& middle = Own(root.children[key / (MIDDLE_FANOUT * LEAF_FANOUT)]);
+    Leaf& leaf = Own(middle.children[key / LEAF_FANOUT % MIDDLE_FANOUT]);
+    Block& block = Own(leaf.children[key % LEAF_FANOUT]);
+    Entry& cell = block.cells[(pos.row % BLOCK_SIZE) * BLOCK_SIZE + pos.col % BLOCK_SIZE];
+    size_ = size_ - (cell != nullptr) + (entry != nullptr);
+    cell = std::move(entry);
+}
+
+PersistentGrid PersistentGrid::Share() {
+    PersistentGrid shared;
+    shared.root_ = root_;
+    shared.size_ = size_;
+    // every node existing now belongs to neither grid from here on
+    owner_ = NewOwner();
+    return shared;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// What a PersistentGrid keeps of a cell: the text of a text cell or the
+// compiled program of a formula, shared with the cell it was taken from.
+struct CellSource {
+    // empty for formulas
+    std::string text;
+    // the ast is null for texts
+    CompiledFormula formula;
+};
+
+// Sparse grid of immutable CellSource entries that is copied in O(1).
+// Cells are grouped into blocks of BLOCK_SIZE x BLOCK_SIZE like in
+// CellStorage, blocks into a tree of three levels indexed by the block row
+// and column. Share() returns a grid with the same root; from then on Set()
+// on either of them copies the nodes on the path to the cell instead of
+// changing them, so neither sees the edits of the other and a shared grid
+// can be read on another thread while this one is changed. Every node
+// remembers the token of the grid that created it, only nodes with the
+// grid's own token are changed in place. Nodes emptied by Set() are kept.
+class PersistentGrid {
+public:
+    using Entry = std::shared_ptr<const CellSource>;
+
+    static constexpr int BLOCK_SIZE = 8;
+
+    PersistentGrid();
+    PersistentGrid(PersistentGrid&&) = default;
+    PersistentGrid& operator=(PersistentGrid&&) = default;
+
+    // nullptr if the cell has no entry
+    const CellSource* Find(Position pos) const;
+    // a null entry removes the cell
+    void Set(Position pos, Entry entry);
+
+    // A grid with the same entries, sharing every node with this one.
+    PersistentGrid Share();
+
+    // number of cells with an entry
+    size_t GetSize() const {
+        return size_;
+    }
+
+    // calls func(pos, source) for every entry, block by block
+    template <typename Func>
+    void ForEach(Func func) const;
+
+private:
+    static constexpr int BLOCK_CELLS = BLOCK_SIZE * BLOCK_SIZE;
+    // a block key has 11 bits of block row and 11 bits of block column
+    static constexpr int KEY_COL_BITS = 11;
+    static constexpr size_t LEAF_FANOUT = 256;
+    static constexpr size_t MIDDLE_FANOUT = 256;
+    static constexpr size_t ROOT_FANOUT = 64;
+
+    struct Block {
+        uint64_t owner = 0;
+        std::array<Entry, BLOCK_CELLS> cells;
+    };
+    template <typename Child, size_t FANOUT>
+    struct Node {
+        uint64_t owner = 0;
+        std::array<std::shared_ptr<Child>, FANOUT> children;
+    };
+    using Leaf = Node<Block, LEAF_FANOUT>;
+    using Middle = Node<Leaf, MIDDLE_FANOUT>;
+    using Root = Node<Middle, ROOT_FANOUT>;
+
+    static uint32_t BlockKey(Position pos) {
+        return (static_cast<uint32_t>(pos.row / BLOCK_SIZE) << KEY_COL_BITS)
+            | static_cast<uint32_t>(pos.col / BLOCK_SIZE);
+    }
+    static uint64_t NewOwner();
+
+    // the node, created or copied first unless this grid owns it already
+    template <typename T>
+    T& Own(std::shared_ptr<T>& node) {
+        if (!node) {
+            node = std::make_shared<T>();
+            node->owner = owner_;
+        }
+        else if (node->owner != owner_) {
+            node = std::make_shared<T>(*node);
+            node->owner = owner_;
+        }
+        return *node;
+    }
+
+    std::shared_ptr<Root> root_;
+    uint64_t owner_;
+    size_t size_ = 0;
+};
+
+template <typename Func>
+void PersistentGrid::ForEach(Func func) const {
+    for (size_t root_index = 0; root_index < ROOT_FANOUT; ++root_index) {
+        const Middle* middle = root_->children[root_index].get();
+        if (!middle) {
+            continue;
+        }
+        for (size_t middle_index = 0; middle_index < MIDDLE_FANOUT; ++middle_index) {
+            const Leaf* leaf = middle->children[middle_index].get();
+            if (!leaf) {
+                continue;
+            }
+            for (size_t leaf_index = 0; leaf_index < LEAF_FANOUT; ++leaf_index) {
+                const Block* block = leaf->children[leaf_index].get();
+                if (!block) {
+                    continue;
+                }
+                const uint32_t key = static_cast<uint32_t>(
+                    (root_index * MIDDLE_FANOUT + middle_index) * LEAF_FANOUT + leaf_index);
+                const Position origin{ static_cast<int>(key >> KEY_COL_BITS) * BLOCK_SIZE,
+                                       static_cast<int>(key & ((1u << KEY_COL_BITS) - 1)) * BLOCK_SIZE };
+                for (int i = 0; i < BLOCK_CELLS; ++i) {
+                    if (const CellSource* source = block->cells[i].get()) {
+                        func(Position{ origin.row + i / BLOCK_SIZE, origin.col + i % BLOCK_SIZE }, *source);
+                    }
+                }
+            }
+        }
+    }
+}
@@ -2,152 +2,755 @@
 
 #include "cell.h"
 #include "common.h"
+#include "sheet_snapshot.h"
 
 #include <algorithm>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+PersistentGrid::Entry MakeCellSource(const Cell* cell) {
+    if (!cell || cell->IsEmpty()) {
+        return nullptr;
+    }
+    if (const FormulaInterface* formula = cell->GetFormula()) {
+        return std::make_shared<const CellSource>(CellSource{ {}, GetCompiledFormula(*formula) });
+    }
+    return std::make_shared<const CellSource>(CellSource{ std::string(cell->GetTextView()), {} });
+}
+}  // namespace
 
 void Sheet::SetCell(Position pos, std::string text) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position!");
     }
-    if (static_cast<int>(sheet_.size()) < (pos.row + 1)) {
-        sheet_.reserve(pos.row + 1);
-        sheet_.resize(pos.row + 1);
-    }
-    if (static_cast<int>(sheet_.at(pos.row).size()) < (pos.col + 1)) {
-        sheet_.at(pos.row).reserve(pos.col + 1);
-        sheet_.at(pos.row).resize(pos.col + 1);
+    if (batch_) {
+        batch_->push_back({ pos, std::move(text) });
+        return;
     }
 
     auto cell = GetConcreteCell(pos);
     if (cell) {
-        if (cell->GetText() == text) { return; }
+        if (cell->GetTextView() == text) { return; }
+        const bool was_empty = cell->IsEmpty();
         cell->Set(text, pos);
+        UpdatePrintableSize(pos, was_empty, cell->IsEmpty());
+        UpdateSource(pos, cell);
     }
     else {
-        auto new_cell = std::make_unique<Cell>(*this);
-        new_cell->Set(text, pos);
-        sheet_.at(pos.row).at(pos.col) = std::move(new_cell);
+        // an empty text leaves a missing cell missing, even if it is
+        // referenced
+        if (text.empty()) {
+            return;
+        }
+        Cell& new_cell = cells_.FindOrCreate(pos, *this);
+        try {
+            new_cell.Set(text, pos);
+        }
+        catch (...) {
+            cells_.Erase(pos);
+            throw;
+        }
+        UpdatePrintableSize(pos, true, new_cell.IsEmpty());
+        UpdateSource(pos, &new_cell);
     }
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
+    if (Cell* cell = GetConcreteCell(pos)) {
+        return cell;
+    }
+    return graph_.HasDependents(pos) ? &PlaceholderCell::Get() : nullptr;
+}
+
+const CellInterface* Sheet::GetCell(Position pos) const {
+    if (const Cell* cell = GetConcreteCell(pos)) {
+        return cell;
+    }
+    return graph_.HasDependents(pos) ? &PlaceholderCell::Get() : nullptr;
+}
+
+Sheet::ReadLock Sheet::LockForReading() const {
+    {
+        std::lock_guard turnstile_lock(turnstile_);
+    }
+    return ReadLock(mutex_);
+}
+
+Sheet::WriteLock Sheet::LockForWriting() const {
+    std::lock_guard turnstile_lock(turnstile_);
+    return WriteLock(mutex_);
+}
+
+Cell* Sheet::GetConcreteCell(Position pos) const {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position!");
     }
+    return cells_.Find(pos);
+}
 
-    if (IsCell(pos)) {
-        if (sheet_.at(pos.row).at(pos.col)) {
-            return sheet_.at(pos.row).at(pos.col).get();
-        }
-    }
-    return nullptr;
+uint64_t Sheet::GetCellsVersion() const {
+    return cells_.GetVersion();
 }
 
-const CellInterface* Sheet::GetCell(Position pos) const {
+bool Sheet::GetRangeNumbers(const Range& range, double* out) const {
+    return numeric_columns_.Gather(range, out);
+}
+
+NumericColumns& Sheet::GetNumericColumns() {
+    return numeric_columns_;
+}
+
+const NumericColumns& Sheet::GetNumericColumns() const {
+    return numeric_columns_;
+}
+
+DependencyGraph& Sheet::GetDependencyGraph() {
+    return graph_;
+}
+
+const DependencyGraph& Sheet::GetDependencyGraph() const {
+    return graph_;
+}
+
+FormulaTemplateCache& Sheet::GetFormulaTemplates() {
+    return formula_templates_;
+}
+
+FormulaTable& Sheet::GetFormulaTable() {
+    return formula_table_;
+}
+
+const FormulaTable& Sheet::GetFormulaTable() const {
+    return formula_table_;
+}
+
+void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position!");
     }
+    if (batch_) {
+        batch_->push_back({ pos, std::string(), /* clear = */ true });
+        return;
+    }
+    Cell* cell = cells_.Find(pos);
+    if (cell) {
+        // unlink the cell from the cells it references before it can be destroyed
+        const bool was_empty = cell->IsEmpty();
+        cell->Clear(pos);
+        UpdatePrintableSize(pos, was_empty, true);
+        // the formulas referencing it keep its graph node
+        cells_.Erase(pos);
+        UpdateSource(pos, nullptr);
+    }
+}
 
-    if (IsCell(pos)) {
-        if (sheet_.at(pos.row).at(pos.col)) {
-            return sheet_.at(pos.row).at(pos.col).get();
+std::shared_ptr<const SheetSnapshot> Sheet::TakeSnapshot() const {
+    std::lock_guard lock(sources_mutex_);
+    if (!sources_) {
+        sources_.emplace();
+        cells_.ForEachCell([this](Position pos, const Cell& cell) {
+            sources_->Set(pos, MakeCellSource(&cell));
+        });
+    }
+    return std::make_shared<const SheetSnapshot>(sources_->Share());
+}
+
+void Sheet::UpdateSource(Position pos, const Cell* cell) {
+    if (sources_) {
+        sources_->Set(pos, MakeCellSource(cell));
+    }
+}
+
+void Sheet::RestoreTextCell(Position pos, std::string text) {
+    Cell& cell = cells_.FindOrCreate(pos, *this);
+    cell.RestoreText(std::move(text), pos);
+    UpdatePrintableSize(pos, true, cell.IsEmpty());
+}
+
+void Sheet::RestoreFormulaCell(Position pos, std::unique_ptr<FormulaInterface> formula,
+                               std::optional<CellInterface::Value> cache) {
+    // views of the formula, which stays where it is when the cell takes it
+    const auto references = formula->GetReferencedCellsView();
+    const auto ranges = formula->GetReferencedRanges();
+    Cell& cell = cells_.FindOrCreate(pos, *this);
+    cell.RestoreFormula(std::move(formula), pos, std::move(cache));
+    graph_.SetReferences(pos, references, ranges);
+    UpdatePrintableSize(pos, true, false);
+}
+
+void Sheet::BeginBatch() {
+    if (batch_) {
+        throw std::logic_error("A batch is already open");
+    }
+    batch_.emplace();
+}
+
+void Sheet::CancelBatch() {
+    batch_.reset();
+}
+
+void Sheet::SetCells(const std::vector<std::pair<Position, std::string>>& edits) {
+    BeginBatch();
+    try {
+        for (const auto& [pos, text] : edits) {
+            SetCell(pos, text);
         }
     }
-    return nullptr;
+    catch (...) {
+        CancelBatch();
+        throw;
+    }
+    CommitBatch();
 }
 
-Cell* Sheet::GetConcreteCell(Position pos) const {
-    if (!pos.IsValid()) {
-        throw InvalidPositionException("Invalid position!");
+void Sheet::CommitBatch() {
+    if (!batch_) {
+        throw std::logic_error("No batch is open");
+    }
+    std::vector<BatchEdit> edits = std::move(*batch_);
+    batch_.reset();
+
+    std::unordered_map<PositionKey, size_t> last_edit;
+    for (size_t i = 0; i < edits.size(); ++i) {
+        last_edit[PackPosition(edits[i].pos)] = i;
     }
 
-    if (IsCell(pos)) {
-        if (sheet_.at(pos.row).at(pos.col)) {
-            return sheet_.at(pos.row).at(pos.col).get();
+    struct Change {
+        const BatchEdit* edit;
+        Cell* cell;
+        bool created;
+        bool was_empty;
+        // the new contents until they are committed
+        CellContents staged;
+        // references before and after the change; the cells are views of
+        // the current and the staged contents, both kept until the end
+        Span<const Position> old_cells;
+        std::vector<Range> old_ranges;
+        Span<const Position> new_cells;
+        std::vector<Range> new_ranges;
+    };
+    std::vector<Change> changes;
+    for (size_t i = 0; i < edits.size(); ++i) {
+        const BatchEdit& edit = edits[i];
+        if (last_edit[PackPosition(edit.pos)] != i) {
+            continue;
+        }
+        Cell* cell = cells_.Find(edit.pos);
+        if (cell && !edit.clear && cell->GetTextView() == edit.text) {
+            continue;
+        }
+        const bool created = cell == nullptr;
+        if (created && edit.text.empty()) {
+            continue;
+        }
+        if (created) {
+            cell = &cells_.FindOrCreate(edit.pos, *this);
+        }
+        changes.push_back({ &edit, cell, created, cell->IsEmpty(), {}, {}, {}, {}, {} });
+    }
+
+    // nothing is changed until everything is known to be valid
+    auto discard = [this, &changes] {
+        for (Change& change : changes) {
+            change.cell->DiscardStaged(change.staged);
+            if (change.created) {
+                cells_.Erase(change.edit->pos);
+            }
+        }
+    };
+    try {
+        for (Change& change : changes) {
+            change.staged = change.cell->Stage(change.edit->text, change.edit->pos);
+            change.new_cells = change.cell->GetStagedReferencedCells(change.staged);
+            change.new_ranges = change.cell->GetStagedReferencedRanges(change.staged);
+        }
+    }
+    catch (...) {
+        discard();
+        throw;
+    }
+
+    // the graph gets no edge from a cell to itself, which could not be
+    // unlinked again like any other
+    for (const Change& change : changes) {
+        if (DependencyGraph::IsSelfReference(change.edit->pos, change.new_cells, change.new_ranges)) {
+            discard();
+            throw CircularDependencyException("Circular dependency!");
+        }
+    }
+
+    std::vector<Position> changed;
+    changed.reserve(changes.size());
+    for (Change& change : changes) {
+        change.old_cells = change.cell->GetReferencedCellsView();
+        change.old_ranges = change.cell->GetReferencedRanges();
+        graph_.SetReferences(change.edit->pos, change.new_cells, change.new_ranges);
+        changed.push_back(change.edit->pos);
+    }
+    bool creates_cycle;
+    {
+        Instrumentation::Timer timer(instrumentation_, Phase::CYCLE_CHECK);
+        creates_cycle = graph_.HasCycleThrough(changed);
+    }
+    if (creates_cycle) {
+        for (auto it = changes.rbegin(); it != changes.rend(); ++it) {
+            graph_.SetReferences(it->edit->pos, it->old_cells, it->old_ranges);
+        }
+        discard();
+        throw CircularDependencyException("Circular dependency!");
+    }
+
+    // the cells whose dependents see new values, and the formulas that
+    // keep their previous ones to compare with
+    std::vector<Position> changed_values;
+    std::vector<Position> unknown_values;
+    for (Change& change : changes) {
+        switch (change.cell->CommitStaged(std::move(change.staged), change.edit->pos)) {
+        case Cell::ValueChange::NONE:
+            break;
+        case Cell::ValueChange::CHANGED:
+            changed_values.push_back(change.edit->pos);
+            break;
+        case Cell::ValueChange::UNKNOWN:
+            unknown_values.push_back(change.edit->pos);
+            break;
+        }
+    }
+    InvalidateDependents(changed_values);
+    InvalidateDependents(unknown_values, false);
+
+    for (const Change& change : changes) {
+        UpdatePrintableSize(change.edit->pos, change.was_empty, change.cell->IsEmpty());
+        UpdateSource(change.edit->pos, change.edit->clear ? nullptr : change.cell);
+    }
+    for (const Change& change : changes) {
+        if (change.edit->clear) {
+            cells_.Erase(change.edit->pos);
         }
     }
-    return nullptr;
 }
 
-void Sheet::ClearCell(Position pos) {
-    if (!pos.IsValid()) {
-        throw InvalidPositionException("Invalid position!");
+void Sheet::InvalidateDependents(Span<const Position> changed, bool values_changed) {
+    Instrumentation::Timer timer(instrumentation_, Phase::INVALIDATION);
+    // explicit stack instead of recursion, chains can be arbitrarily long;
+    // only the direct dependents can be known to see a new value
+    std::vector<std::pair<DependencyGraph::NodeId, bool>> stack;
+    auto push_direct = [&stack, values_changed](DependencyGraph::NodeId dependent) {
+        stack.emplace_back(dependent, values_changed);
+    };
+    auto push = [&stack](DependencyGraph::NodeId dependent) {
+        stack.emplace_back(dependent, false);
+    };
+    // a changed cell may have no node when it is only referenced through
+    // ranges
+    for (const Position& pos : changed) {
+        graph_.ForEachDependent(pos, push_direct);
     }
-    if (IsCell(pos) && sheet_.at(pos.row).at(pos.col)) {
-        if (sheet_.at(pos.row).at(pos.col).get()->GetDependentCells().empty()) {
-            sheet_.at(pos.row).at(pos.col).reset();
+    while (!stack.empty()) {
+        const auto [dependent, value_changed] = stack.back();
+        stack.pop_back();
+        const Position dependent_pos = graph_.GetPosition(dependent);
+        Cell* cell = cells_.Find(dependent_pos);
+        // a stale cell has stale dependents already
+        if (cell->IsCacheValid()) {
+            cell->InvalidateCache(value_changed);
+            ++cache_invalidated_;
+            MarkDirty(dependent_pos);
+            // the cache needs to be marked for all cells that in any way
+            // depend on this one
+            graph_.ForEachDependent(dependent, push);
+        }
+        else if (value_changed) {
+            cell->InvalidateCache(true);
         }
-        else {
-            sheet_.at(pos.row).at(pos.col).get()->Clear(pos);
-        }       
-    }   
+    }
+}
+
+void Sheet::MarkDependentsChanged(Position pos) const {
+    graph_.ForEachDependent(pos, [this](DependencyGraph::NodeId dependent) {
+        cells_.Find(graph_.GetPosition(dependent))->MarkPrecedentChanged();
+    });
 }
 
 Size Sheet::GetPrintableSize() const {
-    Size res;
-    for (int row = 0; row < static_cast<int>(sheet_.size()); ++row) {
-        for (int col = static_cast<int>(sheet_[row].size() - 1); col >= 0; --col) {
-            if (sheet_[row][col]) {
-                if (!sheet_[row][col]->GetText().empty()) {
-                    res.rows = std::max(res.rows, row + 1);
-                    res.cols = std::max(res.cols, col + 1);
-                    break;
-                }
-            }
+    return printable_size_;
+}
+
+void Sheet::UpdatePrintableSize(Position pos, bool was_empty, bool is_empty) {
+    if (was_empty == is_empty) {
+        return;
+    }
+    if (!is_empty) {
+        if (static_cast<int>(row_counts_.size()) <= pos.row) {
+            row_counts_.resize(pos.row + 1);
+        }
+        if (static_cast<int>(col_counts_.size()) <= pos.col) {
+            col_counts_.resize(pos.col + 1);
         }
+        ++row_counts_[pos.row];
+        ++col_counts_[pos.col];
+        printable_size_.rows = std::max(printable_size_.rows, pos.row + 1);
+        printable_size_.cols = std::max(printable_size_.cols, pos.col + 1);
+        return;
+    }
+    --row_counts_[pos.row];
+    --col_counts_[pos.col];
+    // shrink past the trailing rows and columns that became empty
+    while (printable_size_.rows > 0 && row_counts_[printable_size_.rows - 1] == 0) {
+        --printable_size_.rows;
+    }
+    while (printable_size_.cols > 0 && col_counts_[printable_size_.cols - 1] == 0) {
+        --printable_size_.cols;
+    }
+    if (printable_size_.rows == 0 || printable_size_.cols == 0) {
+        printable_size_ = {};
     }
-    return res;
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    Size size = GetPrintableSize();
-    for (int x = 0; x < size.rows; ++x) {
-        bool is_need_separator = false;
-        for (int y = 0; y < size.cols; ++y) {
-            if (is_need_separator) {
-                output << '\t';
+void Sheet::Recalculate() const {
+    std::lock_guard recalculate_lock(recalculate_mutex_);
+    Instrumentation::Timer timer(instrumentation_, Phase::RECALCULATION);
+    recalculating_ = true;
+    // pending_precedents[node] is the number of precedents of a pending cell
+    // that are still not evaluated, -1 for cells that are not pending
+    std::vector<int> pending_precedents(graph_.GetNodeIdBound(), -1);
+    std::vector<DependencyGraph::NodeId> pending;
+    // cells without a node reference nothing, so they can go first even if
+    // a range of some pending formula covers them
+    std::vector<const Cell*> isolated;
+    std::vector<Position> isolated_positions;
+    for (const Position& pos : dirty_cells_) {
+        const Cell* cell = cells_.Find(pos);
+        if (!cell || cell->IsCacheValid()) {
+            continue;
+        }
+        auto node = graph_.Find(pos);
+        if (!node) {
+            isolated.push_back(cell);
+            isolated_positions.push_back(pos);
+            continue;
+        }
+        if (pending_precedents[*node] < 0) {
+            pending_precedents[*node] = 0;
+            pending.push_back(*node);
+        }
+    }
+    dirty_cells_.clear();
+    // precedent_changed[node] is set once a formula the cell references got
+    // a new value, so a cell in CHECK has to be evaluated; the flags of a
+    // level are collected in `flags` and its results in `changed`
+    std::vector<uint8_t> precedent_changed(graph_.GetNodeIdBound(), 0);
+    std::vector<uint8_t> flags(isolated.size(), 0);
+    std::vector<uint8_t> changed;
+    RefreshCells(isolated, flags, changed);
+    // a cell without a node can still be covered by the range of a formula
+    for (size_t i = 0; i < isolated.size(); ++i) {
+        if (changed[i]) {
+            graph_.ForEachDependent(isolated_positions[i], [&precedent_changed](DependencyGraph::NodeId dependent) {
+                precedent_changed[dependent] = 1;
+            });
+        }
+    }
+
+    // Kahn's algorithm over the pending part of the graph, level by level
+    std::vector<DependencyGraph::NodeId> level;
+    // counted from the precedent side, the same way they are released below,
+    // because references through ranges are only known in that direction
+    for (DependencyGraph::NodeId node : pending) {
+        graph_.ForEachDependent(node, [&pending_precedents](DependencyGraph::NodeId dependent) {
+            if (pending_precedents[dependent] >= 0) {
+                ++pending_precedents[dependent];
             }
-            is_need_separator = true;
-            if ((y < static_cast<int>(sheet_.at(x).size())) && sheet_.at(x).at(y)) {
-                auto value = sheet_.at(x).at(y)->GetValue();
-                if (std::holds_alternative<std::string>(value)) {
-                    output << std::get<std::string>(value);
-                }
-                if (std::holds_alternative<double>(value)) {
-                    output << std::get<double>(value);
-                }
-                if (std::holds_alternative<FormulaError>(value)) {
-                    output << std::get<FormulaError>(value);
+        });
+    }
+    for (DependencyGraph::NodeId node : pending) {
+        if (pending_precedents[node] == 0) {
+            level.push_back(node);
+        }
+    }
+    std::vector<DependencyGraph::NodeId> next_level;
+    std::vector<const Cell*> level_cells;
+    while (!level.empty()) {
+        level_cells.clear();
+        flags.clear();
+        for (DependencyGraph::NodeId node : level) {
+            level_cells.push_back(cells_.Find(graph_.GetPosition(node)));
+            flags.push_back(precedent_changed[node]);
+        }
+        // all referenced formulas are cached by now, so this does not recurse
+        RefreshCells(level_cells, flags, changed);
+
+        next_level.clear();
+        for (size_t i = 0; i < level.size(); ++i) {
+            const DependencyGraph::NodeId node = level[i];
+            const uint8_t node_changed = changed[i];
+            pending_precedents[node] = -1;
+            graph_.ForEachDependent(node, [&](DependencyGraph::NodeId dependent) {
+                precedent_changed[dependent] |= node_changed;
+                if (pending_precedents[dependent] > 0 && --pending_precedents[dependent] == 0) {
+                    next_level.push_back(dependent);
                 }
+            });
+        }
+        std::swap(level, next_level);
+    }
+    recalculating_ = false;
+}
+
+void Sheet::RefreshCells(const std::vector<const Cell*>& cells, const std::vector<uint8_t>& precedent_changed,
+                         std::vector<uint8_t>& changed) const {
+    changed.assign(cells.size(), 0);
+    std::unique_lock pool_lock(thread_pool_mutex_, std::defer_lock);
+    if (!thread_pool_ || cells.size() < MIN_PARALLEL_LEVEL || !pool_lock.try_lock()) {
+        for (size_t i = 0; i < cells.size(); ++i) {
+            changed[i] = cells[i]->Refresh(precedent_changed[i]);
+        }
+        return;
+    }
+    // every cell stores only its own cache and reads the caches of cells
+    // from earlier levels, so the cells of a level don't wait for each other
+    const size_t grain = std::max<size_t>(64, cells.size() / (4 * GetThreadCount()));
+    thread_pool_->ParallelFor(cells.size(), grain, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            changed[i] = cells[i]->Refresh(precedent_changed[i]);
+        }
+    });
+}
+
+void Sheet::MarkDirty(Position pos) const {
+    dirty_cells_.push_back(pos);
+    if (dirty_cells_.size() >= dirty_cells_limit_) {
+        CompactDirtyCells();
+    }
+}
+
+void Sheet::CompactDirtyCells() const {
+    // drop cells evaluated on demand since they were marked and duplicates
+    dirty_cells_.erase(std::remove_if(dirty_cells_.begin(), dirty_cells_.end(), [this](Position pos) {
+        const Cell* cell = cells_.Find(pos);
+        return !cell || cell->IsCacheValid();
+    }), dirty_cells_.end());
+    std::sort(dirty_cells_.begin(), dirty_cells_.end());
+    dirty_cells_.erase(std::unique(dirty_cells_.begin(), dirty_cells_.end()), dirty_cells_.end());
+    dirty_cells_limit_ = std::max(MIN_DIRTY_CELLS_LIMIT, 2 * dirty_cells_.size());
+}
+
+void Sheet::GetValues(Position top_left, Size size, Span<Cell::ValueView> out) const {
+    if (!top_left.IsValid() || size.rows < 0 || size.cols < 0
+        || size.rows > Position::MAX_ROWS - top_left.row || size.cols > Position::MAX_COLS - top_left.col) {
+        throw InvalidPositionException("Invalid position!");
+    }
+    if (out.size() < static_cast<size_t>(size.rows) * static_cast<size_t>(size.cols)) {
+        throw std::invalid_argument("The buffer is too small for the area");
+    }
+    std::vector<const Cell*> stale;
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            const Cell* cell = cells_.Find({ top_left.row + row, top_left.col + col });
+            if (cell && !cell->IsCacheValid()) {
+                stale.push_back(cell);
             }
         }
-        output << '\n';
     }
+    EvaluateWithPrecedents(stale);
+    // only cached values are read from here on
+    size_t index = 0;
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col, ++index) {
+            const Cell* cell = cells_.Find({ top_left.row + row, top_left.col + col });
+            out[index] = cell ? cell->GetValueView() : Cell::ValueView();
+        }
+    }
+}
+
+void Sheet::EvaluateWithPrecedents(Span<const Cell* const> cells) const {
+    // Depth-first, a cell is evaluated when it comes to the top of the stack
+    // the second time, after everything pushed above it. A cell may be
+    // pushed more than once, but the copies that come up after it is
+    // evaluated are dropped; without cycles a cell cannot be above itself.
+    if (cells.empty()) {
+        return;
+    }
+    std::vector<std::pair<const Cell*, bool>> stack;
+    stack.reserve(cells.size());
+    size_t evaluations = 0;
+    size_t max_depth = 0;
+    for (size_t i = cells.size(); i > 0; --i) {
+        stack.push_back({ cells[i - 1], false });
+    }
+    const auto push_stale = [&stack](const Cell* cell) {
+        if (cell && !cell->IsCacheValid()) {
+            stack.push_back({ cell, false });
+        }
+    };
+    while (!stack.empty()) {
+        max_depth = std::max(max_depth, stack.size());
+        auto [cell, expanded] = stack.back();
+        if (cell->IsCacheValid()) {
+            stack.pop_back();
+            continue;
+        }
+        if (expanded) {
+            stack.pop_back();
+            // everything the formula references is cached, so this does
+            // not recurse
+            cell->UpdateCache();
+            ++evaluations;
+            continue;
+        }
+        stack.back().second = true;
+        for (const Position& ref : cell->GetReferencedCellsView()) {
+            push_stale(cells_.Find(ref));
+        }
+        for (const Range& range : cell->GetReferencedRanges()) {
+            cells_.ForEachInRange(range, [&push_stale](Position, const Cell& referenced) {
+                push_stale(&referenced);
+            });
+        }
+    }
+    instrumentation_.AddRead(evaluations, max_depth);
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    std::vector<char> buffer(PRINT_BUFFER_SIZE);
+    ExportValues(output, { buffer.data(), buffer.size() });
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-    Size size = GetPrintableSize();
-    for (int x = 0; x < size.rows; ++x) {
-        bool need_separator = false;
-        for (int y = 0; y < size.cols; ++y) {
-            if (need_separator) {
-                output << '\t';
-            }
-            need_separator = true;
-            if ((y < static_cast<int>(sheet_.at(x).size())) && sheet_.at(x).at(y)) {
-                output << sheet_.at(x).at(y)->GetText();
+    std::vector<char> buffer(PRINT_BUFFER_SIZE);
+    ExportTexts(output, { buffer.data(), buffer.size() });
+}
+
+void Sheet::ExportValues(std::ostream& output, Span<char> buffer) const {
+    // every formula has a cached value afterwards, so rendering only reads
+    // the cells and may run on several threads
+    Recalculate();
+    Export(output, buffer, &Cell::WriteValue);
+}
+
+void Sheet::ExportTexts(std::ostream& output, Span<char> buffer) const {
+    Export(output, buffer, &Cell::WriteText);
+}
+
+void Sheet::Export(std::ostream& output, Span<char> buffer, CellWriter write) const {
+    TsvWriter out(buffer, [&output](std::string_view text) {
+        output.write(text.data(), static_cast<std::streamsize>(text.size()));
+    });
+    const Size size = GetPrintableSize();
+    std::unique_lock pool_lock(thread_pool_mutex_, std::defer_lock);
+    if (GetThreadCount() == 1 || size.rows <= EXPORT_BLOCK_ROWS || !pool_lock.try_lock()) {
+        WriteRows(out, 0, size.rows, size.cols, write);
+        out.Flush();
+        return;
+    }
+
+    // blocks are rendered into strings a wave at a time, which bounds the
+    // memory held besides the output
+    const size_t block_count = (static_cast<size_t>(size.rows) + EXPORT_BLOCK_ROWS - 1) / EXPORT_BLOCK_ROWS;
+    const size_t wave_size = 4 * GetThreadCount();
+    std::vector<std::string> blocks(wave_size);
+    for (size_t first = 0; first < block_count; first += wave_size) {
+        const size_t count = std::min(wave_size, block_count - first);
+        thread_pool_->ParallelFor(count, 1, [&](size_t begin, size_t end) {
+            char block_buffer[4096];
+            for (size_t i = begin; i < end; ++i) {
+                std::string& block = blocks[i];
+                block.clear();
+                TsvWriter block_out({ block_buffer, sizeof(block_buffer) }, [&block](std::string_view text) {
+                    block.append(text);
+                });
+                const int begin_row = static_cast<int>(first + i) * EXPORT_BLOCK_ROWS;
+                WriteRows(block_out, begin_row, std::min(size.rows, begin_row + EXPORT_BLOCK_ROWS), size.cols, write);
+                block_out.Flush();
             }
+        });
+        for (size_t i = 0; i < count; ++i) {
+            out.Append(blocks[i]);
         }
-        output << '\n';
     }
+    out.Flush();
 }
 
+void Sheet::WriteRows(TsvWriter& out, int begin_row, int end_row, int cols, CellWriter write) const {
+    for (int x = begin_row; x < end_row; ++x) {
+        cells_.ForEachInRow(x, cols, [this, &out, write, x](int y, const Cell* cell) {
+            if (y > 0) {
+                out.Append('\t');
+            }
+            if (cell) {
+                (cell->*write)(out);
+            }
+            else if (write == &Cell::WriteValue && graph_.HasDependents({ x, y })) {
+                PlaceholderCell::Get().WriteValue(out);
+            }
+        });
+        out.Append('\n');
+    }
+}
+
+Sheet::CacheStatistics Sheet::GetCacheStatistics() const {
+    return { cache_hits_.load(), cache_misses_.load(), cache_recomputes_.load(),
+             cache_invalidated_, cache_cut_off_.load(), cache_unchanged_.load() };
+}
+
+void Sheet::ResetCacheStatistics() {
+    cache_hits_ = 0;
+    cache_misses_ = 0;
+    cache_recomputes_ = 0;
+    cache_invalidated_ = 0;
+    cache_cut_off_ = 0;
+    cache_unchanged_ = 0;
+}
+
+InstrumentationStatistics Sheet::GetInstrumentationStatistics() const {
+    return instrumentation_.GetStatistics();
+}
+
+void Sheet::ResetInstrumentation() {
+    instrumentation_.Reset();
+}
+
+void Sheet::CountCacheHit() const {
+    cache_hits_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Sheet::CountCacheMiss(bool is_recompute) const {
+    cache_misses_.fetch_add(1, std::memory_order_relaxed);
+    if (is_recompute) {
+        cache_recomputes_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Sheet::CountCutOff() const {
+    cache_cut_off_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Sheet::CountUnchangedRecompute() const {
+    cache_unchanged_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Sheet::SetThreadCount(size_t thread_count) {
+    if (thread_count == GetThreadCount()) {
+        return;
+    }
+    thread_pool_.reset();
+    if (thread_count > 1) {
+        thread_pool_ = std::make_unique<ThreadPool>(thread_count - 1);
+    }
+}
 
-bool Sheet::IsCell(Position pos) const {
-    return (pos.row < static_cast<int>(sheet_.size())) && (pos.col < static_cast<int>(sheet_.at(pos.row).size()));
+size_t Sheet::GetThreadCount() const {
+    return thread_pool_ ? thread_pool_->GetWorkerCount() + 1 : 1;
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -1,32 +1,280 @@
 #pragma once
 
 #include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "formula.h"
+#include "formula_table.h"
+#include "instrumentation.h"
+#include "numeric_columns.h"
+#include "persistent_grid.h"
+#include "span.h"
+#include "thread_pool.h"
+#include "tsv_writer.h"
 
+#include <atomic>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <set>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+class SheetSnapshot;
 
 class Sheet : public SheetInterface {
 public:
+    // Formula value cache counters. An edit marks the formulas depending on
+    // the edited cell stale; those that reference it directly are evaluated
+    // again, the others only if something they reference turns out to have a
+    // new value. Reset them before an edit to measure that edit.
+    struct CacheStatistics {
+        size_t hits = 0;        // value taken from the cache
+        size_t misses = 0;      // formula evaluated (including recomputes)
+        size_t recomputes = 0;  // formula evaluated again after invalidation
+        size_t invalidated = 0; // cached value marked stale by an edit
+        size_t cut_off = 0;     // stale value confirmed without evaluation
+        size_t unchanged = 0;   // recompute that gave the previous value
+    };
+
     ~Sheet() = default;
 
+    // Concurrent use. Any number of threads may read the sheet at once, each
+    // holding a ReadLock from LockForReading() for as long as it uses the
+    // sheet or the cells it returned: GetCell() and the CellInterface calls
+    // on the result, GetPrintableSize(), Print*(), Export*(), GetValues(),
+    // GetRangeNumbers(), Recalculate() and GetCacheStatistics(). A stale
+    // formula is evaluated by the first reader that needs it; others that
+    // need the same formula wait for it, readers of clean values never wait,
+    // not even for a Recalculate() in progress. Everything else changes the
+    // sheet and needs the WriteLock from LockForWriting(), which waits for
+    // the readers to finish and keeps new ones out meanwhile, so that it is
+    // not starved by readers that overlap. A sheet used from one thread at
+    // a time needs neither lock.
+    using ReadLock = std::shared_lock<std::shared_mutex>;
+    using WriteLock = std::unique_lock<std::shared_mutex>;
+    ReadLock LockForReading() const;
+    WriteLock LockForWriting() const;
+
+    // During a batch SetCell() and ClearCell() only validate the position
+    // and record the edit; GetCell() keeps returning the cells as they were.
     void SetCell(Position pos, std::string text) override;
 
+    // Positions that are only referenced by formulas hold no cell, just a
+    // node in the dependency graph, until some text is set there; for them
+    // GetCell() returns PlaceholderCell::Get(). Cleared cells are erased,
+    // an empty text never creates a cell.
     const CellInterface* GetCell(Position pos) const override;
 
     CellInterface* GetCell(Position pos) override;
 
+    // the cell stored at `pos`, nullptr for placeholders
     Cell* GetConcreteCell(Position pos) const;
 
+    DependencyGraph& GetDependencyGraph();
+    const DependencyGraph& GetDependencyGraph() const;
+
+    // compiled formulas shared by the cells of this sheet
+    FormulaTemplateCache& GetFormulaTemplates();
+    // formulas of the formula cells with their cached values
+    FormulaTable& GetFormulaTable();
+    const FormulaTable& GetFormulaTable() const;
+
     void ClearCell(Position pos) override;
 
+    // Starts recording edits instead of applying them, see CommitBatch().
+    // Throws std::logic_error if a batch is already open.
+    void BeginBatch();
+    // Applies the recorded edits as one change. The last edit of a position
+    // wins. All formulas are parsed, the dependency graph is rewired once
+    // and checked for cycles in a single pass over the cells reachable from
+    // the edits, and every affected cell is invalidated once. If a formula
+    // is invalid (FormulaException) or the edits create a cycle
+    // (CircularDependencyException), no cell is changed. The batch is closed
+    // either way. Throws std::logic_error if no batch is open.
+    void CommitBatch();
+    // Drops the recorded edits and closes the batch.
+    void CancelBatch();
+    bool IsInBatch() const {
+        return batch_.has_value();
+    }
+    // The edits applied in one batch.
+    void SetCells(const std::vector<std::pair<Position, std::string>>& edits);
+
+    // The cells as they are now, outside of an open batch, see
+    // SheetSnapshot. The first snapshot goes through all the cells; from
+    // then on every edit also updates the sources kept for snapshots, and
+    // taking one costs O(1). Takes the ReadLock in concurrent use.
+    std::shared_ptr<const SheetSnapshot> TakeSnapshot() const;
+
     Size GetPrintableSize() const override;
 
+    // both go through ExportTexts()/ExportValues() with an internal buffer
     void PrintTexts(std::ostream& output) const override;
     void PrintValues(std::ostream& output) const override;
 
+    // Write the same as PrintTexts()/PrintValues(), collecting the output in
+    // `buffer` (at least TsvWriter::MAX_NUMBER_LENGTH characters) and writing
+    // it to `output` whenever it is full. With more than one thread (see
+    // SetThreadCount) blocks of EXPORT_BLOCK_ROWS rows are rendered in
+    // parallel and written in order. ExportValues() calls Recalculate() first.
+    void ExportTexts(std::ostream& output, Span<char> buffer) const;
+    void ExportValues(std::ostream& output, Span<char> buffer) const;
+    static constexpr int EXPORT_BLOCK_ROWS = 256;
+
+    // Writes the values of the size.rows x size.cols cells starting at
+    // top_left to `out`, row by row (see Cell::ValueView; nothing for
+    // positions without text). Only the formulas in the area and those they
+    // depend on are evaluated, in dependency order without recursion; the
+    // other stale formulas stay stale. Texts point into the cells and stay
+    // valid until those cells are changed. Throws InvalidPositionException
+    // if the area leaves the sheet and std::invalid_argument if `out` holds
+    // fewer than size.rows * size.cols values.
+    void GetValues(Position top_left, Size size, Span<Cell::ValueView> out) const;
+
+    uint64_t GetCellsVersion() const override;
+    bool GetRangeNumbers(const Range& range, double* out) const override;
+
+    // numeric values of the cells, kept up to date by the cells themselves
+    NumericColumns& GetNumericColumns();
+    const NumericColumns& GetNumericColumns() const;
+
+    // Evaluates every formula cell whose cached value is stale. Cells are
+    // visited in topological order of the dependency graph, so each of them
+    // is evaluated once and only after all the formulas it references,
+    // without recursion through Formula::Evaluate; one whose references all
+    // kept their values keeps its own without being evaluated. PrintValues()
+    // does this first.
+    // Cells of one level of the order don't depend on each other; with more
+    // than one thread (see SetThreadCount) large levels are evaluated in
+    // parallel, and a level starts only after the previous one is stored.
+    void Recalculate() const;
+    // Number of threads used by Recalculate() and Export*(), including the
+    // calling one.
+    // 1 (the default) keeps recalculation single-threaded.
+    void SetThreadCount(size_t thread_count);
+    size_t GetThreadCount() const;
+    // remembers a formula cell whose cache was dropped, for Recalculate()
+    void MarkDirty(Position pos) const;
+    // Marks the caches of all formulas that depend on the `changed` cells,
+    // directly or not, stale. With `values_changed` the direct dependents
+    // have to be evaluated again; otherwise the changed cells are formulas
+    // that kept their previous values, see Cell::ValueChange.
+    void InvalidateDependents(Span<const Position> changed, bool values_changed = true);
+    // Recalculate() tells the dependents of a formula that got a new value
+    // only when it comes to them, so while it runs a formula in CHECK read
+    // by another thread cannot be confirmed by looking at its references
+    bool IsRecalculating() const {
+        return recalculating_.load();
+    }
+    // a formula at `pos` was evaluated to a new value: its dependents in
+    // CHECK become dirty; may run on the recalculation threads
+    void MarkDependentsChanged(Position pos) const;
+
+    // Evaluates the stale formulas among `cells` and everything they depend
+    // on, precedents first, so that no formula evaluates another one. Used
+    // for every formula read while stale.
+    void EvaluateWithPrecedents(Span<const Cell* const> cells) const;
+
+    CacheStatistics GetCacheStatistics() const;
+    void ResetCacheStatistics();
+
+    // Phase timings and counters of the hot paths, see instrumentation.h;
+    // all zero unless built with SPREADSHEET_INSTRUMENTATION.
+    InstrumentationStatistics GetInstrumentationStatistics() const;
+    void ResetInstrumentation();
+    const Instrumentation& GetInstrumentation() const {
+        return instrumentation_;
+    }
+
+    void CountCacheHit() const;
+    void CountCacheMiss(bool is_recompute) const;
+    void CountCutOff() const;
+    void CountUnchangedRecompute() const;
+
 private:
-    std::vector<std::vector<std::unique_ptr<Cell>>> sheet_ = {};
-    bool IsCell(Position pos) const;
+    // read and restore the cells directly, see snapshot.h
+    friend void SaveSnapshot(const Sheet& sheet, std::ostream& output, bool with_values);
+    friend std::unique_ptr<Sheet> LoadSnapshot(Span<const char> data);
+    friend class SheetSnapshot;
+
+    struct BatchEdit {
+        Position pos;
+        std::string text;
+        // recorded by ClearCell(), the cell is also erased
+        bool clear = false;
+    };
+
+    FormulaTemplateCache formula_templates_;
+    // declared before cells_, which release their formulas into it
+    FormulaTable formula_table_;
+    CellStorage cells_;
+    DependencyGraph graph_;
+    NumericColumns numeric_columns_;
+    // updated from the recalculation threads
+    mutable std::atomic<size_t> cache_hits_{ 0 };
+    mutable std::atomic<size_t> cache_misses_{ 0 };
+    mutable std::atomic<size_t> cache_recomputes_{ 0 };
+    size_t cache_invalidated_ = 0;
+    mutable std::atomic<size_t> cache_cut_off_{ 0 };
+    mutable std::atomic<size_t> cache_unchanged_{ 0 };
+    Instrumentation instrumentation_;
+    mutable std::shared_mutex mutex_;
+    // held by a writer while it waits for mutex_ and passed by every reader
+    // on the way to it
+    mutable std::mutex turnstile_;
+    // Recalculate() takes dirty_cells_ over, concurrent readers take turns
+    mutable std::mutex recalculate_mutex_;
+    mutable std::atomic<bool> recalculating_{ false };
+    // ParallelFor() must not be called concurrently; a reader that finds
+    // the pool busy does its work on its own thread
+    mutable std::mutex thread_pool_mutex_;
+    std::unique_ptr<ThreadPool> thread_pool_;
+    static constexpr size_t MIN_PARALLEL_LEVEL = 256;
+    // buffer of PrintTexts() and PrintValues()
+    static constexpr size_t PRINT_BUFFER_SIZE = 64 * 1024;
+    // formula cells that lost their cached value since the last
+    // Recalculate(), may contain duplicates and cells evaluated since
+    mutable std::vector<Position> dirty_cells_;
+    mutable size_t dirty_cells_limit_ = MIN_DIRTY_CELLS_LIMIT;
+    static constexpr size_t MIN_DIRTY_CELLS_LIMIT = 1024;
+
+    // number of cells with non-empty text in every row and column, used to
+    // keep printable_size_ up to date without scanning the sheet
+    std::vector<int> row_counts_;
+    std::vector<int> col_counts_;
+    Size printable_size_;
+
+    // edits recorded since BeginBatch()
+    std::optional<std::vector<BatchEdit>> batch_;
+
+    // the texts and formula programs of the cells, kept from the first
+    // TakeSnapshot() on; concurrent snapshots take turns
+    mutable std::optional<PersistentGrid> sources_;
+    mutable std::mutex sources_mutex_;
+
+    // Cell::WriteText or Cell::WriteValue
+    using CellWriter = void (Cell::*)(TsvWriter&) const;
+
+    void UpdatePrintableSize(Position pos, bool was_empty, bool is_empty);
+    // the cell at `pos` changed, nullptr if it is gone
+    void UpdateSource(Position pos, const Cell* cell);
+    // Add a cell to a sheet under construction without parsing, for
+    // LoadSnapshot() and SheetSnapshot; the references of the formula must
+    // be valid and create no cycle.
+    void RestoreTextCell(Position pos, std::string text);
+    void RestoreFormulaCell(Position pos, std::unique_ptr<FormulaInterface> formula,
+                            std::optional<CellInterface::Value> cache);
+    void Export(std::ostream& output, Span<char> buffer, CellWriter write) const;
+    void WriteRows(TsvWriter& out, int begin_row, int end_row, int cols, CellWriter write) const;
+    void CompactDirtyCells() const;
+
+    // Cell::Refresh() for every cell, in parallel for large levels
+    void RefreshCells(const std::vector<const Cell*>& cells, const std::vector<uint8_t>& precedent_changed,
+                      std::vector<uint8_t>& changed) const;
 };
@@ -0,0 +1,26 @@
+#include "sheet_snapshot.h"
+
+#include <utility>
+
+SheetSnapshot::SheetSnapshot(PersistentGrid sources)
+    : sources_(std::move(sources)) {
+}
+
+const Sheet& SheetSnapshot::GetSheet() const {
+    std::call_once(sheet_once_, [this] {
+        auto sheet = std::make_unique<Sheet>();
+        sheet->graph_.Reserve(sources_.GetSize());
+        // the sources come from a valid sheet: no cycles, no invalid
+        // references
+        sources_.ForEach([&sheet](Position pos, const CellSource& source) {
+            if (source.formula.ast) {
+                sheet->RestoreFormulaCell(pos, MakeFormula(source.formula), std::nullopt);
+            }
+            else {
+                sheet->RestoreTextCell(pos, source.text);
+            }
+        });
+        sheet_ = std::move(sheet);
+    });
+    return *sheet_;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "persistent_grid.h"
+#include "sheet.h"
+
+#include <memory>
+#include <mutex>
+
+// The cells of a sheet as they were when Sheet::TakeSnapshot() was called,
+// for consistent reads while the sheet keeps being edited. A snapshot shares
+// the cell texts and the formula programs with the sheet through a
+// PersistentGrid, so taking one does not copy the cells, and it may be used
+// on another thread than the sheet.
+//
+// The first GetSheet() builds a sheet of its own from the shared sources,
+// without parsing anything: its cells, dependency graph and formula values,
+// which are evaluated there again, on the thread that reads them.
+class SheetSnapshot {
+public:
+    explicit SheetSnapshot(PersistentGrid sources);
+    SheetSnapshot(const SheetSnapshot&) = delete;
+    SheetSnapshot& operator=(const SheetSnapshot&) = delete;
+
+    // Built once, also when called from several threads at a time; it can
+    // be read like any other sheet from then on, see Sheet::LockForReading.
+    const Sheet& GetSheet() const;
+
+    // number of non-empty cells
+    size_t GetCellCount() const {
+        return sources_.GetSize();
+    }
+
+private:
+    PersistentGrid sources_;
+    mutable std::once_flag sheet_once_;
+    mutable std::unique_ptr<Sheet> sheet_;
+};
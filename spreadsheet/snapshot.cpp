@@ -0,0 +1,576 @@
+#include "snapshot.h"
+
+#include "FormulaAST.h"
+#include "cell.h"
+#include "formula.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr char MAGIC[8] = { 'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P' };
+constexpr uint32_t FORMAT_VERSION = 1;
+// reads differently on a machine with another byte order
+constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+constexpr size_t ALIGNMENT = 8;
+
+// the arrays of a snapshot, in the order they are stored
+enum class Section : uint32_t {
+    Templates,     // TemplateRecord
+    Instructions,  // InstructionRecord, slices of it are the template programs
+    Numbers,       // double
+    Positions,     // PositionRecord, the cells of the templates
+    Ranges,        // RangeRecord
+    Cells,         // CellRecord, sorted by position
+    Texts,         // char, the texts of text cells
+    Count,
+};
+constexpr size_t SECTION_COUNT = static_cast<size_t>(Section::Count);
+
+struct SectionRecord {
+    uint64_t offset;  // from the beginning of the snapshot
+    uint64_t count;   // number of records
+};
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    SectionRecord sections[SECTION_COUNT];
+};
+
+struct PositionRecord {
+    int32_t row;
+    int32_t col;
+};
+
+struct RangeRecord {
+    PositionRecord top_left;
+    PositionRecord bottom_right;
+};
+
+struct InstructionRecord {
+    uint32_t op;
+    uint32_t arg;
+};
+
+// slices of the Instructions, Numbers, Positions and Ranges sections; the
+// positions are relative to the anchor of the formulas, like in FormulaAST
+struct TemplateRecord {
+    uint32_t program_begin;
+    uint32_t program_size;
+    uint32_t numbers_begin;
+    uint32_t numbers_size;
+    uint32_t cells_begin;
+    uint32_t cells_size;
+    uint32_t ranges_begin;
+    uint32_t ranges_size;
+};
+
+enum class CellKind : uint32_t {
+    Empty,
+    Text,
+    Formula,
+};
+
+enum class ValueKind : uint32_t {
+    None,    // not cached, evaluated by the next Recalculate()
+    Number,
+    Error,
+};
+
+struct CellRecord {
+    PositionRecord pos;
+    // formulas: the template and the position its cells are relative to
+    PositionRecord anchor;
+    uint32_t kind;
+    uint32_t template_index;
+    // texts: the slice of the Texts section
+    uint64_t text_offset;
+    uint32_t text_size;
+    // formulas: the cached value
+    uint32_t value_kind;
+    uint32_t error_category;
+    uint32_t reserved;
+    double number;
+};
+
+// indexed by Section
+constexpr size_t RECORD_SIZES[SECTION_COUNT] = {
+    sizeof(TemplateRecord), sizeof(InstructionRecord), sizeof(double), sizeof(PositionRecord),
+    sizeof(RangeRecord), sizeof(CellRecord), sizeof(char),
+};
+
+static_assert(sizeof(Header) % ALIGNMENT == 0 && sizeof(CellRecord) % ALIGNMENT == 0
+              && sizeof(TemplateRecord) % ALIGNMENT == 0 && sizeof(RangeRecord) % ALIGNMENT == 0);
+static_assert(std::is_trivially_copyable_v<Header> && std::is_trivially_copyable_v<CellRecord>);
+
+size_t AlignUp(size_t size) {
+    return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+PositionRecord ToRecord(Position pos) {
+    return { pos.row, pos.col };
+}
+
+Position FromRecord(PositionRecord record) {
+    return { record.row, record.col };
+}
+
+// Serializes the cells into the section arrays.
+class SnapshotWriter {
+public:
+    void AddCell(Position pos, const Cell& cell, bool with_values) {
+        CellRecord record{};
+        record.pos = ToRecord(pos);
+        if (const FormulaInterface* formula = cell.GetFormula()) {
+            const CompiledFormula compiled = GetCompiledFormula(*formula);
+            record.kind = static_cast<uint32_t>(CellKind::Formula);
+            record.anchor = ToRecord(compiled.anchor);
+            record.template_index = AddTemplate(*compiled.ast);
+            const auto cache = with_values ? cell.GetCachedValue() : std::nullopt;
+            if (cache && std::holds_alternative<double>(*cache)) {
+                record.value_kind = static_cast<uint32_t>(ValueKind::Number);
+                record.number = std::get<double>(*cache);
+            }
+            else if (cache) {
+                record.value_kind = static_cast<uint32_t>(ValueKind::Error);
+                record.error_category = static_cast<uint32_t>(std::get<FormulaError>(*cache).GetCategory());
+            }
+        }
+        else {
+            const std::string_view text = cell.GetTextView();
+            record.kind = static_cast<uint32_t>(text.empty() ? CellKind::Empty : CellKind::Text);
+            record.text_offset = texts_.size();
+            record.text_size = static_cast<uint32_t>(text.size());
+            texts_ += text;
+        }
+        cells_.push_back(record);
+    }
+
+    void Write(std::ostream& output) const {
+        Header header{};
+        std::copy(std::begin(MAGIC), std::end(MAGIC), header.magic);
+        header.version = FORMAT_VERSION;
+        header.byte_order = BYTE_ORDER_MARK;
+        const std::pair<const void*, size_t> sections[SECTION_COUNT] = {
+            Bytes(templates_), Bytes(instructions_), Bytes(numbers_), Bytes(positions_),
+            Bytes(ranges_), Bytes(cells_), { texts_.data(), texts_.size() },
+        };
+        size_t offset = sizeof(Header);
+        for (size_t i = 0; i < SECTION_COUNT; ++i) {
+            header.sections[i] = { offset, sections[i].second / RECORD_SIZES[i] };
+            offset += AlignUp(sections[i].second);
+        }
+
+        const char padding[ALIGNMENT] = {};
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const auto& [data, size] : sections) {
+            output.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+            output.write(padding, static_cast<std::streamsize>(AlignUp(size) - size));
+        }
+    }
+
+private:
+    template <typename T>
+    static std::pair<const void*, size_t> Bytes(const std::vector<T>& values) {
+        return { values.data(), values.size() * sizeof(T) };
+    }
+
+    uint32_t AddTemplate(const FormulaAST& ast) {
+        const auto [it, inserted] = template_indices_.emplace(&ast, static_cast<uint32_t>(templates_.size()));
+        if (!inserted) {
+            return it->second;
+        }
+        templates_.push_back({
+            static_cast<uint32_t>(instructions_.size()), static_cast<uint32_t>(ast.GetProgram().size()),
+            static_cast<uint32_t>(numbers_.size()), static_cast<uint32_t>(ast.GetNumbers().size()),
+            static_cast<uint32_t>(positions_.size()), static_cast<uint32_t>(ast.GetCells().size()),
+            static_cast<uint32_t>(ranges_.size()), static_cast<uint32_t>(ast.GetRanges().size()),
+        });
+        for (const ASTImpl::Instruction& instruction : ast.GetProgram()) {
+            instructions_.push_back({ static_cast<uint32_t>(instruction.op), instruction.arg });
+        }
+        numbers_.insert(numbers_.end(), ast.GetNumbers().begin(), ast.GetNumbers().end());
+        for (const Position cell : ast.GetCells()) {
+            positions_.push_back(ToRecord(cell));
+        }
+        for (const Range& range : ast.GetRanges()) {
+            ranges_.push_back({ ToRecord(range.top_left), ToRecord(range.bottom_right) });
+        }
+        return it->second;
+    }
+
+    std::vector<TemplateRecord> templates_;
+    std::vector<InstructionRecord> instructions_;
+    std::vector<double> numbers_;
+    std::vector<PositionRecord> positions_;
+    std::vector<RangeRecord> ranges_;
+    std::vector<CellRecord> cells_;
+    std::string texts_;
+    // templates shared by several cells are stored once
+    std::unordered_map<const FormulaAST*, uint32_t> template_indices_;
+};
+
+// Bounds-checked access to the sections of a snapshot. Records are copied
+// out, so the data needs no particular alignment.
+class SnapshotReader {
+public:
+    explicit SnapshotReader(Span<const char> data)
+        : data_(data) {
+        if (data_.size() < sizeof(Header)) {
+            throw SnapshotError("Snapshot is truncated");
+        }
+        std::memcpy(&header_, data_.data(), sizeof(Header));
+        if (!std::equal(std::begin(MAGIC), std::end(MAGIC), header_.magic)) {
+            throw SnapshotError("Not a sheet snapshot");
+        }
+        if (header_.byte_order != BYTE_ORDER_MARK) {
+            throw SnapshotError("Snapshot has another byte order");
+        }
+        if (header_.version != FORMAT_VERSION) {
+            throw SnapshotError("Unsupported snapshot version " + std::to_string(header_.version));
+        }
+        for (size_t i = 0; i < SECTION_COUNT; ++i) {
+            const SectionRecord& section = header_.sections[i];
+            // with the padding, so that a truncated snapshot is never accepted
+            if (section.offset % ALIGNMENT != 0 || section.offset > data_.size()
+                || section.count > (data_.size() - section.offset) / RECORD_SIZES[i]
+                || AlignUp(section.count * RECORD_SIZES[i]) > data_.size() - section.offset) {
+                throw SnapshotError("Snapshot section is out of bounds");
+            }
+        }
+    }
+
+    size_t GetCount(Section section) const {
+        return static_cast<size_t>(header_.sections[static_cast<size_t>(section)].count);
+    }
+
+    template <typename T>
+    T Get(Section section, size_t index) const {
+        T record;
+        const char* begin = data_.data() + header_.sections[static_cast<size_t>(section)].offset;
+        std::memcpy(&record, begin + index * sizeof(T), sizeof(T));
+        return record;
+    }
+
+    // throws unless [begin, begin + size) is inside the section
+    void CheckSlice(Section section, uint64_t begin, uint64_t size) const {
+        if (begin > GetCount(section) || size > GetCount(section) - begin) {
+            throw SnapshotError("Snapshot record is out of bounds");
+        }
+    }
+
+    std::string_view GetText(uint64_t offset, uint32_t size) const {
+        CheckSlice(Section::Texts, offset, size);
+        return { data_.data() + header_.sections[static_cast<size_t>(Section::Texts)].offset + offset, size };
+    }
+
+private:
+    Span<const char> data_;
+    Header header_;
+};
+
+// The evaluation stack of `program` must hold single values and the
+// (partial, count) pairs of function arguments where FormulaAST expects
+// them, and every argument must index the arrays of its template.
+bool IsValidProgram(const std::vector<ASTImpl::Instruction>& program, size_t numbers_size,
+                    size_t cells_size, size_t ranges_size) {
+    using ASTImpl::Instruction;
+    using Op = Instruction::Op;
+    // true for a pair
+    std::vector<bool> stack;
+    auto pop_value = [&stack] {
+        if (stack.empty() || stack.back()) {
+            return false;
+        }
+        stack.pop_back();
+        return true;
+    };
+    for (const Instruction& instruction : program) {
+        switch (instruction.op) {
+        case Op::PushNumber:
+        case Op::LoadCell:
+            if (instruction.arg >= (instruction.op == Op::PushNumber ? numbers_size : cells_size)) {
+                return false;
+            }
+            stack.push_back(false);
+            break;
+        case Op::Add:
+        case Op::Subtract:
+        case Op::Multiply:
+        case Op::Divide:
+            if (!pop_value() || !pop_value()) {
+                return false;
+            }
+            stack.push_back(false);
+            break;
+        case Op::UnaryPlus:
+        case Op::UnaryMinus:
+            if (!pop_value()) {
+                return false;
+            }
+            stack.push_back(false);
+            break;
+        case Op::ScalarArgument:
+            if (!pop_value()) {
+                return false;
+            }
+            stack.push_back(true);
+            break;
+        case Op::RangeSum:
+        case Op::RangeMin:
+        case Op::RangeMax:
+            if (instruction.arg >= ranges_size) {
+                return false;
+            }
+            stack.push_back(true);
+            break;
+        case Op::Sum:
+        case Op::Average:
+        case Op::Min:
+        case Op::Max:
+            if (instruction.arg == 0 || instruction.arg > stack.size()
+                || !std::all_of(stack.end() - instruction.arg, stack.end(), [](bool pair) { return pair; })) {
+                return false;
+            }
+            stack.resize(stack.size() - instruction.arg);
+            stack.push_back(false);
+            break;
+        default:
+            return false;
+        }
+    }
+    return stack.size() == 1 && !stack.back();
+}
+
+// offsets of template cells from their anchors, so translating them cannot
+// overflow; compared without std::abs, which overflows on INT_MIN
+bool IsValidOffset(Position offset) {
+    return offset.row > -Position::MAX_ROWS && offset.row < Position::MAX_ROWS
+        && offset.col > -Position::MAX_COLS && offset.col < Position::MAX_COLS;
+}
+
+std::vector<std::shared_ptr<const FormulaAST>> LoadTemplates(const SnapshotReader& reader) {
+    std::vector<std::shared_ptr<const FormulaAST>> templates(reader.GetCount(Section::Templates));
+    std::vector<ASTImpl::Instruction> program;
+    std::vector<double> numbers;
+    std::vector<Position> cells;
+    std::vector<Range> ranges;
+    for (size_t i = 0; i < templates.size(); ++i) {
+        const auto record = reader.Get<TemplateRecord>(Section::Templates, i);
+        reader.CheckSlice(Section::Instructions, record.program_begin, record.program_size);
+        reader.CheckSlice(Section::Numbers, record.numbers_begin, record.numbers_size);
+        reader.CheckSlice(Section::Positions, record.cells_begin, record.cells_size);
+        reader.CheckSlice(Section::Ranges, record.ranges_begin, record.ranges_size);
+
+        program.clear();
+        for (uint32_t j = 0; j < record.program_size; ++j) {
+            const auto instruction = reader.Get<InstructionRecord>(Section::Instructions, record.program_begin + j);
+            program.push_back({ static_cast<ASTImpl::Instruction::Op>(instruction.op), instruction.arg });
+        }
+        numbers.clear();
+        for (uint32_t j = 0; j < record.numbers_size; ++j) {
+            numbers.push_back(reader.Get<double>(Section::Numbers, record.numbers_begin + j));
+        }
+        cells.clear();
+        for (uint32_t j = 0; j < record.cells_size; ++j) {
+            cells.push_back(FromRecord(reader.Get<PositionRecord>(Section::Positions, record.cells_begin + j)));
+        }
+        ranges.clear();
+        for (uint32_t j = 0; j < record.ranges_size; ++j) {
+            const auto range = reader.Get<RangeRecord>(Section::Ranges, record.ranges_begin + j);
+            ranges.push_back({ FromRecord(range.top_left), FromRecord(range.bottom_right) });
+        }
+
+        const bool valid_offsets = std::all_of(cells.begin(), cells.end(), IsValidOffset)
+            && std::all_of(ranges.begin(), ranges.end(), [](const Range& range) {
+                   return IsValidOffset(range.top_left) && IsValidOffset(range.bottom_right);
+               });
+        if (!valid_offsets || !IsValidProgram(program, numbers.size(), cells.size(), ranges.size())) {
+            throw SnapshotError("Snapshot has an invalid formula program");
+        }
+        templates[i] = std::make_shared<const FormulaAST>(program, numbers, cells, ranges);
+    }
+    return templates;
+}
+
+std::optional<CellInterface::Value> LoadCachedValue(const CellRecord& record) {
+    switch (static_cast<ValueKind>(record.value_kind)) {
+    case ValueKind::None:
+        return std::nullopt;
+    case ValueKind::Number:
+        // formulas cache non-finite results as #ARITHM!
+        if (!std::isfinite(record.number)) {
+            break;
+        }
+        return record.number;
+    case ValueKind::Error:
+        if (record.error_category > static_cast<uint32_t>(FormulaError::Category::Arithmetic)) {
+            break;
+        }
+        return FormulaError(static_cast<FormulaError::Category>(record.error_category));
+    }
+    throw SnapshotError("Snapshot has an invalid cell value");
+}
+
+}  // namespace
+
+void SaveSnapshot(const Sheet& sheet, std::ostream& output, bool with_values) {
+    std::vector<std::pair<Position, const Cell*>> cells;
+    sheet.cells_.ForEachCell([&cells](Position pos, const Cell& cell) {
+        cells.emplace_back(pos, &cell);
+    });
+    // the order of blocks in the storage is arbitrary
+    std::sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    SnapshotWriter writer;
+    for (const auto& [pos, cell] : cells) {
+        writer.AddCell(pos, *cell, with_values);
+    }
+    writer.Write(output);
+    if (!output) {
+        throw SnapshotError("Cannot write the snapshot");
+    }
+}
+
+void SaveSnapshotFile(const Sheet& sheet, const std::string& path, bool with_values) {
+    std::ofstream output(path, std::ios::binary | std::ios::trunc);
+    if (!output) {
+        throw SnapshotError("Cannot open " + path);
+    }
+    SaveSnapshot(sheet, output, with_values);
+    output.close();
+    if (!output) {
+        throw SnapshotError("Cannot write " + path);
+    }
+}
+
+std::unique_ptr<Sheet> LoadSnapshot(Span<const char> data) {
+    const SnapshotReader reader(data);
+    const auto templates = LoadTemplates(reader);
+
+    auto sheet = std::make_unique<Sheet>();
+    // the nodes of the graph are the formulas and the positions they
+    // reference, saved or empty; a position referenced by several formulas
+    // is counted for each, so this is an upper bound
+    size_t node_count = 0;
+    for (size_t i = 0; i < reader.GetCount(Section::Cells); ++i) {
+        const auto record = reader.Get<CellRecord>(Section::Cells, i);
+        if (static_cast<CellKind>(record.kind) == CellKind::Formula && record.template_index < templates.size()) {
+            node_count += 1 + templates[record.template_index]->GetCells().size();
+        }
+    }
+    sheet->graph_.Reserve(node_count);
+    std::vector<Position> formula_cells;
+    for (size_t i = 0; i < reader.GetCount(Section::Cells); ++i) {
+        const auto record = reader.Get<CellRecord>(Section::Cells, i);
+        const Position pos = FromRecord(record.pos);
+        if (!pos.IsValid() || sheet->cells_.Find(pos)) {
+            throw SnapshotError("Snapshot has an invalid cell position");
+        }
+
+        std::unique_ptr<FormulaInterface> formula;
+        std::string text;
+        switch (static_cast<CellKind>(record.kind)) {
+        case CellKind::Empty:
+        case CellKind::Text:
+            text = reader.GetText(record.text_offset, record.text_size);
+            if (text.empty() != (static_cast<CellKind>(record.kind) == CellKind::Empty)
+                || (text.size() > 1 && text[0] == FORMULA_SIGN)) {
+                throw SnapshotError("Snapshot has an invalid cell text");
+            }
+            break;
+        case CellKind::Formula: {
+            const Position anchor = FromRecord(record.anchor);
+            if (record.template_index >= templates.size() || !anchor.IsValid()) {
+                throw SnapshotError("Snapshot has an invalid formula");
+            }
+            formula = MakeFormula({ templates[record.template_index], anchor });
+            break;
+        }
+        default:
+            throw SnapshotError("Snapshot has an invalid cell kind");
+        }
+
+        if (!formula) {
+            sheet->RestoreTextCell(pos, std::move(text));
+            continue;
+        }
+        const auto references = formula->GetReferencedCellsView();
+        const auto ranges = formula->GetReferencedRanges();
+        const bool valid_references = std::all_of(references.begin(), references.end(), [](Position cell) {
+            return cell.IsValid();
+        }) && std::all_of(ranges.begin(), ranges.end(), [](const Range& range) {
+            return range.IsValid();
+        });
+        if (!valid_references) {
+            throw SnapshotError("Snapshot has a formula with an invalid reference");
+        }
+        sheet->RestoreFormulaCell(pos, std::move(formula), LoadCachedValue(record));
+        formula_cells.push_back(pos);
+    }
+
+    if (sheet->graph_.HasCycleThrough(formula_cells)) {
+        throw SnapshotError("Snapshot has a circular dependency");
+    }
+    return sheet;
+}
+
+std::unique_ptr<Sheet> LoadSnapshotFile(const std::string& path) {
+#if defined(__unix__) || defined(__APPLE__)
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat info {};
+        void* mapped = MAP_FAILED;
+        size_t size = 0;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            size = static_cast<size_t>(info.st_size);
+            mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (mapped != MAP_FAILED) {
+            // the records are read once, front to back
+            madvise(mapped, size, MADV_SEQUENTIAL);
+            struct Unmap {
+                void* data;
+                size_t size;
+                ~Unmap() {
+                    munmap(data, size);
+                }
+            } unmap{ mapped, size };
+            return LoadSnapshot({ static_cast<const char*>(mapped), size });
+        }
+    }
+#endif
+    // no mapping: empty files, pipes or another platform
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        throw SnapshotError("Cannot open " + path);
+    }
+    std::vector<char> data;
+    char buffer[64 * 1024];
+    while (input.read(buffer, sizeof(buffer)) || input.gcount() > 0) {
+        data.insert(data.end(), buffer, buffer + input.gcount());
+    }
+    return LoadSnapshot(data);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "sheet.h"
+#include "span.h"
+
+#include <iosfwd>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+// Binary snapshots of a sheet, for restarting without replaying every cell
+// text through the formula parser.
+//
+// A snapshot is a header followed by 8-byte aligned arrays of fixed-size
+// records: the compiled formula programs (each stored once, however many
+// cells share it, see FormulaTemplateCache), their numbers, cells and
+// ranges, one record per cell and a pool of cell texts. Formulas are
+// restored from their programs; the dependency graph is rebuilt from the
+// references of the programs, which are the graph's edges. Formula values
+// cached when the snapshot was saved may be stored too, the other formulas
+// are left for Recalculate().
+//
+// Records are written in the byte order of the machine; a snapshot from a
+// machine with another byte order or another format version is rejected.
+class SnapshotError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+void SaveSnapshot(const Sheet& sheet, std::ostream& output, bool with_values = true);
+void SaveSnapshotFile(const Sheet& sheet, const std::string& path, bool with_values = true);
+
+// Throws SnapshotError if `data` is not a valid snapshot. Nothing keeps
+// referencing `data` afterwards.
+std::unique_ptr<Sheet> LoadSnapshot(Span<const char> data);
+// Memory-maps the file where the platform allows it and reads it otherwise.
+std::unique_ptr<Sheet> LoadSnapshotFile(const std::string& path);
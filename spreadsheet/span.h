@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+// Non-owning view of a contiguous array, a small stand-in for C++20
+// std::span. The viewed elements must outlive the span.
+template <typename T>
+class Span {
+public:
+    Span() = default;
+    Span(T* data, size_t size)
+        : data_(data), size_(size) {
+    }
+    template <typename U, typename Alloc>
+    Span(const std::vector<U, Alloc>& values)
+        : data_(values.data()), size_(values.size()) {
+    }
+
+    T* data() const {
+        return data_;
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    T* begin() const {
+        return data_;
+    }
+    T* end() const {
+        return data_ + size_;
+    }
+
+    T& operator[](size_t index) const {
+        return data_[index];
+    }
+    T& front() const {
+        return data_[0];
+    }
+    T& back() const {
+        return data_[size_ - 1];
+    }
+
+    std::vector<std::remove_const_t<T>> ToVector() const {
+        return { begin(), end() };
+    }
+
+private:
+    T* data_ = nullptr;
+    size_t size_ = 0;
+};
@@ -1,6 +1,7 @@
 #include "common.h"
 
 #include <cctype>
+#include <charconv>
 #include <sstream>
 #include <algorithm>
 
@@ -58,9 +59,10 @@ Position Position::FromString(std::string_view str) {
         return Position::NONE;
     }
 
+    // from_chars does not allocate, unlike a temporary istringstream
     int row;
-    std::istringstream row_in{ std::string{digits} };
-    if (!(row_in >> row) || !row_in.eof()) {
+    const auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), row);
+    if (error != std::errc() || end != digits.data() + digits.size()) {
         return Position::NONE;
     }
 
@@ -73,6 +75,66 @@ Position Position::FromString(std::string_view str) {
     return { row - 1, col - 1 };
 }
 
+bool Range::operator==(const Range& rhs) const {
+    return top_left == rhs.top_left && bottom_right == rhs.bottom_right;
+}
+
+bool Range::IsValid() const {
+    return top_left.IsValid() && bottom_right.IsValid()
+        && top_left.row <= bottom_right.row && top_left.col <= bottom_right.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= top_left.row && pos.row <= bottom_right.row
+        && pos.col >= top_left.col && pos.col <= bottom_right.col;
+}
+
+size_t Range::GetCellCount() const {
+    return static_cast<size_t>(bottom_right.row - top_left.row + 1)
+        * static_cast<size_t>(bottom_right.col - top_left.col + 1);
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    return top_left.ToString() + ':' + bottom_right.ToString();
+}
+
+Range Range::FromCorners(Position first, Position second) {
+    return { { std::min(first.row, second.row), std::min(first.col, second.col) },
+             { std::max(first.row, second.row), std::max(first.col, second.col) } };
+}
+
+std::optional<double> ParseCellText(std::string_view text) {
+    if (text.empty() || !std::all_of(text.begin(), text.end(), [](char ch) {
+            return std::isdigit(static_cast<unsigned char>(ch)) || ch == '.';
+        })) {
+        return std::nullopt;
+    }
+    // like strtod, a valid prefix is enough: "1.5.2" is 1.5
+    double number = 0;
+    const auto result = std::from_chars(text.data(), text.data() + text.size(), number);
+    if (result.ec != std::errc()) {
+        return std::nullopt;
+    }
+    return number;
+}
+
+CellInterface::NumericValue CellInterface::GetNumericValue() const {
+    auto value = GetValue();
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    if (std::holds_alternative<std::string>(value)) {
+        if (auto number = ParseCellText(std::get<std::string>(value))) {
+            return *number;
+        }
+        return FormulaError(FormulaError::Category::Value);
+    }
+    return std::get<FormulaError>(value);
+}
+
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
\ No newline at end of file
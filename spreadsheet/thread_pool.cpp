@@ -0,0 +1,120 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+ThreadPool::ThreadPool(size_t worker_count) {
+    for (size_t i = 0; i <= worker_count; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    workers_.reserve(worker_count);
+    for (size_t i = 0; i < worker_count; ++i) {
+        workers_.emplace_back([this, i] { WorkerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t grain, const RangeTask& task) {
+    if (count == 0) {
+        return;
+    }
+    grain = std::max<size_t>(grain, 1);
+    const size_t self = workers_.size();
+    const size_t chunks = (count + grain - 1) / grain;
+    if (workers_.empty() || chunks == 1) {
+        task(0, count);
+        return;
+    }
+
+    {
+        std::lock_guard lock(mutex_);
+        task_ = &task;
+        error_ = nullptr;
+        remaining_ = chunks;
+        // deal the chunks round-robin so neighbours land on different threads
+        for (size_t chunk = 0; chunk < chunks; ++chunk) {
+            Queue& queue = *queues_[chunk % queues_.size()];
+            std::lock_guard queue_lock(queue.mutex);
+            queue.ranges.push_back({ chunk * grain, std::min(count, (chunk + 1) * grain) });
+        }
+        ++generation_;
+    }
+    wake_.notify_all();
+
+    while (RunOne(self)) {
+    }
+
+    std::unique_lock lock(mutex_);
+    done_.wait(lock, [this] { return remaining_ == 0; });
+    task_ = nullptr;
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+void ThreadPool::WorkerLoop(size_t self) {
+    size_t seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock lock(mutex_);
+            wake_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+            if (stop_) {
+                return;
+            }
+            seen_generation = generation_;
+        }
+        while (RunOne(self)) {
+        }
+    }
+}
+
+bool ThreadPool::RunOne(size_t self) {
+    Range range;
+    bool found = false;
+    {
+        Queue& own = *queues_[self];
+        std::lock_guard lock(own.mutex);
+        if (!own.ranges.empty()) {
+            range = own.ranges.front();
+            own.ranges.pop_front();
+            found = true;
+        }
+    }
+    for (size_t i = 1; !found && i < queues_.size(); ++i) {
+        Queue& victim = *queues_[(self + i) % queues_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.ranges.empty()) {
+            range = victim.ranges.back();
+            victim.ranges.pop_back();
+            found = true;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+
+    try {
+        (*task_)(range.begin, range.end);
+    }
+    catch (...) {
+        std::lock_guard lock(mutex_);
+        if (!error_) {
+            error_ = std::current_exception();
+        }
+    }
+    if (--remaining_ == 0) {
+        std::lock_guard lock(mutex_);
+        done_.notify_all();
+    }
+    return true;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size work-stealing thread pool for data-parallel loops.
+// ParallelFor() splits the index range into chunks and deals them to
+// per-thread queues; every thread takes chunks from the front of its own
+// queue and, once it is empty, steals from the back of the others. The
+// calling thread takes part in the work, so a pool with N workers runs the
+// loop on N + 1 threads. Everything written by the chunks is visible to the
+// caller when ParallelFor() returns.
+class ThreadPool {
+public:
+    using RangeTask = std::function<void(size_t begin, size_t end)>;
+
+    explicit ThreadPool(size_t worker_count);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+
+    size_t GetWorkerCount() const {
+        return workers_.size();
+    }
+
+    // Calls task(begin, end) for consecutive chunks of at most `grain`
+    // indices covering [0, count) and waits for all of them. The first
+    // exception thrown by a chunk is rethrown here. Must not be called
+    // concurrently or from inside a task.
+    void ParallelFor(size_t count, size_t grain, const RangeTask& task);
+
+private:
+    struct Range {
+        size_t begin = 0;
+        size_t end = 0;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Range> ranges;
+    };
+
+    void WorkerLoop(size_t self);
+    // runs one chunk from the own queue or a stolen one, false if none left
+    bool RunOne(size_t self);
+
+    std::vector<std::thread> workers_;
+    // one queue per worker plus the last one for the calling thread
+    std::vector<std::unique_ptr<Queue>> queues_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const RangeTask* task_ = nullptr;
+    std::atomic<size_t> remaining_{ 0 };
+    size_t generation_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_;
+};
@@ -0,0 +1,43 @@
+#include "tsv_writer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <stdexcept>
+#include <utility>
+
+TsvWriter::TsvWriter(Span<char> buffer, Sink sink)
+    : buffer_(buffer), sink_(std::move(sink)) {
+    if (buffer_.size() < MAX_NUMBER_LENGTH) {
+        throw std::invalid_argument("TsvWriter buffer is too small");
+    }
+}
+
+void TsvWriter::Append(std::string_view text) {
+    if (text.size() > buffer_.size() - size_) {
+        Flush();
+        if (text.size() > buffer_.size()) {
+            sink_(text);
+            return;
+        }
+    }
+    std::copy(text.begin(), text.end(), buffer_.data() + size_);
+    size_ += text.size();
+}
+
+void TsvWriter::AppendNumber(double value) {
+    if (buffer_.size() - size_ < MAX_NUMBER_LENGTH) {
+        Flush();
+    }
+    char* begin = buffer_.data() + size_;
+    const auto [end, error] = std::to_chars(begin, begin + MAX_NUMBER_LENGTH, value, std::chars_format::general, 6);
+    assert(error == std::errc());
+    size_ += static_cast<size_t>(end - begin);
+}
+
+void TsvWriter::Flush() {
+    if (size_ > 0) {
+        sink_({ buffer_.data(), size_ });
+        size_ = 0;
+    }
+}
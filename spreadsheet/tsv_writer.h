@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+#include "span.h"
+
+#include <cstddef>
+#include <functional>
+#include <string_view>
+
+// Buffered writer of tab-separated cell contents. Everything is collected in
+// a caller-supplied buffer which is handed to the sink whenever it fills up
+// and on Flush(); pieces larger than the buffer go to the sink directly.
+// Numbers are formatted with std::to_chars the way an output stream with
+// the default flags prints them (%g with 6 significant digits), without
+// locale lookups.
+class TsvWriter {
+public:
+    using Sink = std::function<void(std::string_view)>;
+
+    // longest number AppendNumber() writes, e.g. "-1.23457e-308"
+    static constexpr size_t MAX_NUMBER_LENGTH = 32;
+
+    // `buffer` must hold at least MAX_NUMBER_LENGTH characters, throws
+    // std::invalid_argument otherwise
+    TsvWriter(Span<char> buffer, Sink sink);
+    TsvWriter(const TsvWriter&) = delete;
+    TsvWriter& operator=(const TsvWriter&) = delete;
+
+    void Append(std::string_view text);
+    void Append(char ch) {
+        if (size_ == buffer_.size()) {
+            Flush();
+        }
+        buffer_[size_++] = ch;
+    }
+    void AppendNumber(double value);
+    void AppendError(FormulaError error) {
+        Append(error.ToString());
+    }
+
+    // hands the buffered characters to the sink; the owner has to call it
+    // after the last Append(), nothing is flushed on destruction
+    void Flush();
+
+private:
+    Span<char> buffer_;
+    size_t size_ = 0;
+    Sink sink_;
+};